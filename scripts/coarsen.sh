@@ -0,0 +1,29 @@
+#!/bin/bash -e
+
+# usage: coarsen.sh RUN2_SCRIPT ARGS...
+# e.g. COARSEN="1 2 4 8" coarsen.sh ./run2_vulkan.sh shaders/shader.comp 512 512 1
+# runs the workgroup size sweep with every thread coarsening factor of COARSEN=
+# (default 1 2 4 8) and prints the throughput in pixels per microsecond of each
+# factor next to each other, for every workgroup size
+
+factors=$(echo ${COARSEN:-1 2 4 8} | tr , ' ')
+# both run2 scripts end with the image size
+pixels=$((${@: -3:1} * ${@: -2:1} * ${@: -1:1}))
+
+COARSEN="$factors" "$@"
+
+columns=
+for c in $factors; do
+	columns="$columns,
+		printf('%.1f', $pixels * 1000.0 / avg(case when coarsen = $c then time_ms end)) as px_per_us_c$c"
+done
+
+csv-merge -N run -p runtime.csv |
+csv-sqlite -T \
+	"select x,
+		y,
+		z,
+		variant$columns
+	   from run
+	  group by x, y, z, variant
+	  order by variant, x * y * z, x, y" -s
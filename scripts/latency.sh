@@ -0,0 +1,32 @@
+#!/bin/bash -e
+
+# usage: latency.sh [INSTRUMENT_CSV]
+# histograms of the latency of the workgroups and of the subgroups (their last end_clock
+# minus their first start_clock) in instrument.csv of an INSTRUMENT=1 run (see
+# run_vulkan.sh), in buckets of BUCKET= cycles (default 1000), with how many invocations
+# they had and their lane efficiency: the iterations of all invocations over the ones
+# the slowest ran, times the invocations, which is what divergence costs
+file=${1:-instrument.csv}
+bucket=${BUCKET:-1000}
+
+for level in workgroup subgroup; do
+	case $level in
+		workgroup) key="workgroup" ;;
+		subgroup)  key="workgroup, subgroup" ;;
+	esac
+
+	echo "$level latency:"
+	csv-merge -N sample -p "$file" |
+	csv-sqlite -T \
+		"select latency_cycles,
+			count(*) as ${level}s,
+			printf('%.1f', avg(invocations)) as invocations,
+			printf('%.1f', avg(efficiency)) as lane_efficiency_pct
+		   from (select cast((max(end_clock) - min(start_clock)) / $bucket as int) * $bucket as latency_cycles,
+				count(*) as invocations,
+				100.0 * sum(iterations) / (max(iterations) * count(*)) as efficiency
+			   from sample
+			  group by $key)
+		  group by latency_cycles
+		  order by latency_cycles" -s
+done
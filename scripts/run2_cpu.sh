@@ -0,0 +1,49 @@
+#!/bin/bash -e
+
+# usage: run2_cpu.sh WIDTH HEIGHT DEPTH
+# the workgroup size sweep of run2_vulkan.sh on the CPU reference, with the per-thread
+# busy time of every configuration in cpu_runtime.csv
+# with VARIANTS= and COARSEN= (see run_vulkan.sh) every workgroup size is run with each
+# variant and coarsening factor
+
+echo "x:int,y:int,z:int,time_ms:int,threads:int,invocations:int,simd:int,thread_occupancy_pct:int,cpu_time_ns:int,variant:string,coarsen:int" | tee runtime.csv
+
+configs=
+for x in 1 2 4 8 16 32 64 128 256 512; do
+	for y in 1 2 4 8 16 32 64 128 256 512; do
+		for z in 1 2 4 8 16 32 64; do
+			sz=$(($x * $y * $z))
+			if [ $sz -le 1792 ]; then
+				configs="$configs $x $y $z"
+			fi
+		done
+	done
+done
+
+./run_cpu.sh $1 $2 $3 $configs
+cat stats.csv | csv-header -m | tee -a runtime.csv
+cp cpu_threads.csv cpu_runtime.csv
+
+dims=${1}x${2}x${3}
+variants=$(echo ${VARIANTS:-bruteforce} | tr , ' ')
+if [ $(echo $variants | wc -w) -eq 1 ]; then
+	prefixes=_
+else
+	prefixes=$(for v in $variants; do echo _${v}_; done)
+fi
+factors=$(echo ${COARSEN:-1} | tr , ' ')
+if [ $(echo $factors | wc -w) -gt 1 ]; then
+	prefixes=$(for p in $prefixes; do for c in $factors; do echo ${p}c${c}_; done; done)
+fi
+for p in $prefixes; do
+	set -- $configs
+	while [ $# -gt 0 ]; do
+		# OUTPUT_COMPRESS writes .csv.gz, OUTPUT_DELTA adds _model.csv
+		for ext in .csv .csv.gz _model.csv; do
+			if [ -f data${p}${1}x${2}x${3}$ext ]; then
+				mv data${p}${1}x${2}x${3}$ext data_${dims}${p}${1}x${2}x${3}$ext
+			fi
+		done
+		shift 3
+	done
+done
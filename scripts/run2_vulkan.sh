@@ -1,16 +1,50 @@
 #!/bin/bash -e
 
-echo "x:int,y:int,z:int,time_ms:int,threads:int,invocations:int,simd:int,thread_occupancy_pct:int" | tee runtime.csv
+# usage: run2_vulkan.sh SHADER WIDTH HEIGHT DEPTH
+# with VARIANTS= and COARSEN= (see run_vulkan.sh) every workgroup size is run with each
+# variant and coarsening factor
 
+echo "x:int,y:int,z:int,time_ms:int,threads:int,invocations:int,simd:int,thread_occupancy_pct:int,cpu_time_ns:int,variant:string,coarsen:int" | tee runtime.csv
+
+configs=
 for x in 1 2 4 8 16 32 64 128 256 512; do
 	for y in 1 2 4 8 16 32 64 128 256 512; do
 		for z in 1 2 4 8 16 32 64; do
 			sz=$(($x * $y * $z))
 			if [ $sz -le 1792 ]; then
-				./run_vulkan.sh $1 $2 $3 $4 $x $y $z
-				cat stats.csv | csv-header -m | tee -a runtime.csv
-				cp data.csv data_${2}x${3}x${4}_${x}x${y}x${z}.csv
+				configs="$configs $x $y $z"
 			fi
 		done
 	done
 done
+
+# one process runs all configurations, so that writing out the results of one
+# overlaps with the dispatch of the next
+./run_vulkan.sh $1 $2 $3 $4 $configs
+cat stats.csv | csv-header -m | tee -a runtime.csv
+
+dims=${2}x${3}x${4}
+variants=$(echo ${VARIANTS:-bruteforce} | tr , ' ')
+if [ $(echo $variants | wc -w) -eq 1 ]; then
+	prefixes=_
+else
+	prefixes=$(for v in $variants; do echo _${v}_; done)
+fi
+factors=$(echo ${COARSEN:-1} | tr , ' ')
+if [ $(echo $factors | wc -w) -gt 1 ]; then
+	prefixes=$(for p in $prefixes; do for c in $factors; do echo ${p}c${c}_; done; done)
+fi
+for p in $prefixes; do
+	set -- $configs
+	while [ $# -gt 0 ]; do
+		# OUTPUT_COMPRESS writes .csv.gz, OUTPUT_DELTA adds _model.csv
+		for f in data instrument; do
+			for ext in .csv .csv.gz _model.csv; do
+				if [ -f $f${p}${1}x${2}x${3}$ext ]; then
+					mv $f${p}${1}x${2}x${3}$ext ${f}_${dims}${p}${1}x${2}x${3}$ext
+				fi
+			done
+		done
+		shift 3
+	done
+done
@@ -0,0 +1,35 @@
+#!/bin/bash -e
+
+# usage: run_cpu.sh WIDTH HEIGHT DEPTH GROUP_X GROUP_Y GROUP_Z [GROUP_X GROUP_Y GROUP_Z]...
+# CPU_SIMD=avx2|sse2|neon|scalar picks the lanes standing in for a subgroup, default is the widest
+# CPU_THREADS= and CPU_GRAIN= (workgroups per task) configure the work-stealing pool, the
+# time each thread spent running workgroups goes to cpu_threads.csv
+# VARIANTS=, REPEAT= and COARSEN= select the kernel variants, their repeat count and the
+# thread coarsening factors, as in run_vulkan.sh
+
+# with more than one variant, coarsening factor or configuration output files are
+# suffixed with the variant, the factor and the group size, the last one is written last
+variants=$(echo ${VARIANTS:-bruteforce} | tr , ' ')
+suffix=
+if [ $(echo $variants | wc -w) -gt 1 ]; then
+	suffix=_${variants##* }
+fi
+factors=$(echo ${COARSEN:-1} | tr , ' ')
+if [ $(echo $factors | wc -w) -gt 1 ]; then
+	suffix=${suffix}_c${factors##* }
+fi
+if [ $# -gt 6 ]; then
+	suffix=${suffix}_${@: -3:1}x${@: -2:1}x${@: -1:1}
+fi
+
+rm -f result$suffix.png stats.csv cpu_threads.csv data$suffix.csv checksum$suffix.txt
+CSV=1 $GDB ./cpu_compute "$@"
+case "${OUTPUT:-full}" in
+	full|image) out=result$suffix.png ;;
+	checksum)   out=checksum$suffix.txt ;;
+	stats)      out=stats.csv ;;
+esac
+if [ ! -f $out ]; then
+	echo "output file doesn't exist"
+	exit 1
+fi
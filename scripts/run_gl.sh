@@ -1,8 +1,32 @@
 #!/bin/bash -e
 
-rm -f result.png stats.csv data.csv
-MESA_GLSL_CACHE_DISABLE=1 CSV=1 mygl.sh $GDB ./gl_compute $1 $2 $3 $4 $5 $6 $7 $8
-if [ ! -f result.png ]; then
+# usage: run_gl.sh DEVICE SHADER WIDTH HEIGHT DEPTH GROUP_X GROUP_Y GROUP_Z [GROUP_X GROUP_Y GROUP_Z]...
+# VARIANTS=, REPEAT= and COARSEN= select the kernel variants, their repeat count and the
+# thread coarsening factors, as in run_vulkan.sh, which also describes EU_COUNT= of the
+# persistent variant (the EU count is asked from DEVICE here), and INSTRUMENT=
+# with more than one variant, coarsening factor or configuration output files are
+# suffixed with the variant, the factor and the group size, the last one is written last
+variants=$(echo ${VARIANTS:-bruteforce} | tr , ' ')
+suffix=
+if [ $(echo $variants | wc -w) -gt 1 ]; then
+	suffix=_${variants##* }
+fi
+factors=$(echo ${COARSEN:-1} | tr , ' ')
+if [ $(echo $factors | wc -w) -gt 1 ]; then
+	suffix=${suffix}_c${factors##* }
+fi
+if [ $# -gt 8 ]; then
+	suffix=${suffix}_${@: -3:1}x${@: -2:1}x${@: -1:1}
+fi
+
+rm -f result$suffix.png stats.csv data$suffix.csv checksum$suffix.txt
+MESA_GLSL_CACHE_DISABLE=1 CSV=1 mygl.sh $GDB ./gl_compute "$@"
+case "${OUTPUT:-full}" in
+	full|image) out=result$suffix.png ;;
+	checksum)   out=checksum$suffix.txt ;;
+	stats)      out=stats.csv ;;
+esac
+if [ ! -f $out ]; then
 	echo "output file doesn't exist"
 	exit 1
 fi
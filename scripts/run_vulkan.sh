@@ -1,10 +1,61 @@
 #!/bin/bash -e
 
-~/glslang/bin/glslangValidator -DUSE_SUBGROUPS=1 -DWIDTH=$2 -DHEIGHT=$3 -DDEPTH=$4 -DWORKGROUP_SIZE_X=$5 -DWORKGROUP_SIZE_Y=$6 -DWORKGROUP_SIZE_Z=$7 --target-env vulkan1.2 -V $1 -o shaders/comp.spv --quiet
+# usage: run_vulkan.sh SHADER WIDTH HEIGHT DEPTH GROUP_X GROUP_Y GROUP_Z [GROUP_X GROUP_Y GROUP_Z]...
+# VARIANTS= picks kernel variants of shaders/variants.csv (default bruteforce), all
+# configurations are run with each, REPEAT is how many times the kernel runs its loop
+# (default 100), COARSEN= is a list of thread coarsening factors (default 1), every
+# invocation computes that many times the pixels of its variant along x
+# the persistent variant dispatches the workgroups the device keeps resident: EU_COUNT=
+# EUs (asked from i915 on DRI_DEVICE=, default /dev/dri/renderD128, when unset) times
+# EU_THREADS= threads (default 7) of EU_SIMD= invocations (default 16)
+# INSTRUMENT=1 builds the shaders with shader clock samples of every invocation, written
+# to instrument.csv (suffixed like data.csv) for latency.sh
+variants=$(echo ${VARIANTS:-bruteforce} | tr , ' ')
 
-rm -f result.png stats.csv data.csv
-ANV_ENABLE_PIPELINE_CACHE=0 CSV=1 mygl.sh $GDB ./vulkan_compute $2 $3 $4 $5 $6 $7
-if [ ! -f result.png ]; then
+# every define set by any variant, the ones a variant doesn't set are 0
+defines=$(tail -n +2 shaders/variants.csv | cut -d, -f2 | tr ' ' '\n' | cut -d= -f1 | sort -u)
+
+# the workgroup size and the coarsening factor are specialization constants, so one
+# SPIR-V per variant serves all configurations
+for v in $variants; do
+	row=$(grep "^$v," shaders/variants.csv) || { echo "unknown variant $v"; exit 1; }
+	set_defines=$(echo "$row" | cut -d, -f2)
+	flags=
+	for d in $defines; do
+		value=0
+		for kv in $set_defines; do
+			case $kv in
+				$d=*) value=${kv#*=} ;;
+				$d)   value=1 ;;
+			esac
+		done
+		flags="$flags -D$d=$value"
+	done
+	~/glslang/bin/glslangValidator -DUSE_SUBGROUPS=1 -DWIDTH=$2 -DHEIGHT=$3 -DDEPTH=$4 $flags -DINSTRUMENT=${INSTRUMENT:-0} -DREPEAT=${REPEAT:-100} --target-env vulkan1.2 -V $1 -o shaders/comp_$v.spv --quiet
+done
+
+# with more than one variant, coarsening factor or configuration output files are
+# suffixed with the variant, the factor and the group size, the last one is written last
+suffix=
+if [ $(echo $variants | wc -w) -gt 1 ]; then
+	suffix=_${variants##* }
+fi
+factors=$(echo ${COARSEN:-1} | tr , ' ')
+if [ $(echo $factors | wc -w) -gt 1 ]; then
+	suffix=${suffix}_c${factors##* }
+fi
+if [ $# -gt 7 ]; then
+	suffix=${suffix}_${@: -3:1}x${@: -2:1}x${@: -1:1}
+fi
+
+rm -f result$suffix.png stats.csv data$suffix.csv checksum$suffix.txt
+ANV_ENABLE_PIPELINE_CACHE=0 CSV=1 mygl.sh $GDB ./vulkan_compute $2 $3 $4 "${@:5}"
+case "${OUTPUT:-full}" in
+	full|image) out=result$suffix.png ;;
+	checksum)   out=checksum$suffix.txt ;;
+	stats)      out=stats.csv ;;
+esac
+if [ ! -f $out ]; then
 	echo "output file doesn't exist"
 	exit 1
 fi
@@ -0,0 +1,39 @@
+#!/bin/bash -e
+
+# usage: speedup.sh RUN2_SCRIPT ARGS...
+# e.g. VARIANT=staged speedup.sh ./run2_vulkan.sh shaders/shader.comp 512 512 1
+# runs the workgroup size sweep with the BASE (default bruteforce) and the
+# VARIANT (default optimized) kernel of shaders/variants.csv, and prints the
+# speed-up of the latter for every configuration, next to the SIMD width each
+# kernel got
+# BASE=half VARIANT=half_packed shows what the packed fp16 math gains, with
+# BASE=bruteforce the harness also prints the colour error of the other kernel,
+# VARIANT=persistent compares the atomic tile queue with the hardware dispatcher
+
+base=${BASE:-bruteforce}
+variant=${VARIANT:-optimized}
+
+VARIANTS="$base $variant" "$@"
+
+csv-merge -N base -p runtime.csv -N opt -p runtime.csv |
+csv-sqlite -T \
+	"select base.x,
+		base.y,
+		base.z,
+		base.coarsen,
+		cast(avg(base.time_ms) as int) as time_ms_$base,
+		cast(avg(opt. time_ms) as int) as time_ms_$variant,
+		printf('%.2f', avg(base.time_ms) / avg(opt.time_ms)) as speedup,
+		base.simd as simd_$base,
+		opt. simd as simd_$variant,
+		base.thread_occupancy_pct as occupancy_$base,
+		opt. thread_occupancy_pct as occupancy_$variant
+	   from base, opt
+	  where base.variant = '$base'
+	    and opt. variant = '$variant'
+	    and base.x = opt.x
+	    and base.y = opt.y
+	    and base.z = opt.z
+	    and base.coarsen = opt.coarsen
+	  group by base.x, base.y, base.z, base.coarsen
+	  order by avg(base.time_ms) / avg(opt.time_ms) desc" -s
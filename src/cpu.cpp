@@ -0,0 +1,1046 @@
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <math.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define CPU_NEON 1
+#endif
+
+#include "shared.h"
+
+/*
+CPU reference for shaders/shader.comp: the dispatch is emulated workgroup by
+workgroup, and the invocations of a workgroup are split into subgroups of
+consecutive local invocation indices, as GPUs do. The lanes of a SIMD register
+stand in for the lanes of a subgroup, so the Mandelbrot loop runs until all of
+them have escaped, like it does on an EU. Workgroups are spread over the cores
+by a work-stealing pool (CPU_THREADS=, CPU_GRAIN=). VARIANTS= and
+REPEAT= select the kernel variants of shaders/variants.csv and their repeat
+count, as for the GPU harnesses. The SIMD kernels leave the loop once no lane
+is left, which is what the ballot of the subgroup_ops shader does, for it the
+same per-subgroup stats are written. staged writes each workgroup's pixels to
+a local buffer first and copies them out row by row, as the shader does
+through shared memory. half rounds every operation to half precision (with
+F16C or _Float16), half_packed computes two pixels along x per invocation.
+COARSEN= factors have every invocation compute that many runs of them.
+persistent runs one workgroup per thread, which takes the workgroups of the
+grid from a shared atomic counter instead of the pool's deques.
+*/
+
+#define WARMUP 5
+#define AVERAGE 10
+
+// the iteration limit of the Mandelbrot loop in shader.comp
+#define M 128
+
+#define MAX_LANES 8
+// pixels iterated together by one invocation, 2 with PACKED
+#define MAX_PACK 2
+
+struct simd_impl {
+    const char *name;
+    unsigned lanes;
+    // iteration counts n of lanes points c = (cx, cy), brute force and with
+    // the periodicity check of the OPTIMIZED shader
+    void (*mandel)(const float *cx, const float *cy, float *n);
+    void (*mandel_periodic)(const float *cx, const float *cy, float *n);
+};
+
+/*
+With PERIODIC, z is saved after iterations 1, 2, 4, 8, ... and a lane whose
+orbit comes back to it exactly is periodic, so it never escapes and gets n = M
+right away.
+*/
+template <bool PERIODIC>
+static void
+mandel_scalar(const float *cx, const float *cy, float *n)
+{
+    for (unsigned l = 0; l < 4; ++l) {
+        float zx = 0.0f, zy = 0.0f, sx = 0.0f, sy = 0.0f;
+        int check = 1;
+        n[l] = 0.0f;
+        for (int i = 0; i < M; i++) {
+            float x = zx * zx - zy * zy + cx[l];
+            float y = 2.0f * zx * zy + cy[l];
+            zx = x;
+            zy = y;
+            if (zx * zx + zy * zy > 2.0f)
+                break;
+            n[l]++;
+            if (PERIODIC) {
+                if (zx == sx && zy == sy) {
+                    n[l] = M;
+                    break;
+                }
+                if (i + 1 == check) {
+                    sx = zx;
+                    sy = zy;
+                    check *= 2;
+                }
+            }
+        }
+    }
+}
+
+#ifdef CPU_X86
+template <bool PERIODIC>
+static void
+mandel_sse2(const float *cx, const float *cy, float *n)
+{
+    const __m128 vcx = _mm_loadu_ps(cx), vcy = _mm_loadu_ps(cy);
+    const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f);
+    __m128 zx = _mm_setzero_ps(), zy = _mm_setzero_ps(), vn = _mm_setzero_ps();
+    __m128 active = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    __m128 sx = _mm_setzero_ps(), sy = _mm_setzero_ps(), inside = _mm_setzero_ps();
+    int check = 1;
+
+    for (int i = 0; i < M; i++) {
+        __m128 x = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(zx, zx), _mm_mul_ps(zy, zy)), vcx);
+        __m128 y = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(two, zx), zy), vcy);
+        zx = x;
+        zy = y;
+        // lanes stay inactive once escaped, their z doesn't matter any more
+        __m128 dot = _mm_add_ps(_mm_mul_ps(zx, zx), _mm_mul_ps(zy, zy));
+        active = _mm_andnot_ps(_mm_cmpgt_ps(dot, two), active);
+        vn = _mm_add_ps(vn, _mm_and_ps(active, one));
+        if (PERIODIC) {
+            __m128 same = _mm_and_ps(_mm_cmpeq_ps(zx, sx), _mm_cmpeq_ps(zy, sy));
+            same = _mm_and_ps(same, active);
+            inside = _mm_or_ps(inside, same);
+            active = _mm_andnot_ps(same, active);
+            if (i + 1 == check) {
+                sx = zx;
+                sy = zy;
+                check *= 2;
+            }
+        }
+        if (!_mm_movemask_ps(active))
+            break;
+    }
+    if (PERIODIC)
+        vn = _mm_or_ps(_mm_andnot_ps(inside, vn), _mm_and_ps(inside, _mm_set1_ps(M)));
+    _mm_storeu_ps(n, vn);
+}
+
+template <bool PERIODIC>
+__attribute__((target("avx2")))
+static void
+mandel_avx2(const float *cx, const float *cy, float *n)
+{
+    const __m256 vcx = _mm256_loadu_ps(cx), vcy = _mm256_loadu_ps(cy);
+    const __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f);
+    __m256 zx = _mm256_setzero_ps(), zy = _mm256_setzero_ps(), vn = _mm256_setzero_ps();
+    __m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    __m256 sx = _mm256_setzero_ps(), sy = _mm256_setzero_ps(), inside = _mm256_setzero_ps();
+    int check = 1;
+
+    for (int i = 0; i < M; i++) {
+        __m256 x = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(zx, zx), _mm256_mul_ps(zy, zy)), vcx);
+        __m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(two, zx), zy), vcy);
+        zx = x;
+        zy = y;
+        __m256 dot = _mm256_add_ps(_mm256_mul_ps(zx, zx), _mm256_mul_ps(zy, zy));
+        active = _mm256_andnot_ps(_mm256_cmp_ps(dot, two, _CMP_GT_OQ), active);
+        vn = _mm256_add_ps(vn, _mm256_and_ps(active, one));
+        if (PERIODIC) {
+            __m256 same = _mm256_and_ps(_mm256_cmp_ps(zx, sx, _CMP_EQ_OQ),
+                    _mm256_cmp_ps(zy, sy, _CMP_EQ_OQ));
+            same = _mm256_and_ps(same, active);
+            inside = _mm256_or_ps(inside, same);
+            active = _mm256_andnot_ps(same, active);
+            if (i + 1 == check) {
+                sx = zx;
+                sy = zy;
+                check *= 2;
+            }
+        }
+        if (!_mm256_movemask_ps(active))
+            break;
+    }
+    if (PERIODIC)
+        vn = _mm256_blendv_ps(vn, _mm256_set1_ps(M), inside);
+    _mm256_storeu_ps(n, vn);
+}
+#endif
+
+/*
+float16_t arithmetic of the HALF_FLOAT shader: products of two halves are
+exact in float, so rounding the float result gives the half one (and sums
+nearly always do). There is no fp16 arithmetic to vectorize it with, F16C
+only converts.
+*/
+typedef void (*mandel_half_fn)(const float *cx, const float *cy, float *n, unsigned count);
+
+#ifdef __FLT16_MAX__
+static inline float
+round_half(float v)
+{
+    return (float)(_Float16)v;
+}
+
+static void
+mandel_half_scalar(const float *cx, const float *cy, float *n, unsigned count)
+{
+    for (unsigned l = 0; l < count; ++l) {
+        float hx = round_half(cx[l]), hy = round_half(cy[l]);
+        float zx = 0.0f, zy = 0.0f;
+        n[l] = 0.0f;
+        for (int i = 0; i < M; i++) {
+            float x = round_half(round_half(round_half(zx * zx) - round_half(zy * zy)) + hx);
+            float y = round_half(round_half(2.0f * zx * zy) + hy);
+            zx = x;
+            zy = y;
+            if (round_half(round_half(zx * zx) + round_half(zy * zy)) > 2.0f)
+                break;
+            n[l]++;
+        }
+    }
+}
+#endif
+
+#ifdef CPU_X86
+__attribute__((target("f16c")))
+static inline __m128
+round_half_ps(__m128 v)
+{
+    return _mm_cvtph_ps(_mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+}
+
+// four lanes at a time, count is a multiple of 4
+__attribute__((target("f16c")))
+static void
+mandel_half_f16c(const float *cx, const float *cy, float *n, unsigned count)
+{
+    for (unsigned l = 0; l < count; l += 4) {
+        const __m128 vcx = round_half_ps(_mm_loadu_ps(cx + l));
+        const __m128 vcy = round_half_ps(_mm_loadu_ps(cy + l));
+        const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f);
+        __m128 zx = _mm_setzero_ps(), zy = _mm_setzero_ps(), vn = _mm_setzero_ps();
+        __m128 active = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+        for (int i = 0; i < M; i++) {
+            __m128 x = round_half_ps(_mm_sub_ps(round_half_ps(_mm_mul_ps(zx, zx)),
+                    round_half_ps(_mm_mul_ps(zy, zy))));
+            __m128 y = round_half_ps(_mm_mul_ps(_mm_mul_ps(two, zx), zy));
+            zx = round_half_ps(_mm_add_ps(x, vcx));
+            zy = round_half_ps(_mm_add_ps(y, vcy));
+            __m128 dot = round_half_ps(_mm_add_ps(round_half_ps(_mm_mul_ps(zx, zx)),
+                    round_half_ps(_mm_mul_ps(zy, zy))));
+            active = _mm_andnot_ps(_mm_cmpgt_ps(dot, two), active);
+            vn = _mm_add_ps(vn, _mm_and_ps(active, one));
+            if (!_mm_movemask_ps(active))
+                break;
+        }
+        _mm_storeu_ps(n + l, vn);
+    }
+}
+#endif
+
+// F16C where the CPU has it, _Float16 otherwise, NULL without either
+static mandel_half_fn
+select_mandel_half(void)
+{
+#ifdef CPU_X86
+    if (__builtin_cpu_supports("f16c"))
+        return mandel_half_f16c;
+#endif
+#ifdef __FLT16_MAX__
+    return mandel_half_scalar;
+#else
+    return NULL;
+#endif
+}
+
+#ifdef CPU_NEON
+template <bool PERIODIC>
+static void
+mandel_neon(const float *cx, const float *cy, float *n)
+{
+    const float32x4_t vcx = vld1q_f32(cx), vcy = vld1q_f32(cy);
+    const float32x4_t one = vdupq_n_f32(1.0f), two = vdupq_n_f32(2.0f);
+    float32x4_t zx = vdupq_n_f32(0.0f), zy = vdupq_n_f32(0.0f), vn = vdupq_n_f32(0.0f);
+    uint32x4_t active = vdupq_n_u32(0xffffffff);
+    float32x4_t sx = vdupq_n_f32(0.0f), sy = vdupq_n_f32(0.0f);
+    uint32x4_t inside = vdupq_n_u32(0);
+    int check = 1;
+
+    for (int i = 0; i < M; i++) {
+        float32x4_t x = vaddq_f32(vsubq_f32(vmulq_f32(zx, zx), vmulq_f32(zy, zy)), vcx);
+        float32x4_t y = vaddq_f32(vmulq_f32(vmulq_f32(two, zx), zy), vcy);
+        zx = x;
+        zy = y;
+        float32x4_t dot = vaddq_f32(vmulq_f32(zx, zx), vmulq_f32(zy, zy));
+        active = vbicq_u32(active, vcgtq_f32(dot, two));
+        vn = vaddq_f32(vn, vreinterpretq_f32_u32(vandq_u32(active, vreinterpretq_u32_f32(one))));
+        if (PERIODIC) {
+            uint32x4_t same = vandq_u32(vceqq_f32(zx, sx), vceqq_f32(zy, sy));
+            same = vandq_u32(same, active);
+            inside = vorrq_u32(inside, same);
+            active = vbicq_u32(active, same);
+            if (i + 1 == check) {
+                sx = zx;
+                sy = zy;
+                check *= 2;
+            }
+        }
+        if (vmaxvq_u32(active) == 0)
+            break;
+    }
+    if (PERIODIC)
+        vn = vbslq_f32(inside, vdupq_n_f32(M), vn);
+    vst1q_f32(n, vn);
+}
+#endif
+
+static const struct simd_impl simd_impls[] = {
+#ifdef CPU_X86
+    { "avx2", 8, mandel_avx2<false>, mandel_avx2<true> },
+    { "sse2", 4, mandel_sse2<false>, mandel_sse2<true> },
+#endif
+#ifdef CPU_NEON
+    { "neon", 4, mandel_neon<false>, mandel_neon<true> },
+#endif
+    { "scalar", 4, mandel_scalar<false>, mandel_scalar<true> },
+};
+
+static bool
+simd_supported(const struct simd_impl *impl)
+{
+#ifdef CPU_X86
+    if (impl->mandel == mandel_avx2<false>)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return true;
+}
+
+// the widest supported implementation, or the one named by CPU_SIMD=
+static const struct simd_impl *
+select_simd(void)
+{
+    const char *name = getenv("CPU_SIMD");
+
+    for (const struct simd_impl &impl : simd_impls) {
+        if (name && strcmp(name, impl.name) != 0)
+            continue;
+        if (simd_supported(&impl))
+            return &impl;
+    }
+
+    fprintf(stderr, "CPU_SIMD=%s is not supported, use one of:", name);
+    for (const struct simd_impl &impl : simd_impls) {
+        if (simd_supported(&impl))
+            fprintf(stderr, " %s", impl.name);
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+struct dispatch {
+    int width, height, depth;
+    struct uvec4 groupSize;
+    struct uvec4 numGroups;
+    const struct simd_impl *simd;
+    bool optimized;
+    bool subgroup_ops;
+    bool staged_output;
+    bool half_float;
+    bool persistent;
+    mandel_half_fn mandel_half;
+    // pixels along x per invocation, coarsening factor runs of pack pixels
+    uint32_t pack;
+    uint32_t points;
+    int repeat;
+    struct Pixel *data;
+};
+
+struct dispatch_stats {
+    // subgroups run, and how many of their lanes had a pixel to compute
+    uint64_t subgroups;
+    uint64_t active_lanes;
+};
+
+// the main cardioid and the period-2 bulb, which the OPTIMIZED shader doesn't iterate
+static bool
+in_cardioid_or_bulb(float cx, float cy)
+{
+    float q = (cx - 0.25f) * (cx - 0.25f) + cy * cy;
+    return q * (q + (cx - 0.25f)) <= 0.25f * cy * cy ||
+            (cx + 1.0f) * (cx + 1.0f) + cy * cy <= 0.0625f;
+}
+
+// what shader.comp does for one subgroup of workgroup wg, pixels go to
+// stage[local invocation index * points + point] if it isn't NULL
+static void
+run_subgroup(const struct dispatch *d, struct uvec4 wg, uint32_t sgid,
+        struct Pixel *stage, struct dispatch_stats *stats)
+{
+    const uint32_t lanes = d->simd->lanes;
+    const uint32_t invocations = d->groupSize.x * d->groupSize.y * d->groupSize.z;
+    const uint32_t numSubgroups = (invocations + lanes - 1) / lanes;
+    const float scale = 2.0f + 1.7f * 0.2f;
+
+    // point k of a run of lane l at k * lanes + l, so that every point of
+    // the lanes is one SIMD vector
+    const uint32_t pack = d->pack, points = d->points;
+    float cx[MAX_LANES * MAX_PACK], cy[MAX_LANES * MAX_PACK], n[MAX_LANES * MAX_PACK];
+    struct uvec4 liid[MAX_LANES], giid[MAX_LANES];
+    bool active[MAX_LANES], live[MAX_LANES], inside[MAX_LANES * MAX_PACK];
+
+    for (uint32_t l = 0; l < lanes; ++l) {
+        uint32_t index = sgid * lanes + l;
+
+        liid[l].x = index % d->groupSize.x;
+        liid[l].y = index / d->groupSize.x % d->groupSize.y;
+        liid[l].z = index / (d->groupSize.x * d->groupSize.y);
+        liid[l].w = 0;
+        giid[l].x = wg.x * d->groupSize.x + liid[l].x;
+        giid[l].y = wg.y * d->groupSize.y + liid[l].y;
+        giid[l].z = wg.z * d->groupSize.z + liid[l].z;
+        giid[l].w = 0;
+
+        // lanes past the end of the workgroup or the image return early
+        active[l] = index < invocations &&
+                giid[l].x * points < (uint32_t)d->width &&
+                giid[l].y < (uint32_t)d->height &&
+                giid[l].z < (uint32_t)d->depth;
+        if (active[l])
+            stats->active_lanes++;
+    }
+    stats->subgroups++;
+
+    // the coarsening loop of the shader, pack pixels at a time
+    for (uint32_t run = 0; run < points / pack; ++run) {
+        bool iterate = false;
+
+        for (uint32_t l = 0; l < lanes; ++l) {
+            // lanes whose run starts past the image leave the loop
+            live[l] = active[l] && giid[l].x * points + run * pack < (uint32_t)d->width;
+
+            for (uint32_t k = 0; k < pack; ++k) {
+                uint32_t p = k * lanes + l;
+                inside[p] = false;
+                if (live[l]) {
+                    uint32_t x = giid[l].x * points + run * pack + k;
+                    cx[p] = -.445f + (x / (float)d->width - 0.5f) * scale;
+                    cy[p] = (giid[l].y / (float)d->height - 0.5f) * scale;
+                    inside[p] = d->optimized && in_cardioid_or_bulb(cx[p], cy[p]);
+                }
+                if (!live[l] || inside[p]) {
+                    // escapes in the first iteration
+                    cx[p] = cy[p] = 4.0f;
+                } else {
+                    iterate = true;
+                }
+            }
+        }
+
+        // like a subgroup none of whose invocations enter the loop
+        if (iterate) {
+            for (int j = 0; j < d->repeat; ++j) {
+                for (uint32_t k = 0; k < pack; ++k) {
+                    const float *pcx = &cx[k * lanes], *pcy = &cy[k * lanes];
+                    float *pn = &n[k * lanes];
+                    if (d->half_float)
+                        d->mandel_half(pcx, pcy, pn, lanes);
+                    else if (d->optimized)
+                        d->simd->mandel_periodic(pcx, pcy, pn);
+                    else
+                        d->simd->mandel(pcx, pcy, pn);
+                }
+            }
+        }
+
+        for (uint32_t p = 0; p < lanes * pack; ++p) {
+            if (inside[p])
+                n[p] = M;
+        }
+
+        // subgroupAdd() of the iterations and lanes, with the iterations the
+        // subgroup ran, for the first lane with a pixel (subgroupElect()),
+        // of every run
+        struct uvec4 sg_stats = {};
+        int elected = -1;
+        if (d->subgroup_ops) {
+            for (uint32_t l = 0; l < lanes; ++l) {
+                if (!live[l])
+                    continue;
+                if (elected < 0)
+                    elected = l;
+                // a lane escaping after n iterations runs n + 1 of them
+                uint32_t trips = n[l] < M ? (uint32_t)n[l] + 1 : M;
+                sg_stats.y += trips;
+                sg_stats.z = trips > sg_stats.z ? trips : sg_stats.z;
+                sg_stats.w++;
+            }
+        }
+
+        for (uint32_t l = 0; l < lanes; ++l) {
+            if (!live[l])
+                continue;
+
+            for (uint32_t k = 0; k < pack; ++k) {
+                uint32_t x = giid[l].x * points + run * pack + k;
+                if (x >= (uint32_t)d->width)
+                    break;
+
+                float t = n[k * lanes + l] / (float)M;
+                float z = giid[l].z / (float)d->depth;
+                size_t idx = (size_t)d->width * d->height * giid[l].z +
+                        (size_t)d->width * giid[l].y + x;
+                struct Pixel *p = stage ? &stage[(sgid * lanes + l) * points + run * pack + k] :
+                        &d->data[idx];
+
+                p->r = 0.3f + -0.2f * cosf(6.28318f * (2.1f * t + 0.0f)) * (1 - z);
+                p->g = 0.3f + -0.3f * cosf(6.28318f * (2.0f * t + 0.1f)) * (1 - z);
+                p->b = 0.5f + -0.5f * cosf(6.28318f * (3.0f * t + 0.0f)) * (1 - z);
+                p->a = 1.0f;
+                p->numWorkGroups = d->numGroups;
+                p->workGroupSize = d->groupSize;
+                p->workGroupID = wg;
+                p->localInvocationID = liid[l];
+                p->globalInvocationID = giid[l];
+                p->localInvocationIndex = { sgid * lanes + l, 0, 0, 0 };
+                if ((int)l == elected) {
+                    p->localInvocationIndex.y = sg_stats.y;
+                    p->localInvocationIndex.z = sg_stats.z;
+                    p->localInvocationIndex.w = sg_stats.w;
+                }
+                p->subgroup = { sgid, l, lanes, numSubgroups };
+            }
+        }
+    }
+}
+
+static void
+run_workgroup(const struct dispatch *d, struct uvec4 wg, struct dispatch_stats *stats)
+{
+    const uint32_t lanes = d->simd->lanes;
+    const uint32_t invocations = d->groupSize.x * d->groupSize.y * d->groupSize.z;
+
+    static thread_local std::vector<struct Pixel> stage;
+    struct Pixel *s = NULL;
+    if (d->staged_output) {
+        stage.resize(invocations * d->points);
+        s = stage.data();
+    }
+
+    for (uint32_t sgid = 0; sgid * lanes < invocations; ++sgid)
+        run_subgroup(d, wg, sgid, s, stats);
+
+    if (!s)
+        return;
+
+    // the part of every row of the workgroup that is inside the image
+    const uint32_t rowPixels = d->groupSize.x * d->points;
+    const uint32_t x = wg.x * rowPixels;
+    const uint32_t row = std::min(rowPixels, (uint32_t)d->width - x);
+    for (uint32_t lz = 0; lz < d->groupSize.z; ++lz) {
+        uint32_t z = wg.z * d->groupSize.z + lz;
+        if (z >= (uint32_t)d->depth)
+            break;
+        for (uint32_t ly = 0; ly < d->groupSize.y; ++ly) {
+            uint32_t y = wg.y * d->groupSize.y + ly;
+            if (y >= (uint32_t)d->height)
+                break;
+            size_t idx = (size_t)d->width * d->height * z + (size_t)d->width * y + x;
+            memcpy(&d->data[idx], &s[(lz * d->groupSize.y + ly) * rowPixels],
+                    row * sizeof(struct Pixel));
+        }
+    }
+}
+
+static uint64_t
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return 1000ULL * 1000 * 1000 * (end->tv_sec - start->tv_sec) +
+            end->tv_nsec - start->tv_nsec;
+}
+
+/*
+Work-stealing pool: a task is a run of grain consecutive workgroups (x
+fastest, like gl_WorkGroupID is usually walked). Every thread starts with a
+contiguous share of the tasks in its own deque and takes them from the front,
+once that is empty it steals from the back of the others.
+*/
+struct task {
+    uint64_t first, count;
+};
+
+struct worker {
+    std::mutex lock;
+    std::deque<task> tasks;
+
+    // of the last dispatch
+    struct dispatch_stats stats;
+    uint64_t busy_ns;
+    uint64_t workgroups;
+    uint64_t stolen;
+
+    std::thread thread;
+};
+
+struct pool {
+    // worker 0 is the thread calling pool_dispatch()
+    std::vector<worker *> workers;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    const struct dispatch *d;
+    // the next workgroup of a persistent dispatch
+    std::atomic<uint64_t> next_tile;
+    unsigned generation; // bumped for every dispatch
+    unsigned running;    // helper threads still working on it
+    bool done;
+};
+
+static bool
+pop_task(struct worker *w, struct task *t)
+{
+    std::unique_lock<std::mutex> l(w->lock);
+    if (w->tasks.empty())
+        return false;
+    *t = w->tasks.front();
+    w->tasks.pop_front();
+    return true;
+}
+
+// no tasks are added during a dispatch, so if every deque is empty we are done
+static bool
+steal_task(struct pool *p, unsigned self, uint32_t *seed, struct task *t)
+{
+    unsigned n = p->workers.size();
+
+    // xorshift, so that thieves don't all go for the same victim
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+
+    for (unsigned i = 0; i < n; ++i) {
+        struct worker *victim = p->workers[(*seed + i) % n];
+        if (victim == p->workers[self])
+            continue;
+
+        std::unique_lock<std::mutex> l(victim->lock);
+        if (!victim->tasks.empty()) {
+            *t = victim->tasks.back();
+            victim->tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+work(struct pool *p, unsigned self)
+{
+    const struct dispatch *d = p->d;
+    struct worker *w = p->workers[self];
+    uint32_t seed = 2463534242u + self * 2654435761u;
+    struct task t;
+
+    for (;;) {
+        bool stolen = false;
+        if (!pop_task(w, &t)) {
+            // persistent tasks are pinned to their worker, the tiles balance the load
+            if (d->persistent || !steal_task(p, self, &seed, &t))
+                break;
+            stolen = true;
+        }
+
+        struct timespec start, end;
+        if (clock_gettime(CLOCK_MONOTONIC, &start))
+            abort();
+
+        // a persistent task is one workgroup running tiles until there are none left
+        const uint64_t groups = (uint64_t)d->numGroups.x * d->numGroups.y * d->numGroups.z;
+        uint64_t i = d->persistent ? p->next_tile++ : t.first, count = 0;
+        while (d->persistent ? i < groups : i < t.first + t.count) {
+            struct uvec4 wg;
+            wg.x = i % d->numGroups.x;
+            wg.y = i / d->numGroups.x % d->numGroups.y;
+            wg.z = i / ((uint64_t)d->numGroups.x * d->numGroups.y);
+            wg.w = 0;
+            run_workgroup(d, wg, &w->stats);
+            i = d->persistent ? p->next_tile++ : i + 1;
+            count++;
+        }
+
+        if (clock_gettime(CLOCK_MONOTONIC, &end))
+            abort();
+
+        w->busy_ns += elapsed_ns(&start, &end);
+        w->workgroups += count;
+        w->stolen += stolen;
+    }
+}
+
+static void
+worker_thread(struct pool *p, unsigned self)
+{
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> l(p->lock);
+
+    for (;;) {
+        while (p->generation == seen && !p->done)
+            p->cond.wait(l);
+        if (p->done)
+            break;
+        seen = p->generation;
+        l.unlock();
+
+        work(p, self);
+
+        l.lock();
+        if (--p->running == 0)
+            p->cond.notify_all();
+    }
+}
+
+static struct pool *
+pool_create(unsigned threads)
+{
+    struct pool *p = new pool;
+
+    p->d = NULL;
+    p->generation = 0;
+    p->running = 0;
+    p->done = false;
+
+    for (unsigned i = 0; i < threads; ++i)
+        p->workers.push_back(new worker);
+    for (unsigned i = 1; i < threads; ++i)
+        p->workers[i]->thread = std::thread(worker_thread, p, i);
+
+    return p;
+}
+
+static void
+pool_destroy(struct pool *p)
+{
+    {
+        std::unique_lock<std::mutex> l(p->lock);
+        p->done = true;
+        p->cond.notify_all();
+    }
+
+    for (unsigned i = 0; i < p->workers.size(); ++i) {
+        if (i > 0)
+            p->workers[i]->thread.join();
+        delete p->workers[i];
+    }
+    delete p;
+}
+
+// runs all workgroups of d on the pool, stats is the sum over all threads
+static void
+pool_dispatch(struct pool *p, const struct dispatch *d, uint64_t grain,
+        struct dispatch_stats *stats)
+{
+    const uint64_t groups = (uint64_t)d->numGroups.x * d->numGroups.y * d->numGroups.z;
+    const uint64_t tasks = (groups + grain - 1) / grain;
+    const unsigned n = p->workers.size();
+
+    p->next_tile = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        struct worker *w = p->workers[i];
+        w->stats = {};
+        w->busy_ns = w->workgroups = w->stolen = 0;
+
+        // persistent: one task per thread, which fills the "device", only
+        // its own thread runs it so it is never counted as stolen
+        if (d->persistent) {
+            w->tasks.push_back({ 0, 0 });
+            continue;
+        }
+        for (uint64_t t = tasks * i / n; t < tasks * (i + 1) / n; ++t) {
+            uint64_t first = t * grain;
+            w->tasks.push_back({ first, first + grain <= groups ? grain : groups - first });
+        }
+    }
+
+    {
+        std::unique_lock<std::mutex> l(p->lock);
+        p->d = d;
+        p->running = n - 1;
+        p->generation++;
+        p->cond.notify_all();
+    }
+
+    work(p, 0);
+
+    {
+        std::unique_lock<std::mutex> l(p->lock);
+        while (p->running > 0)
+            p->cond.wait(l);
+    }
+
+    for (unsigned i = 0; i < n; ++i) {
+        stats->subgroups += p->workers[i]->stats.subgroups;
+        stats->active_lanes += p->workers[i]->stats.active_lanes;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 7 || (argc - 4) % 3 != 0) {
+        fprintf(stderr, "Usage: %s IMG_WIDTH IMG_HEIGHT IMG_DEPTH GROUP_X GROUP_Y GROUP_Z [GROUP_X GROUP_Y GROUP_Z]...\n", argv[0]);
+        exit(2);
+    }
+
+    int WIDTH = atoi(argv[1]);
+    int HEIGHT = atoi(argv[2]);
+    int DEPTH = atoi(argv[3]);
+
+    if (WIDTH == 0 || HEIGHT == 0 || DEPTH == 0)
+        abort();
+
+    struct WorkgroupSize {
+        int x, y, z;
+    };
+    std::vector<WorkgroupSize> configs;
+    for (int i = 4; i < argc; i += 3) {
+        WorkgroupSize cfg;
+        cfg.x = atoi(argv[i + 0]);
+        cfg.y = atoi(argv[i + 1]);
+        cfg.z = atoi(argv[i + 2]);
+        if (cfg.x == 0 || cfg.y == 0 || cfg.z == 0)
+            abort();
+        configs.push_back(cfg);
+    }
+
+    const char *tmp;
+    tmp = getenv("PERF_ENABLED");
+    bool perf_enabled = tmp == NULL || atoi(tmp) > 0;
+    tmp = getenv("CSV");
+    bool show_csv = tmp != NULL && atoi(tmp) > 0;
+
+    struct output_opts output;
+    get_output_opts(&output);
+
+    FILE *statsFile = NULL;
+    if (perf_enabled && show_csv) {
+        statsFile = fopen("stats.csv", "w");
+        if (!statsFile) {
+            perror("fopen stats.csv");
+            exit(2);
+        }
+        fprintf(statsFile, "x:int,y:int,z:int,time_ns:int,threads:int,invocations:int,simd:int,thread_occupancy_pct:int,cpu_time_ns:int,variant:string,coarsen:int\n");
+    }
+
+    // one thread per core by default, each taking CPU_GRAIN workgroups at a time
+    unsigned threads = std::thread::hardware_concurrency();
+    tmp = getenv("CPU_THREADS");
+    if (tmp)
+        threads = atoi(tmp);
+    if (threads == 0)
+        threads = 1;
+
+    uint64_t grain = 1;
+    tmp = getenv("CPU_GRAIN");
+    if (tmp && atoi(tmp) > 0)
+        grain = atoi(tmp);
+
+    FILE *threadsFile = NULL;
+    if (perf_enabled && show_csv) {
+        threadsFile = fopen("cpu_threads.csv", "w");
+        if (!threadsFile) {
+            perror("fopen cpu_threads.csv");
+            exit(2);
+        }
+        fprintf(threadsFile, "x:int,y:int,z:int,thread:int,busy_ns:int,time_ns:int,workgroups:int,stolen:int,variant:string,coarsen:int\n");
+    }
+
+    unsigned warmup, average;
+    if (perf_enabled) {
+        const char *env = getenv("WARMUP");
+        if (env)
+            warmup = atoi(env);
+        else
+            warmup = WARMUP;
+
+        env = getenv("AVERAGE");
+        if (env)
+            average = atoi(env);
+        else
+            average = AVERAGE;
+    } else {
+        warmup = 0;
+        average = 1;
+    }
+
+    struct dispatch d;
+    d.width = WIDTH;
+    d.height = HEIGHT;
+    d.depth = DEPTH;
+    d.simd = select_simd();
+    d.mandel_half = select_mandel_half();
+
+    tmp = getenv("REPEAT");
+    d.repeat = tmp ? atoi(tmp) : 100;
+    if (d.repeat < 1)
+        abort();
+
+    struct kernel_variant *variants;
+    unsigned num_variants = get_kernel_variants("cpu", &variants);
+
+    unsigned coarsen_factors[MAX_COARSEN_FACTORS];
+    unsigned num_coarsen = get_coarsen_factors(coarsen_factors);
+
+    std::vector<struct Pixel> data((size_t)WIDTH * HEIGHT * DEPTH);
+    d.data = data.data();
+
+    struct pool *pool = pool_create(threads);
+    struct output_writer *writer = output_writer_create(&output,
+            num_variants * num_coarsen * configs.size() > 1);
+    struct color_reference *reference = color_reference_create();
+
+    for (unsigned v = 0; v < num_variants; ++v) {
+        const struct kernel_variant *variant = &variants[v];
+
+        // like #elif in shader.comp: PACKED, OPTIMIZED, SUBGROUP_OPS, HALF_FLOAT
+        d.pack = kernel_variant_points(variant);
+        d.optimized = d.pack == 1 && kernel_variant_define(variant, "OPTIMIZED");
+        d.subgroup_ops = d.pack == 1 && !d.optimized && kernel_variant_define(variant, "SUBGROUP_OPS");
+        d.half_float = !d.optimized && !d.subgroup_ops && kernel_variant_define(variant, "HALF_FLOAT");
+        d.staged_output = kernel_variant_define(variant, "STAGED_OUTPUT");
+        d.persistent = kernel_variant_define(variant, "PERSISTENT");
+        if (d.half_float && !d.mandel_half) {
+            fprintf(stderr, "variant %s needs F16C or a compiler with _Float16\n", variant->name);
+            exit(2);
+        }
+
+        // all configurations of the first coarsening factor, then of the next one
+        for (unsigned r = 0; r < num_coarsen * configs.size(); ++r) {
+            const WorkgroupSize &cfg = configs[r % configs.size()];
+            unsigned coarsen = coarsen_factors[r / configs.size()];
+            d.points = d.pack * coarsen;
+            d.groupSize = { (uint32_t)cfg.x, (uint32_t)cfg.y, (uint32_t)cfg.z, 0 };
+            d.numGroups = {
+                (uint32_t)ceil(WIDTH / (float)(cfg.x * d.points)),
+                (uint32_t)ceil(HEIGHT / (float)cfg.y),
+                (uint32_t)ceil(DEPTH / (float)cfg.z),
+                0
+            };
+
+            uint64_t overall_cpu_time = 0, overall_time = 0;
+
+            for (unsigned i = 0; i < warmup + average; ++i) {
+                struct timespec start, end, cpu_start, cpu_end;
+                struct dispatch_stats stats = {};
+
+                if (clock_gettime(CLOCK_MONOTONIC, &start) ||
+                        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start))
+                    abort();
+
+                pool_dispatch(pool, &d, grain, &stats);
+
+                if (clock_gettime(CLOCK_MONOTONIC, &end) ||
+                        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end))
+                    abort();
+
+                if (!perf_enabled || i < warmup)
+                    continue;
+
+                uint64_t time_ns = elapsed_ns(&start, &end);
+                uint64_t cpu_time_ns = elapsed_ns(&cpu_start, &cpu_end);
+                // like the CS invocations counter, this includes the ones outside the image
+                uint64_t invocations = (uint64_t)d.numGroups.x * d.numGroups.y * d.numGroups.z *
+                        cfg.x * cfg.y * cfg.z;
+                // lanes that had a pixel to compute, there is no EU occupancy on the CPU
+                int lane_occupancy_pct = (int)(100 * stats.active_lanes / (stats.subgroups * d.simd->lanes));
+
+                if (show_csv) {
+                    fprintf(statsFile, "%d,%d,%d,", cfg.x, cfg.y, cfg.z);
+                    fprintf(statsFile, "%" PRIu64 ",", time_ns);
+                    fprintf(statsFile, "%" PRIu64 ",", stats.subgroups);
+                    fprintf(statsFile, "%" PRIu64 ",", invocations);
+                    fprintf(statsFile, "%" PRIu64 ",", invocations / stats.subgroups);
+                    fprintf(statsFile, "%d,", lane_occupancy_pct);
+                    fprintf(statsFile, "%" PRIu64 ",", cpu_time_ns);
+                    fprintf(statsFile, "%s,", variant->name);
+                    fprintf(statsFile, "%u\n", coarsen);
+                } else {
+                    printf("Lane Occupancy:        %d %%\n", lane_occupancy_pct);
+                    printf("Subgroups (%s x%u):  %" PRIu64 "\n", d.simd->name, d.simd->lanes, stats.subgroups);
+                    printf("Time Elapsed:          %" PRIu64 " ns\n", time_ns);
+                    printf("CS Invocations:        %" PRIu64 "\n", invocations);
+                    printf("CPU Time Elapsed:      %" PRIu64 " ns\n", cpu_time_ns);
+                }
+
+                // load balance: how long each thread ran workgroups, and how many it stole
+                for (unsigned t = 0; t < threads; ++t) {
+                    const struct worker *w = pool->workers[t];
+                    if (show_csv) {
+                        fprintf(threadsFile, "%d,%d,%d,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%s,%u\n", cfg.x, cfg.y, cfg.z,
+                                t, w->busy_ns, time_ns, w->workgroups, w->stolen, variant->name, coarsen);
+                    } else {
+                        printf("Thread %-3u busy:        %" PRIu64 " ns (%d %%), %" PRIu64 " workgroups, %" PRIu64 " tasks stolen\n",
+                                t, w->busy_ns, (int)(100 * w->busy_ns / time_ns),
+                                w->workgroups, w->stolen);
+                    }
+                }
+
+                overall_time += time_ns;
+                overall_cpu_time += cpu_time_ns;
+            }
+
+            if (perf_enabled && !show_csv) {
+                printf("Average Time Elapsed:          %" PRIu64 " ns\n", overall_time / average);
+                printf("Average CPU Time Elapsed:      %" PRIu64 " ns\n", overall_cpu_time / average);
+            }
+
+            struct subgroup_stats sg_stats;
+            if (variant->pixel == PIXEL_SUBGROUP_STATS && get_subgroup_stats(data.data(), WIDTH, HEIGHT, DEPTH, &sg_stats)) {
+                printf("Subgroups:                %" PRIu64 "\n", sg_stats.subgroups);
+                printf("Subgroup Lane Efficiency: %d %%\n",
+                        (int)(100 * sg_stats.lane_iterations / sg_stats.lane_slots));
+            }
+
+            struct color_error color_err;
+            if (num_variants * num_coarsen > 1 &&
+                    color_reference_check(reference, variant, data.data(), WIDTH, HEIGHT, DEPTH, &color_err))
+                printf("Colour Error vs bruteforce: max %f, mean %g, %" PRIu64 " pixels differ\n",
+                        color_err.max, color_err.mean, color_err.pixels);
+
+            if (output.mode != OUTPUT_STATS) {
+                char suffix[64] = "";
+                if (num_variants > 1)
+                    snprintf(suffix, sizeof(suffix), "_%s", variant->name);
+                if (num_coarsen > 1)
+                    snprintf(suffix + strlen(suffix), sizeof(suffix) - strlen(suffix), "_c%u", coarsen);
+                if (configs.size() > 1)
+                    snprintf(suffix + strlen(suffix), sizeof(suffix) - strlen(suffix),
+                            "_%dx%dx%d", cfg.x, cfg.y, cfg.z);
+
+                output_writer_submit(writer, data.data(), WIDTH, HEIGHT, DEPTH, suffix);
+            }
+        }
+    }
+
+    int ret = output_writer_finish(writer);
+    color_reference_destroy(reference);
+    pool_destroy(pool);
+    free(variants);
+
+    if (statsFile)
+        fclose(statsFile);
+    if (threadsFile)
+        fclose(threadsFile);
+
+    return ret;
+}
@@ -7,6 +7,7 @@
 #include <GL/gl.h>
 #include <GL/glext.h>
 #include <gbm.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -130,22 +131,195 @@ query_query(char *name, bool pipeline)
     assert(glGetError() == GL_NO_ERROR);
 }
 
+/* patches the shader source with the given sizes, compiles and links it */
+static GLuint
+create_program(const char *orig_src, int WIDTH, int HEIGHT, int DEPTH,
+        int WORKGROUP_SIZE_X, int WORKGROUP_SIZE_Y, int WORKGROUP_SIZE_Z,
+        bool variable_group_size, const struct kernel_variant *variant, int repeat,
+        unsigned coarsen, bool instrument)
+{
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    if (shader == 0) {
+        fprintf(stderr, "glCreateShader: 0x%x\n", glGetError());
+        exit(2);
+    }
+
+    char *shader_src = strdup(orig_src);
+    if (!shader_src) {
+        perror("strdup");
+        exit(2);
+    }
+
+    char *pos;
+    while ((pos = strstr(shader_src, "WIDTH")) != NULL) {
+        sprintf(pos, "%-4d", WIDTH);
+        *(pos + 4) = ' ';
+    }
+    while ((pos = strstr(shader_src, "HEIGHT")) != NULL) {
+        sprintf(pos, "%-5d", HEIGHT);
+        *(pos + 5) = ' ';
+    }
+    while ((pos = strstr(shader_src, "DEPTH")) != NULL) {
+        sprintf(pos, "%-4d", DEPTH);
+        *(pos + 4) = ' ';
+    }
+    while ((pos = strstr(shader_src, "WORKGROUP_SIZE_X")) != NULL) {
+        sprintf(pos, "%-15d", WORKGROUP_SIZE_X);
+        *(pos + 15) = ' ';
+    }
+    while ((pos = strstr(shader_src, "WORKGROUP_SIZE_Y")) != NULL) {
+        sprintf(pos, "%-15d", WORKGROUP_SIZE_Y);
+        *(pos + 15) = ' ';
+    }
+    while ((pos = strstr(shader_src, "WORKGROUP_SIZE_Z")) != NULL) {
+        sprintf(pos, "%-15d", WORKGROUP_SIZE_Z);
+        *(pos + 15) = ' ';
+    }
+
+    while ((pos = strstr(shader_src, "USE_VARIABLE_GROUP_SIZE")) != NULL) {
+        sprintf(pos, "%-22d", variable_group_size ? 1 : 0);
+        *(pos + 22) = ' ';
+    }
+    // every define of the registry, so that the source doesn't move each
+    // has to be at least as long as its value
+    for (unsigned i = 0; i < variant->num_defines; ++i) {
+        const struct kernel_define *def = &variant->defines[i];
+        int len = strlen(def->name);
+        while ((pos = strstr(shader_src, def->name)) != NULL) {
+            sprintf(pos, "%-*d", len - 1, def->value);
+            *(pos + len - 1) = ' ';
+        }
+    }
+    while ((pos = strstr(shader_src, "REPEAT")) != NULL) {
+        sprintf(pos, "%-5d", repeat);
+        *(pos + 5) = ' ';
+    }
+    while ((pos = strstr(shader_src, "COARSEN")) != NULL) {
+        sprintf(pos, "%-6u", coarsen);
+        *(pos + 6) = ' ';
+    }
+    while ((pos = strstr(shader_src, "INSTRUMENT")) != NULL) {
+        sprintf(pos, "%-9d", instrument ? 1 : 0);
+        *(pos + 9) = ' ';
+    }
+
+    // mesa doesn't support KHR_shader_subgroup in GL
+    if (0) {
+        while ((pos = strstr(shader_src, "USE_SUBGROUPS")) != NULL) {
+            sprintf(pos, "%-12d", 1);
+            *(pos + 12) = ' ';
+        }
+    }
+
+    if (0)
+        printf("%s\n", shader_src);
+
+    GLenum err;
+    const char *const_shader_src = shader_src;
+    glShaderSource(shader, 1, &const_shader_src, NULL);
+    err = glGetError();
+    if (err != GL_NO_ERROR) {
+        fprintf(stderr, "glShaderSource: 0x%x\n", err);
+        exit(2);
+    }
+
+    free(shader_src);
+
+    glCompileShader(shader);
+    err = glGetError();
+    if (err != GL_NO_ERROR) {
+        char b[4096];
+        GLsizei l;
+        glGetShaderInfoLog(shader, sizeof(b), &l, b);
+        fprintf(stderr, "glCompileShader: %s\n", b);
+        exit(2);
+    }
+
+    int compiled;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    assert(glGetError() == GL_NO_ERROR);
+    if (compiled != GL_TRUE) {
+        char b[4096];
+        GLsizei l;
+        glGetShaderInfoLog(shader, sizeof(b), &l, b);
+        fprintf(stderr, "GL_COMPILE_STATUS: %s\n", b);
+        exit(2);
+    }
+
+    assert(compiled == GL_TRUE);
+
+    GLuint prog = glCreateProgram();
+
+    glAttachShader(prog, shader);
+    err = glGetError();
+    if (err != GL_NO_ERROR) {
+        fprintf(stderr, "glAttachShader: 0x%x\n", err);
+        exit(2);
+    }
+
+    glLinkProgram(prog);
+    err = glGetError();
+    if (err != GL_NO_ERROR) {
+        char b[4096];
+        GLsizei l;
+        glGetProgramInfoLog(prog, sizeof(b), &l, b);
+        fprintf(stderr, "glLinkProgram: %s\n", b);
+        exit(2);
+    }
+    int linked;
+    glGetProgramiv(prog, GL_LINK_STATUS, &linked);
+    assert(glGetError() == GL_NO_ERROR);
+    if (linked != GL_TRUE) {
+        char b[4096];
+        GLsizei l;
+        glGetProgramInfoLog(shader, sizeof(b), &l, b);
+        fprintf(stderr, "GL_LINK_STATUS: %s\n", b);
+        exit(2);
+    }
+
+    glUseProgram(prog);
+    err = glGetError();
+    if (err != GL_NO_ERROR) {
+        fprintf(stderr, "glUseProgram: 0x%x\n", err);
+
+        char b[4096];
+        GLsizei l;
+        glGetProgramInfoLog(prog, sizeof(b), &l, b);
+        fprintf(stderr, "%s\n", b);
+        exit(2);
+    }
+
+    /* the program keeps the shader alive for as long as it needs it */
+    glDeleteShader(shader);
+
+    return prog;
+}
+
 int
 main(int argc, char *argv[])
 {
-    if (argc != 9) {
-        fprintf(stderr, "not enough arguments\n");
+    if (argc < 9 || (argc - 6) % 3 != 0) {
+        fprintf(stderr, "Usage: %s DEVICE SHADER IMG_WIDTH IMG_HEIGHT IMG_DEPTH GROUP_X GROUP_Y GROUP_Z [GROUP_X GROUP_Y GROUP_Z]...\n", argv[0]);
         exit(2);
     }
 
     int WIDTH = atoi(argv[3]);
     int HEIGHT = atoi(argv[4]);
     int DEPTH = atoi(argv[5]);
-    int WORKGROUP_SIZE_X = atoi(argv[6]);
-    int WORKGROUP_SIZE_Y = atoi(argv[7]);
-    int WORKGROUP_SIZE_Z = atoi(argv[8]);
     const char *tmp;
 
+    unsigned num_configs = (argc - 6) / 3;
+    struct {
+        int x, y, z;
+    } *configs = calloc(num_configs, sizeof(*configs));
+    for (unsigned c = 0; c < num_configs; ++c) {
+        configs[c].x = atoi(argv[6 + 3 * c + 0]);
+        configs[c].y = atoi(argv[6 + 3 * c + 1]);
+        configs[c].z = atoi(argv[6 + 3 * c + 2]);
+        if (configs[c].x == 0 || configs[c].y == 0 || configs[c].z == 0)
+            abort();
+    }
+
     tmp = getenv("PERF_ENABLED");
     perf.enabled = tmp == NULL || atoi(tmp) > 0;
     if (perf.enabled) {
@@ -158,17 +332,36 @@ main(int argc, char *argv[])
                 perror("fopen stats.csv");
                 exit(2);
             }
-            fprintf(perf.statsFile, "x:int,y:int,z:int,time_ns:int,threads:int,invocations:int,simd:int,thread_occupancy_pct:int,cpu_time_ns:int\n");
+            fprintf(perf.statsFile, "x:int,y:int,z:int,time_ns:int,threads:int,invocations:int,simd:int,thread_occupancy_pct:int,cpu_time_ns:int,variant:string,coarsen:int\n");
         }
     }
 
-    if (WORKGROUP_SIZE_X == 0 || WORKGROUP_SIZE_Y == 0 || WORKGROUP_SIZE_Z == 0||
-            WIDTH == 0 || HEIGHT == 0 || DEPTH == 0)
+    if (WIDTH == 0 || HEIGHT == 0 || DEPTH == 0)
         abort();
 
+    struct output_opts output;
+    get_output_opts(&output);
+
     tmp = getenv("USE_VARIABLE_GROUP_SIZE");
     bool variable_group_size = tmp != NULL && atoi(tmp) > 0;
 
+    // variants using subgroup operations or fp16 aren't registered for gl,
+    // mesa doesn't support KHR_shader_subgroup or explicit fp16 types in GL
+    struct kernel_variant *variants;
+    unsigned num_variants = get_kernel_variants("gl", &variants);
+
+    tmp = getenv("REPEAT");
+    int repeat = tmp ? atoi(tmp) : 100;
+    if (repeat < 1 || repeat > 99999)
+        abort();
+
+    unsigned coarsen_factors[MAX_COARSEN_FACTORS];
+    unsigned num_coarsen = get_coarsen_factors(coarsen_factors);
+
+    // clocks and iterations of every invocation, with GL_ARB_shader_clock
+    tmp = getenv("INSTRUMENT");
+    bool instrument = tmp != NULL && atoi(tmp) > 0;
+
     int fd = open(argv[1], O_RDWR);
     if (fd < 0) {
         perror("open");
@@ -235,6 +428,27 @@ main(int argc, char *argv[])
         exit(2);
     }
 
+    // the tile counter of PERSISTENT variants and the samples of INSTRUMENT,
+    // bound first so that the image buffer stays bound to the generic target
+    // for glMapBuffer
+    GLuint queue;
+    glGenBuffers(1, &queue);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, queue);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    assert(glGetError() == GL_NO_ERROR);
+
+    // the samples of INSTRUMENT, at most one per pixel
+    size_t samples_size = sizeof(struct instrument_sample) * (instrument ? WIDTH * HEIGHT * DEPTH : 1);
+    GLuint samples;
+    glGenBuffers(1, &samples);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, samples);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, samples_size, NULL, GL_STATIC_READ);
+    assert(glGetError() == GL_NO_ERROR);
+
+    GLint max_groups_x;
+    glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &max_groups_x);
+    assert(glGetError() == GL_NO_ERROR);
+
     size_t bufferSize = sizeof(struct Pixel) * WIDTH * HEIGHT * DEPTH;
     GLuint ssbo;
     glGenBuffers(1, &ssbo);
@@ -249,12 +463,6 @@ main(int argc, char *argv[])
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ssbo);
     assert(glGetError() == GL_NO_ERROR);
 
-    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
-    if (shader == 0) {
-        fprintf(stderr, "glCreateShader: 0x%x\n", glGetError());
-        exit(2);
-    }
-
     FILE *f = fopen(argv[2], "r");
     if (!f) {
         perror("fopen");
@@ -285,124 +493,7 @@ main(int argc, char *argv[])
         rem -= r;
     }
     shader_src[st.st_size] = 0;
-
-    char *pos;
-    while ((pos = strstr(shader_src, "WIDTH")) != NULL) {
-        sprintf(pos, "%-4d", WIDTH);
-        *(pos + 4) = ' ';
-    }
-    while ((pos = strstr(shader_src, "HEIGHT")) != NULL) {
-        sprintf(pos, "%-5d", HEIGHT);
-        *(pos + 5) = ' ';
-    }
-    while ((pos = strstr(shader_src, "DEPTH")) != NULL) {
-        sprintf(pos, "%-4d", DEPTH);
-        *(pos + 4) = ' ';
-    }
-    while ((pos = strstr(shader_src, "WORKGROUP_SIZE_X")) != NULL) {
-        sprintf(pos, "%-15d", WORKGROUP_SIZE_X);
-        *(pos + 15) = ' ';
-    }
-    while ((pos = strstr(shader_src, "WORKGROUP_SIZE_Y")) != NULL) {
-        sprintf(pos, "%-15d", WORKGROUP_SIZE_Y);
-        *(pos + 15) = ' ';
-    }
-    while ((pos = strstr(shader_src, "WORKGROUP_SIZE_Z")) != NULL) {
-        sprintf(pos, "%-15d", WORKGROUP_SIZE_Z);
-        *(pos + 15) = ' ';
-    }
-
-    while ((pos = strstr(shader_src, "USE_VARIABLE_GROUP_SIZE")) != NULL) {
-        sprintf(pos, "%-22d", variable_group_size ? 1 : 0);
-        *(pos + 22) = ' ';
-    }
-
-    // mesa doesn't support KHR_shader_subgroup in GL
-    if (0) {
-        while ((pos = strstr(shader_src, "USE_SUBGROUPS")) != NULL) {
-            sprintf(pos, "%-12d", 1);
-            *(pos + 12) = ' ';
-        }
-    }
-
-    if (0)
-        printf("%s\n", shader_src);
-
-    GLenum err;
-    const char *const_shader_src = shader_src;
-    glShaderSource(shader, 1, &const_shader_src, NULL);
-    err = glGetError();
-    if (err != GL_NO_ERROR) {
-        fprintf(stderr, "glShaderSource: 0x%x\n", err);
-        exit(2);
-    }
-
-    free(shader_src);
-    shader_src = NULL;
-
-    glCompileShader(shader);
-    err = glGetError();
-    if (err != GL_NO_ERROR) {
-        char b[4096];
-        GLsizei l;
-        glGetShaderInfoLog(shader, sizeof(b), &l, b);
-        fprintf(stderr, "glCompileShader: %s\n", b);
-        exit(2);
-    }
-
-    int compiled;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-    assert(glGetError() == GL_NO_ERROR);
-    if (compiled != GL_TRUE) {
-        char b[4096];
-        GLsizei l;
-        glGetShaderInfoLog(shader, sizeof(b), &l, b);
-        fprintf(stderr, "GL_COMPILE_STATUS: %s\n", b);
-        exit(2);
-    }
-
-    assert(compiled == GL_TRUE);
-
-    GLuint prog = glCreateProgram();
-
-    glAttachShader(prog, shader);
-    err = glGetError();
-    if (err != GL_NO_ERROR) {
-        fprintf(stderr, "glAttachShader: 0x%x\n", err);
-        exit(2);
-    }
-
-    glLinkProgram(prog);
-    err = glGetError();
-    if (err != GL_NO_ERROR) {
-        char b[4096];
-        GLsizei l;
-        glGetProgramInfoLog(prog, sizeof(b), &l, b);
-        fprintf(stderr, "glLinkProgram: %s\n", b);
-        exit(2);
-    }
-    int linked;
-    glGetProgramiv(prog, GL_LINK_STATUS, &linked);
-    assert(glGetError() == GL_NO_ERROR);
-    if (linked != GL_TRUE) {
-        char b[4096];
-        GLsizei l;
-        glGetProgramInfoLog(shader, sizeof(b), &l, b);
-        fprintf(stderr, "GL_LINK_STATUS: %s\n", b);
-        exit(2);
-    }
-
-    glUseProgram(prog);
-    err = glGetError();
-    if (err != GL_NO_ERROR) {
-        fprintf(stderr, "glUseProgram: 0x%x\n", err);
-
-        char b[4096];
-        GLsizei l;
-        glGetProgramInfoLog(prog, sizeof(b), &l, b);
-        fprintf(stderr, "%s\n", b);
-        exit(2);
-    }
+    fclose(f);
 
     unsigned warmup, average;
     if (perf.enabled) {
@@ -421,181 +512,259 @@ main(int argc, char *argv[])
         warmup = 0;
         average = 1;
     }
-    uint64_t overall_cpu_time = 0, overall_gpu_time = 0;
 
-    for (unsigned i = 0; i < warmup + average; ++i) {
-        struct timespec start, end;
+    unsigned num_runs = num_variants * num_coarsen * num_configs;
+    struct output_writer *writer = output_writer_create(&output, num_runs > 1);
+    struct color_reference *reference = color_reference_create();
 
-        if (perf.enabled) {
-            // perf.dbg = true;
-
-            perf.compute_metrics_basic.off_thread_occupancy_pct = 0;
-            perf.compute_metrics_basic.off_threads = 0;
-            perf.compute_metrics_basic.off_time_ns = 0;
-            perf.pipeline_statistics.off_cs_invocations = 0;
-
-            char qname0[] = "Compute Metrics Basic Gen9";
-            char qname1[] = "Pipeline Statistics Registers";
-            query_query(qname0, false);
-            query_query(qname1, true);
-
-            int err;
-
-            do {
-                glBeginPerfQueryINTEL(perf.compute_metrics_basic.queryHandle);
-                err = glGetError();
-                if (err == GL_INVALID_OPERATION)
-                    usleep(10000);
-            } while (err == GL_INVALID_OPERATION);
-            assert(err == GL_NO_ERROR);
-
-            do {
-                glBeginPerfQueryINTEL(perf.pipeline_statistics.queryHandle);
-                err = glGetError();
-                if (err == GL_INVALID_OPERATION)
-                    usleep(10000);
-            } while (err == GL_INVALID_OPERATION);
-            assert(err == GL_NO_ERROR);
-
-            if (clock_gettime(CLOCK_MONOTONIC, &start))
-                abort();
-        }
+    // all configurations of the first coarsening factor of the first variant,
+    // then of the next factor, then of the next variant
+    for (unsigned r = 0; r < num_runs; ++r) {
+        const struct kernel_variant *variant = &variants[r / (num_coarsen * num_configs)];
+        unsigned coarsen = coarsen_factors[r / num_configs % num_coarsen];
+        unsigned c = r % num_configs;
+        int WORKGROUP_SIZE_X = configs[c].x;
+        int WORKGROUP_SIZE_Y = configs[c].y;
+        int WORKGROUP_SIZE_Z = configs[c].z;
 
-        GLuint num_groups_x = (GLuint)ceil(WIDTH / (float)WORKGROUP_SIZE_X);
-        GLuint num_groups_y = (GLuint)ceil(HEIGHT / (float)WORKGROUP_SIZE_Y);
-        GLuint num_groups_z = (GLuint)ceil(DEPTH / (float)WORKGROUP_SIZE_Z);
+        GLuint prog = create_program(shader_src, WIDTH, HEIGHT, DEPTH,
+                WORKGROUP_SIZE_X, WORKGROUP_SIZE_Y, WORKGROUP_SIZE_Z,
+                variable_group_size, variant, repeat, coarsen, instrument);
 
-        if (variable_group_size) {
-            glDispatchComputeGroupSizeARB(num_groups_x, num_groups_y, num_groups_z,
-                    WORKGROUP_SIZE_X, WORKGROUP_SIZE_Y, WORKGROUP_SIZE_Z);
-        } else {
-            glDispatchCompute(num_groups_x, num_groups_y, num_groups_z);
-        }
-        err = glGetError();
-        if (err != GL_NO_ERROR) {
-            fprintf(stderr, "glDispatchCompute: 0x%x\n", err);
-            exit(2);
+        // invocations without a pixel leave their samples zeroed
+        if (instrument) {
+            glClearNamedBufferData(samples, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+            assert(glGetError() == GL_NO_ERROR);
         }
 
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
-        assert(glGetError() == GL_NO_ERROR);
+        uint64_t overall_cpu_time = 0, overall_gpu_time = 0;
 
-        glFinish();
-        assert(glGetError() == GL_NO_ERROR);
+        for (unsigned i = 0; i < warmup + average; ++i) {
+            struct timespec start, end;
 
-        if (perf.enabled) {
-            if (clock_gettime(CLOCK_MONOTONIC, &end))
-                abort();
+            if (perf.enabled) {
+                // perf.dbg = true;
 
-            glEndPerfQueryINTEL(perf.pipeline_statistics.queryHandle);
-            assert(glGetError() == GL_NO_ERROR);
+                perf.compute_metrics_basic.off_thread_occupancy_pct = 0;
+                perf.compute_metrics_basic.off_threads = 0;
+                perf.compute_metrics_basic.off_time_ns = 0;
+                perf.pipeline_statistics.off_cs_invocations = 0;
 
-            glEndPerfQueryINTEL(perf.compute_metrics_basic.queryHandle);
-            assert(glGetError() == GL_NO_ERROR);
+                char qname0[] = "Compute Metrics Basic Gen9";
+                char qname1[] = "Pipeline Statistics Registers";
+                query_query(qname0, false);
+                query_query(qname1, true);
 
-            uint bytesWritten = 0;
+                int err;
 
-            char *cmb_queryData = malloc(perf.compute_metrics_basic.dataSize);
-            char *ps_queryData = malloc(perf.pipeline_statistics.dataSize);
+                do {
+                    glBeginPerfQueryINTEL(perf.compute_metrics_basic.queryHandle);
+                    err = glGetError();
+                    if (err == GL_INVALID_OPERATION)
+                        usleep(10000);
+                } while (err == GL_INVALID_OPERATION);
+                assert(err == GL_NO_ERROR);
 
-            glGetPerfQueryDataINTEL(perf.compute_metrics_basic.queryHandle,
-                    GL_PERFQUERY_WAIT_INTEL, perf.compute_metrics_basic.dataSize,
-                    cmb_queryData, &bytesWritten);
-            assert(glGetError() == GL_NO_ERROR);
-            if (bytesWritten != perf.compute_metrics_basic.dataSize)
-                abort();
+                do {
+                    glBeginPerfQueryINTEL(perf.pipeline_statistics.queryHandle);
+                    err = glGetError();
+                    if (err == GL_INVALID_OPERATION)
+                        usleep(10000);
+                } while (err == GL_INVALID_OPERATION);
+                assert(err == GL_NO_ERROR);
 
-            glGetPerfQueryDataINTEL(perf.pipeline_statistics.queryHandle,
-                    GL_PERFQUERY_WAIT_INTEL, perf.pipeline_statistics.dataSize,
-                    ps_queryData, &bytesWritten);
-            assert(glGetError() == GL_NO_ERROR);
-            if (bytesWritten != perf.pipeline_statistics.dataSize)
-                abort();
-
-            if (perf.dbg) {
-                printf("CMB:\n");
-                for (unsigned i = 0; i < perf.compute_metrics_basic.dataSize / 8; ++i)
-                    printf("%u %lu\n", i * 8, *(uint64_t *)(cmb_queryData + i * 8));
-                printf("PS:\n");
-                for (unsigned i = 0; i < perf.pipeline_statistics.dataSize / 8; ++i)
-                    printf("%u %lu\n", i * 8, *(uint64_t *)(ps_queryData + i * 8));
+                if (clock_gettime(CLOCK_MONOTONIC, &start))
+                    abort();
             }
 
-            uint64_t threads = 0;
-            uint64_t gpu_time_ns = 0;
-            float thread_occupancy_pct = 0;
-            uint64_t cs_invocations = 0;
-
-            if (perf.compute_metrics_basic.off_threads)
-                threads = *(uint64_t *)(cmb_queryData + perf.compute_metrics_basic.off_threads);
-
-            if (perf.compute_metrics_basic.off_time_ns)
-                gpu_time_ns = *(uint64_t *)(cmb_queryData + perf.compute_metrics_basic.off_time_ns);
-
-            if (perf.compute_metrics_basic.off_thread_occupancy_pct)
-                thread_occupancy_pct = *(float *)(cmb_queryData + perf.compute_metrics_basic.off_thread_occupancy_pct);
-
-            if (perf.pipeline_statistics.off_cs_invocations)
-                cs_invocations = *(uint64_t *)(ps_queryData + perf.pipeline_statistics.off_cs_invocations);
-
-            uint64_t cpu_time_ns = 1000ULL * 1000 * 1000 * (end.tv_sec - start.tv_sec) +
-                    end.tv_nsec - start.tv_nsec;
-
-            if (i >= warmup) {
-                if (perf.show_csv) {
-                    fprintf(perf.statsFile, "%d,%d,%d,", WORKGROUP_SIZE_X, WORKGROUP_SIZE_Y, WORKGROUP_SIZE_Z);
-                    fprintf(perf.statsFile, "%lu,", gpu_time_ns);
-                    fprintf(perf.statsFile, "%lu,", threads);
-                    fprintf(perf.statsFile, "%lu,", cs_invocations);
-                    fprintf(perf.statsFile, "%lu,", threads ? cs_invocations / threads : 0);
-                    fprintf(perf.statsFile, "%d,", (int)thread_occupancy_pct);
-                    fprintf(perf.statsFile, "%lu\n", cpu_time_ns);
-                } else {
-                    printf("EU Thread Occupancy:   %f %%\n", thread_occupancy_pct);
-                    printf("CS Threads Dispatched: %lu\n", threads);
-                    printf("GPU Time Elapsed:      %lu ns\n", gpu_time_ns);
-                    printf("CS Invocations:        %lu\n", cs_invocations);
-                    printf("CPU Time Elapsed:      %lu ns\n", cpu_time_ns);
-                }
+            GLuint num_groups_x = (GLuint)ceil(WIDTH / (float)(WORKGROUP_SIZE_X * coarsen * kernel_variant_points(variant)));
+            GLuint num_groups_y = (GLuint)ceil(HEIGHT / (float)WORKGROUP_SIZE_Y);
+            GLuint num_groups_z = (GLuint)ceil(DEPTH / (float)WORKGROUP_SIZE_Z);
 
-                overall_cpu_time += cpu_time_ns;
-                overall_gpu_time += gpu_time_ns;
+            if (kernel_variant_define(variant, "PERSISTENT")) {
+                num_groups_x = get_persistent_groups(argv[1],
+                        WORKGROUP_SIZE_X * WORKGROUP_SIZE_Y * WORKGROUP_SIZE_Z,
+                        num_groups_x * num_groups_y * num_groups_z, max_groups_x);
+                num_groups_y = num_groups_z = 1;
+
+                const GLuint zero = 0;
+                glNamedBufferSubData(queue, 0, sizeof(zero), &zero);
+                assert(glGetError() == GL_NO_ERROR);
             }
 
-            free(cmb_queryData);
-            free(ps_queryData);
+            if (variable_group_size) {
+                glDispatchComputeGroupSizeARB(num_groups_x, num_groups_y, num_groups_z,
+                        WORKGROUP_SIZE_X, WORKGROUP_SIZE_Y, WORKGROUP_SIZE_Z);
+            } else {
+                glDispatchCompute(num_groups_x, num_groups_y, num_groups_z);
+            }
+            GLenum err = glGetError();
+            if (err != GL_NO_ERROR) {
+                fprintf(stderr, "glDispatchCompute: 0x%x\n", err);
+                exit(2);
+            }
 
-            glDeletePerfQueryINTEL(perf.compute_metrics_basic.queryHandle);
+            glMemoryBarrier(GL_ALL_BARRIER_BITS);
             assert(glGetError() == GL_NO_ERROR);
-            glDeletePerfQueryINTEL(perf.pipeline_statistics.queryHandle);
+
+            glFinish();
             assert(glGetError() == GL_NO_ERROR);
+
+            if (perf.enabled) {
+                if (clock_gettime(CLOCK_MONOTONIC, &end))
+                    abort();
+
+                glEndPerfQueryINTEL(perf.pipeline_statistics.queryHandle);
+                assert(glGetError() == GL_NO_ERROR);
+
+                glEndPerfQueryINTEL(perf.compute_metrics_basic.queryHandle);
+                assert(glGetError() == GL_NO_ERROR);
+
+                uint bytesWritten = 0;
+
+                char *cmb_queryData = malloc(perf.compute_metrics_basic.dataSize);
+                char *ps_queryData = malloc(perf.pipeline_statistics.dataSize);
+
+                glGetPerfQueryDataINTEL(perf.compute_metrics_basic.queryHandle,
+                        GL_PERFQUERY_WAIT_INTEL, perf.compute_metrics_basic.dataSize,
+                        cmb_queryData, &bytesWritten);
+                assert(glGetError() == GL_NO_ERROR);
+                if (bytesWritten != perf.compute_metrics_basic.dataSize)
+                    abort();
+
+                glGetPerfQueryDataINTEL(perf.pipeline_statistics.queryHandle,
+                        GL_PERFQUERY_WAIT_INTEL, perf.pipeline_statistics.dataSize,
+                        ps_queryData, &bytesWritten);
+                assert(glGetError() == GL_NO_ERROR);
+                if (bytesWritten != perf.pipeline_statistics.dataSize)
+                    abort();
+
+                if (perf.dbg) {
+                    printf("CMB:\n");
+                    for (unsigned i = 0; i < perf.compute_metrics_basic.dataSize / 8; ++i)
+                        printf("%u %" PRIu64 "\n", i * 8, *(uint64_t *)(cmb_queryData + i * 8));
+                    printf("PS:\n");
+                    for (unsigned i = 0; i < perf.pipeline_statistics.dataSize / 8; ++i)
+                        printf("%u %" PRIu64 "\n", i * 8, *(uint64_t *)(ps_queryData + i * 8));
+                }
+
+                uint64_t threads = 0;
+                uint64_t gpu_time_ns = 0;
+                float thread_occupancy_pct = 0;
+                uint64_t cs_invocations = 0;
+
+                if (perf.compute_metrics_basic.off_threads)
+                    threads = *(uint64_t *)(cmb_queryData + perf.compute_metrics_basic.off_threads);
+
+                if (perf.compute_metrics_basic.off_time_ns)
+                    gpu_time_ns = *(uint64_t *)(cmb_queryData + perf.compute_metrics_basic.off_time_ns);
+
+                if (perf.compute_metrics_basic.off_thread_occupancy_pct)
+                    thread_occupancy_pct = *(float *)(cmb_queryData + perf.compute_metrics_basic.off_thread_occupancy_pct);
+
+                if (perf.pipeline_statistics.off_cs_invocations)
+                    cs_invocations = *(uint64_t *)(ps_queryData + perf.pipeline_statistics.off_cs_invocations);
+
+                uint64_t cpu_time_ns = 1000ULL * 1000 * 1000 * (end.tv_sec - start.tv_sec) +
+                        end.tv_nsec - start.tv_nsec;
+
+                if (i >= warmup) {
+                    if (perf.show_csv) {
+                        fprintf(perf.statsFile, "%d,%d,%d,", WORKGROUP_SIZE_X, WORKGROUP_SIZE_Y, WORKGROUP_SIZE_Z);
+                        fprintf(perf.statsFile, "%" PRIu64 ",", gpu_time_ns);
+                        fprintf(perf.statsFile, "%" PRIu64 ",", threads);
+                        fprintf(perf.statsFile, "%" PRIu64 ",", cs_invocations);
+                        fprintf(perf.statsFile, "%" PRIu64 ",", threads ? cs_invocations / threads : 0);
+                        fprintf(perf.statsFile, "%d,", (int)thread_occupancy_pct);
+                        fprintf(perf.statsFile, "%" PRIu64 ",", cpu_time_ns);
+                        fprintf(perf.statsFile, "%s,", variant->name);
+                        fprintf(perf.statsFile, "%u\n", coarsen);
+                    } else {
+                        printf("EU Thread Occupancy:   %f %%\n", thread_occupancy_pct);
+                        printf("CS Threads Dispatched: %" PRIu64 "\n", threads);
+                        printf("GPU Time Elapsed:      %" PRIu64 " ns\n", gpu_time_ns);
+                        printf("CS Invocations:        %" PRIu64 "\n", cs_invocations);
+                        printf("CPU Time Elapsed:      %" PRIu64 " ns\n", cpu_time_ns);
+                        if (kernel_variant_define(variant, "PERSISTENT"))
+                            printf("Persistent Workgroups: %u\n", num_groups_x);
+                    }
+
+                    overall_cpu_time += cpu_time_ns;
+                    overall_gpu_time += gpu_time_ns;
+                }
+
+                free(cmb_queryData);
+                free(ps_queryData);
+
+                glDeletePerfQueryINTEL(perf.compute_metrics_basic.queryHandle);
+                assert(glGetError() == GL_NO_ERROR);
+                glDeletePerfQueryINTEL(perf.pipeline_statistics.queryHandle);
+                assert(glGetError() == GL_NO_ERROR);
+            }
         }
-    }
 
-    if (perf.enabled) {
-        if (perf.show_csv) {
-            // taking average is on the user's side
-        } else {
-            printf("Average GPU Time Elapsed:      %lu ns\n", overall_gpu_time / average);
-            printf("Average CPU Time Elapsed:      %lu ns\n", overall_cpu_time / average);
+        if (perf.enabled) {
+            if (perf.show_csv) {
+                // taking average is on the user's side
+            } else {
+                printf("Average GPU Time Elapsed:      %" PRIu64 " ns\n", overall_gpu_time / average);
+                printf("Average CPU Time Elapsed:      %" PRIu64 " ns\n", overall_cpu_time / average);
+            }
         }
-    }
 
-    struct Pixel *result = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
-    if (!result) {
-        fprintf(stderr, "glMapBuffer: 0x%x\n", glGetError());
-        exit(2);
-    }
+        char suffix[64] = "";
+        if (num_variants > 1)
+            snprintf(suffix, sizeof(suffix), "_%s", variant->name);
+        if (num_coarsen > 1)
+            snprintf(suffix + strlen(suffix), sizeof(suffix) - strlen(suffix), "_c%u", coarsen);
+        if (num_configs > 1)
+            snprintf(suffix + strlen(suffix), sizeof(suffix) - strlen(suffix), "_%dx%dx%d",
+                    WORKGROUP_SIZE_X, WORKGROUP_SIZE_Y, WORKGROUP_SIZE_Z);
+
+        if (instrument) {
+            struct instrument_sample *s = glMapNamedBuffer(samples, GL_READ_ONLY);
+            if (!s) {
+                fprintf(stderr, "glMapNamedBuffer: 0x%x\n", glGetError());
+                exit(2);
+            }
+            if (save_instrumentation(s, (size_t)WIDTH * HEIGHT * DEPTH, suffix))
+                exit(2);
+            glUnmapNamedBuffer(samples);
+        }
+
+        // with several variants or coarsening factors the image is also read
+        // back to compare its colours with the ones of bruteforce
+        if (output.mode != OUTPUT_STATS || num_variants * num_coarsen > 1) {
+            struct Pixel *result = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+            if (!result) {
+                fprintf(stderr, "glMapBuffer: 0x%x\n", glGetError());
+                exit(2);
+            }
 
-    save_data(result, WIDTH, HEIGHT, DEPTH);
+            struct color_error color_err;
+            if (color_reference_check(reference, variant, result, WIDTH, HEIGHT, DEPTH, &color_err))
+                printf("Colour Error vs bruteforce: max %f, mean %g, %" PRIu64 " pixels differ\n",
+                        color_err.max, color_err.mean, color_err.pixels);
 
-    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+            if (output.mode != OUTPUT_STATS)
+                output_writer_submit(writer, result, WIDTH, HEIGHT, DEPTH, suffix);
 
-    glDeleteShader(shader);
-    glDeleteProgram(prog);
+            glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+        }
+
+        glDeleteProgram(prog);
+
+    }
+
+    int ret = output_writer_finish(writer);
+    color_reference_destroy(reference);
+
+    free(shader_src);
+    free(configs);
+    free(variants);
     eglDestroyContext(disp, ctx);
     eglTerminate(disp);
     gbm_device_destroy(gbm);
     close(fd);
-    return 0;
+    return ret;
 }
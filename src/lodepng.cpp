@@ -39,6 +39,25 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
 #endif /*_MSC_VER */
 
+/*instruction sets for the SIMD code paths, see LODEPNG_COMPILE_SIMD*/
+#if defined(LODEPNG_COMPILE_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_SIMD_X86 /*SSE2, AVX2 and PCLMULQDQ, checked with __builtin_cpu_supports*/
+#include <immintrin.h>
+#elif defined(LODEPNG_COMPILE_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define LODEPNG_SIMD_NEON /*NEON is part of the aarch64 baseline*/
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_CRC32)
+#define LODEPNG_SIMD_ARM_CRC32
+#include <arm_acle.h>
+#elif defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+/*the CRC instructions are optional before ARMv8.1, check HWCAP_CRC32 at runtime*/
+#define LODEPNG_SIMD_ARM_CRC32
+#define LODEPNG_SIMD_ARM_CRC32_HWCAP
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
 const char* LODEPNG_VERSION_STRING = "20161127";
 
 /*
@@ -60,24 +79,70 @@ lodepng source code. Don't forget to remove "static" if you copypaste them
 from here.*/
 
 #ifdef LODEPNG_COMPILE_ALLOCATORS
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define LODEPNG_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define LODEPNG_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define LODEPNG_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define LODEPNG_THREAD_LOCAL __declspec(thread)
+#else
+#define LODEPNG_THREAD_LOCAL /*assume a single thread*/
+#endif
+
+/*the allocator of the encode or decode running on this thread, null for malloc, realloc and free*/
+static LODEPNG_THREAD_LOCAL const LodePNGAllocator* lodepng_allocator = 0;
+
 static void* lodepng_malloc(size_t size)
 {
+  if(lodepng_allocator) return lodepng_allocator->allocate(lodepng_allocator->user, size);
   return malloc(size);
 }
 
 static void* lodepng_realloc(void* ptr, size_t new_size)
 {
+  if(lodepng_allocator) return lodepng_allocator->reallocate(lodepng_allocator->user, ptr, new_size);
   return realloc(ptr, new_size);
 }
 
 static void lodepng_free(void* ptr)
 {
-  free(ptr);
+  if(lodepng_allocator) lodepng_allocator->deallocate(lodepng_allocator->user, ptr);
+  else free(ptr);
+}
+
+/*makes allocator the one of this thread, returns the previous one to restore it with*/
+static const LodePNGAllocator* lodepng_set_allocator(const LodePNGAllocator* allocator)
+{
+  const LodePNGAllocator* previous = lodepng_allocator;
+  lodepng_allocator = allocator;
+  return previous;
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+static const LodePNGAllocator* lodepng_get_allocator(void)
+{
+  return lodepng_allocator;
 }
+#endif /*LODEPNG_COMPILE_THREADS*/
 #else /*LODEPNG_COMPILE_ALLOCATORS*/
 void* lodepng_malloc(size_t size);
 void* lodepng_realloc(void* ptr, size_t new_size);
 void lodepng_free(void* ptr);
+
+static const LodePNGAllocator* lodepng_set_allocator(const LodePNGAllocator* allocator)
+{
+  (void)allocator;
+  return 0;
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+static const LodePNGAllocator* lodepng_get_allocator(void)
+{
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
 #endif /*LODEPNG_COMPILE_ALLOCATORS*/
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -409,37 +474,276 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 
 #endif /*LODEPNG_COMPILE_DISK*/
 
-/* ////////////////////////////////////////////////////////////////////////// */
-/* ////////////////////////////////////////////////////////////////////////// */
-/* // End of common code and tools. Begin of Zlib related code.            // */
-/* ////////////////////////////////////////////////////////////////////////// */
-/* ////////////////////////////////////////////////////////////////////////// */
+#ifdef LODEPNG_COMPILE_THREADS
+#include <pthread.h>
 
-#ifdef LODEPNG_COMPILE_ZLIB
-#ifdef LODEPNG_COMPILE_ENCODER
-/*TODO: this ignores potential out of memory errors*/
-#define addBitToStream(/*size_t**/ bitpointer, /*ucvector**/ bitstream, /*unsigned char*/ bit)\
-{\
-  /*add a new byte at the end*/\
-  if(((*bitpointer) & 7) == 0) ucvector_push_back(bitstream, (unsigned char)0);\
-  /*earlier bit of huffman code is in a lesser significant bit of an earlier byte*/\
-  (bitstream->data[bitstream->size - 1]) |= (bit << ((*bitpointer) & 0x7));\
-  ++(*bitpointer);\
+/*
+Runs fn on each of the n jobs, which are jobsize bytes apart: n - 1 of them on new
+threads and the first one on the calling thread. Jobs that did not get a thread (if
+creating one fails) also run on the calling thread.
+*/
+typedef struct ParallelThread
+{
+  pthread_t thread;
+  void* (*fn)(void*);
+  void* job;
+  const LodePNGAllocator* allocator; /*of the calling thread*/
+} ParallelThread;
+
+static void* parallelThread(void* arg)
+{
+  ParallelThread* thread = (ParallelThread*)arg;
+  lodepng_set_allocator(thread->allocator);
+  return thread->fn(thread->job);
 }
 
-static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
+static void lodepng_parallel(void* (*fn)(void*), void* jobs, size_t jobsize, unsigned n)
 {
-  size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> i) & 1));
+  ParallelThread* threads = n > 1 ? (ParallelThread*)lodepng_malloc(sizeof(ParallelThread) * (n - 1)) : 0;
+  const LodePNGAllocator* allocator = lodepng_get_allocator();
+  unsigned i, numstarted = 0;
+  if(threads)
+  {
+    for(i = 1; i < n; ++i)
+    {
+      threads[i - 1].fn = fn;
+      threads[i - 1].job = (char*)jobs + i * jobsize;
+      threads[i - 1].allocator = allocator;
+      if(pthread_create(&threads[i - 1].thread, 0, parallelThread, &threads[i - 1])) break;
+      ++numstarted;
+    }
+  }
+  fn(jobs);
+  for(i = numstarted + 1; i < n; ++i) fn((char*)jobs + i * jobsize);
+  for(i = 0; i != numstarted; ++i) pthread_join(threads[i].thread, 0);
+  lodepng_free(threads);
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+/*
+The blocks of an arena start with an ArenaBlock, padded to ARENA_ALIGN. Every allocation
+is preceded by ARENA_ALIGN bytes holding its size, for realloc.
+*/
+#define ARENA_ALIGN 16u
+#define ARENA_ROUND(size) (((size) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_BLOCKHEADER ARENA_ROUND(sizeof(ArenaBlock))
+
+typedef struct ArenaBlock
+{
+  struct ArenaBlock* next; /*the older blocks*/
+  size_t size; /*bytes after the header*/
+  size_t used;
+} ArenaBlock;
+
+struct LodePNGArena
+{
+  LodePNGAllocator allocator;
+  ArenaBlock* blocks; /*the one allocations are taken from, then the full ones*/
+  size_t blocksize;
+  unsigned char* last; /*most recent allocation, it can grow or be freed in place*/
+#ifdef LODEPNG_COMPILE_THREADS
+  pthread_mutex_t lock;
+#endif /*LODEPNG_COMPILE_THREADS*/
+};
+
+static unsigned char* arenaBlockData(ArenaBlock* block)
+{
+  return (unsigned char*)block + ARENA_BLOCKHEADER;
 }
 
-static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
+static size_t* arenaSize(unsigned char* ptr)
 {
-  size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
+  return (size_t*)(ptr - ARENA_ALIGN);
+}
+
+static unsigned arenaOwns(const LodePNGArena* arena, const unsigned char* ptr)
+{
+  ArenaBlock* block;
+  for(block = arena->blocks; block; block = block->next)
+  {
+    if(ptr >= arenaBlockData(block) && ptr < arenaBlockData(block) + block->size) return 1;
+  }
+  return 0;
+}
+
+static ArenaBlock* arenaNewBlock(size_t size)
+{
+  ArenaBlock* block = (ArenaBlock*)malloc(ARENA_BLOCKHEADER + size);
+  if(!block) return 0;
+  block->next = 0;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+static void* arenaAllocate(LodePNGArena* arena, size_t size)
+{
+  size_t needed;
+  ArenaBlock* block = arena->blocks;
+  unsigned char* ptr;
+  if(size > ((size_t)(-1) >> 1)) return 0;
+  needed = ARENA_ALIGN + ARENA_ROUND(size);
+  if(!block || block->size - block->used < needed)
+  {
+    block = arenaNewBlock(needed > arena->blocksize ? needed : arena->blocksize);
+    if(!block) return 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+  ptr = arenaBlockData(block) + block->used + ARENA_ALIGN;
+  *arenaSize(ptr) = size;
+  block->used += needed;
+  arena->last = ptr;
+  return ptr;
+}
+
+static void* arenaReallocate(LodePNGArena* arena, unsigned char* ptr, size_t size)
+{
+  unsigned char* result;
+  size_t oldsize = *arenaSize(ptr);
+  if(ptr == arena->last && size <= ((size_t)(-1) >> 1))
+  {
+    ArenaBlock* block = arena->blocks;
+    size_t start = (size_t)(ptr - arenaBlockData(block));
+    if(start + ARENA_ROUND(size) <= block->size)
+    {
+      block->used = start + ARENA_ROUND(size);
+      *arenaSize(ptr) = size;
+      return ptr;
+    }
+  }
+  else if(size <= oldsize)
+  {
+    *arenaSize(ptr) = size;
+    return ptr;
+  }
+  result = (unsigned char*)arenaAllocate(arena, size);
+  if(result) memcpy(result, ptr, oldsize < size ? oldsize : size);
+  return result;
+}
+
+static void arenaLock(LodePNGArena* arena)
+{
+#ifdef LODEPNG_COMPILE_THREADS
+  pthread_mutex_lock(&arena->lock);
+#else /*LODEPNG_COMPILE_THREADS*/
+  (void)arena;
+#endif /*LODEPNG_COMPILE_THREADS*/
+}
+
+static void arenaUnlock(LodePNGArena* arena)
+{
+#ifdef LODEPNG_COMPILE_THREADS
+  pthread_mutex_unlock(&arena->lock);
+#else /*LODEPNG_COMPILE_THREADS*/
+  (void)arena;
+#endif /*LODEPNG_COMPILE_THREADS*/
+}
+
+static void* arena_allocate(void* user, size_t size)
+{
+  LodePNGArena* arena = (LodePNGArena*)user;
+  void* result;
+  arenaLock(arena);
+  result = arenaAllocate(arena, size);
+  arenaUnlock(arena);
+  return result;
+}
+
+static void* arena_reallocate(void* user, void* ptr, size_t size)
+{
+  LodePNGArena* arena = (LodePNGArena*)user;
+  void* result;
+  arenaLock(arena);
+  if(!ptr) result = arenaAllocate(arena, size);
+  else if(arenaOwns(arena, (unsigned char*)ptr)) result = arenaReallocate(arena, (unsigned char*)ptr, size);
+  else result = realloc(ptr, size);
+  arenaUnlock(arena);
+  return result;
+}
+
+static void arena_deallocate(void* user, void* ptr)
+{
+  LodePNGArena* arena = (LodePNGArena*)user;
+  if(!ptr) return;
+  arenaLock(arena);
+  if((unsigned char*)ptr == arena->last)
+  {
+    arena->blocks->used = (size_t)(arena->last - ARENA_ALIGN - arenaBlockData(arena->blocks));
+    arena->last = 0;
+  }
+  else if(!arenaOwns(arena, (unsigned char*)ptr)) free(ptr);
+  arenaUnlock(arena);
+}
+
+LodePNGArena* lodepng_arena_new(size_t blocksize)
+{
+  LodePNGArena* arena = (LodePNGArena*)malloc(sizeof(LodePNGArena));
+  if(!arena) return 0;
+  arena->allocator.allocate = arena_allocate;
+  arena->allocator.reallocate = arena_reallocate;
+  arena->allocator.deallocate = arena_deallocate;
+  arena->allocator.user = arena;
+  arena->blocks = 0;
+  arena->blocksize = ARENA_ROUND(blocksize ? blocksize : 1048576u);
+  arena->last = 0;
+#ifdef LODEPNG_COMPILE_THREADS
+  pthread_mutex_init(&arena->lock, 0);
+#endif /*LODEPNG_COMPILE_THREADS*/
+  return arena;
+}
+
+const LodePNGAllocator* lodepng_arena_allocator(LodePNGArena* arena)
+{
+  return arena ? &arena->allocator : 0;
 }
-#endif /*LODEPNG_COMPILE_ENCODER*/
 
+static void arenaFreeBlocks(LodePNGArena* arena)
+{
+  while(arena->blocks)
+  {
+    ArenaBlock* next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+}
+
+void lodepng_arena_reset(LodePNGArena* arena)
+{
+  size_t total = 0;
+  ArenaBlock* block;
+  if(!arena) return;
+  arena->last = 0;
+  if(!arena->blocks) return;
+  if(!arena->blocks->next)
+  {
+    arena->blocks->used = 0;
+    return;
+  }
+  for(block = arena->blocks; block; block = block->next) total += block->size;
+  arenaFreeBlocks(arena);
+  arena->blocks = arenaNewBlock(total); /*if this fails, blocks are allocated again as needed*/
+}
+
+void lodepng_arena_delete(LodePNGArena* arena)
+{
+  if(!arena) return;
+  arenaFreeBlocks(arena);
+#ifdef LODEPNG_COMPILE_THREADS
+  pthread_mutex_destroy(&arena->lock);
+#endif /*LODEPNG_COMPILE_THREADS*/
+  free(arena);
+}
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* ////////////////////////////////////////////////////////////////////////// */
+/* // End of common code and tools. Begin of Zlib related code.            // */
+/* ////////////////////////////////////////////////////////////////////////// */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#ifdef LODEPNG_COMPILE_ZLIB
 #ifdef LODEPNG_COMPILE_DECODER
 
 #define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
@@ -508,7 +812,10 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
+  /*decoding tables, see HuffmanTree_makeTable: the code length and symbol for the next
+  FIRSTBITS bits of input, for longer codes the index of a second table instead*/
+  unsigned char* table_len;
+  unsigned short* table_value;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
@@ -530,77 +837,25 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+static unsigned reverseBits(unsigned bits, unsigned num)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
-
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
-
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffman tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; ++n)
-  {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
-  }
-
-  for(n = 0; n < tree->numcodes; ++n) /*the codes*/
-  {
-    for(i = 0; i != tree->lengths[n]; ++i) /*the bits for this code*/
-    {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      /*oversubscribed, see comment in lodepng_error_text*/
-      if(treepos > 2147483647 || treepos + 2 > tree->numcodes) return 55;
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
-      {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          ++nodefilled;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
-      }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
-    }
-  }
-
-  for(n = 0; n < tree->numcodes * 2; ++n)
-  {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
-  }
-
-  return 0;
+  unsigned i, result = 0;
+  for(i = 0; i != num; ++i) result |= ((bits >> i) & 1u) << (num - i - 1u);
+  return result;
 }
 
 /*
@@ -634,18 +889,18 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
     {
       nextcode.data[bits] = (nextcode.data[bits - 1] + blcount.data[bits - 1]) << 1;
     }
-    /*step 3: generate all the codes*/
+    /*step 3: generate all the codes. They are stored reversed, in the order of the bits in the
+    stream: the first (most significant) bit of the code in the least significant bit*/
     for(n = 0; n != tree->numcodes; ++n)
     {
-      if(tree->lengths[n] != 0) tree->tree1d[n] = nextcode.data[tree->lengths[n]]++;
+      if(tree->lengths[n] != 0) tree->tree1d[n] = reverseBits(nextcode.data[tree->lengths[n]]++, tree->lengths[n]);
     }
   }
 
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+  return error;
 }
 
 /*
@@ -940,6 +1195,174 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
+/*the number of input bits the first decoding table of a HuffmanTree is indexed with*/
+#define FIRSTBITS 9u
+/*table_value of the unused entries of a tree with fewer than 2 codes*/
+#define INVALIDSYMBOL 65535u
+
+/*
+Makes the decoding tables from the tree1d codes and lengths, as zlib and libdeflate do:
+the first table is indexed with the next FIRSTBITS bits of input and gives the code
+length and symbol at once. Codes longer than FIRSTBITS share a first table entry with
+the other codes with the same first bits, that entry gives the longest of their
+lengths and where their second table starts, indexed with the remaining bits.
+return value is error.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
+{
+  static const unsigned headsize = 1u << FIRSTBITS; /*size of the first table*/
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  size_t i, numpresent, pointer, size; /*size: of all tables together*/
+  unsigned* maxlens = (unsigned*)lodepng_malloc(headsize * sizeof(unsigned));
+  if(!maxlens) return 83; /*alloc fail*/
+
+  /*the longest code length of each first table entry*/
+  for(i = 0; i != headsize; ++i) maxlens[i] = 0;
+  for(i = 0; i != tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue; /*these do not need a second table*/
+    index = tree->tree1d[i] & mask;
+    if(maxlens[index] < l) maxlens[index] = l;
+  }
+  size = headsize;
+  for(i = 0; i != headsize; ++i)
+  {
+    if(maxlens[i] > FIRSTBITS) size += (size_t)1u << (maxlens[i] - FIRSTBITS);
+  }
+
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(unsigned char));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(unsigned short));
+  if(!tree->table_len || !tree->table_value)
+  {
+    lodepng_free(maxlens);
+    return 83; /*alloc fail*/
+  }
+  for(i = 0; i != size; ++i) tree->table_len[i] = 16; /*16 marks an entry not filled in yet*/
+
+  /*the first table entries of the long codes*/
+  pointer = headsize;
+  for(i = 0; i != headsize; ++i)
+  {
+    unsigned l = maxlens[i];
+    if(l <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)l;
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += (size_t)1u << (l - FIRSTBITS);
+  }
+  lodepng_free(maxlens);
+
+  numpresent = 0;
+  for(i = 0; i != tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned reverse = tree->tree1d[i]; /*the code, in the order it is read*/
+    unsigned j;
+    if(l == 0) continue;
+    ++numpresent;
+
+    if(l <= FIRSTBITS)
+    {
+      /*every entry starting with the code, whatever the following input bits are*/
+      unsigned num = 1u << (FIRSTBITS - l);
+      for(j = 0; j != num; ++j)
+      {
+        unsigned index = reverse | (j << l);
+        if(tree->table_len[index] != 16) return 55; /*oversubscribed, see comment in lodepng_error_text*/
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reverse & mask;
+      unsigned maxlen = tree->table_len[index];
+      unsigned start = tree->table_value[index];
+      unsigned num;
+      if(maxlen < l || maxlen == 16) return 55; /*a short code is a prefix of this one*/
+      num = 1u << (maxlen - l);
+      for(j = 0; j != num; ++j)
+      {
+        unsigned index2 = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        if(tree->table_len[index2] != 16) return 55; /*oversubscribed, see comment in lodepng_error_text*/
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
+      }
+    }
+  }
+
+  if(numpresent < 2)
+  {
+    /*with a single code, deflate uses 1 bit for it, and a distance tree may have no codes at all
+    if no distances are used. The rest of the table decodes to an invalid symbol. As length use
+    at most FIRSTBITS in the first table and more in the second, like the real entries.*/
+    for(i = 0; i != size; ++i)
+    {
+      if(tree->table_len[i] == 16)
+      {
+        tree->table_len[i] = (unsigned char)(i < headsize ? 1 : FIRSTBITS + 1);
+        tree->table_value[i] = INVALIDSYMBOL;
+      }
+    }
+  }
+  else
+  {
+    /*a complete tree fills every entry, if not the codes are too long for their amount
+    (undersubscribed): some inputs can not be decoded*/
+    for(i = 0; i != size; ++i)
+    {
+      if(tree->table_len[i] == 16) return 55;
+    }
+  }
+
+  return 0;
+}
+
+/*
+The 64 bits of input from bit bp on, the bit at bp in the least significant bit. Past the
+end of the input, the bits are 0. At least 57 bits are valid after bp, enough for a length
+code, its extra bits, a distance code and its extra bits.
+*/
+static unsigned long long peekBits(const unsigned char* in, size_t inlength, size_t bp)
+{
+  size_t p = bp >> 3;
+  unsigned long long result = 0;
+  if(p + 8 <= inlength)
+  {
+    /*compilers turn this into a single load on little endian machines*/
+    result = (unsigned long long)in[p] | ((unsigned long long)in[p + 1] << 8u)
+           | ((unsigned long long)in[p + 2] << 16u) | ((unsigned long long)in[p + 3] << 24u)
+           | ((unsigned long long)in[p + 4] << 32u) | ((unsigned long long)in[p + 5] << 40u)
+           | ((unsigned long long)in[p + 6] << 48u) | ((unsigned long long)in[p + 7] << 56u);
+  }
+  else
+  {
+    unsigned i;
+    for(i = 0; p + i < inlength && i != 8; ++i) result |= (unsigned long long)in[p + i] << (8u * i);
+  }
+  return result >> (bp & 7u);
+}
+
+/*
+Decodes the symbol at the start of bits (from peekBits) and sets *numbits to its length.
+Returns INVALIDSYMBOL for input that does not decode.
+*/
+static unsigned huffmanDecodeBits(const HuffmanTree* codetree, unsigned long long bits, unsigned* numbits)
+{
+  unsigned index = (unsigned)bits & ((1u << FIRSTBITS) - 1u);
+  unsigned l = codetree->table_len[index];
+  if(l <= FIRSTBITS)
+  {
+    *numbits = l;
+    return codetree->table_value[index];
+  }
+  /*long code: the first table entry gives the longest length of the second table*/
+  index = codetree->table_value[index] + ((unsigned)(bits >> FIRSTBITS) & ((1u << (l - FIRSTBITS)) - 1u));
+  *numbits = codetree->table_len[index];
+  return codetree->table_value[index];
+}
+
 /*
 returns the code, or (unsigned)(-1) if error happened
 inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
@@ -947,21 +1370,12 @@ inbitlength is the length of the complete buffer, in bits (so its byte length ti
 static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
                                     const HuffmanTree* codetree, size_t inbitlength)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
-  {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    ++(*bp);
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
-  }
+  unsigned numbits;
+  unsigned code = huffmanDecodeBits(codetree, peekBits(in, inbitlength / 8, *bp), &numbits);
+  *bp += numbits;
+  if(*bp > inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
+  if(code == INVALIDSYMBOL) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+  return code;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -972,11 +1386,13 @@ static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
 /* ////////////////////////////////////////////////////////////////////////// */
 
 /*get the tree of a deflated block with fixed tree, as specified in the deflate specification*/
-static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
+static unsigned getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 {
-  /*TODO: check for out of memory errors*/
-  generateFixedLitLenTree(tree_ll);
-  generateFixedDistanceTree(tree_d);
+  unsigned error = generateFixedLitLenTree(tree_ll);
+  if(!error) error = generateFixedDistanceTree(tree_d);
+  if(!error) error = HuffmanTree_makeTable(tree_ll);
+  if(!error) error = HuffmanTree_makeTable(tree_d);
+  return error;
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
@@ -1022,6 +1438,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     }
 
     error = HuffmanTree_makeFromLengths(&tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
+    if(!error) error = HuffmanTree_makeTable(&tree_cl);
     if(error) break;
 
     /*now we can use this tree to read the lengths for the tree that this function will return*/
@@ -1113,8 +1530,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     /*now we've finally got HLIT and HDIST, so generate the code trees, and the function is done*/
     error = HuffmanTree_makeFromLengths(tree_ll, bitlen_ll, NUM_DEFLATE_CODE_SYMBOLS, 15);
+    if(!error) error = HuffmanTree_makeTable(tree_ll);
     if(error) break;
     error = HuffmanTree_makeFromLengths(tree_d, bitlen_d, NUM_DISTANCE_SYMBOLS, 15);
+    if(!error) error = HuffmanTree_makeTable(tree_d);
 
     break; /*end of error-while*/
   }
@@ -1139,13 +1558,20 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
 
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
+  if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
   else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
+    /*one read gives enough bits for a length code, a distance code and their extra bits*/
+    unsigned long long bits = peekBits(in, inlength, *bp);
+    unsigned numbits;
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll = huffmanDecodeBits(&tree_ll, bits, &numbits);
+    *bp += numbits;
+    bits >>= numbits;
+    if(*bp > inbitlength) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
+
     if(code_ll <= 255) /*literal symbol*/
     {
       /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
@@ -1164,19 +1590,19 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if((*bp + numextrabits_l) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      *bp += numextrabits_l;
+      if(*bp > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
+      length += (size_t)(bits & ((1u << numextrabits_l) - 1u));
+      bits >>= numextrabits_l;
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      code_d = huffmanDecodeBits(&tree_d, bits, &numbits);
+      *bp += numbits;
+      bits >>= numbits;
+      if(*bp > inbitlength) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
       if(code_d > 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
-        }
+        if(code_d == INVALIDSYMBOL) error = 11; /*error: it appeared outside the codetree*/
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
       }
@@ -1184,8 +1610,9 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if((*bp + numextrabits_d) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      *bp += numextrabits_d;
+      if(*bp > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
+      distance += (unsigned)(bits & ((1u << numextrabits_d) - 1u));
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
       start = (*pos);
@@ -1207,11 +1634,9 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
     {
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else /*code 286 or 287, or not in the tree*/
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-      (10=no endcode, 11=wrong jump outside of tree)*/
-      error = ((*bp) > inlength * 8) ? 10 : 11;
+      error = 11; /*error: it appeared outside the codetree*/
       break;
     }
   }
@@ -1225,7 +1650,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
 {
   size_t p;
-  unsigned LEN, NLEN, n, error = 0;
+  unsigned LEN, NLEN, error = 0;
 
   /*go to first boundary of byte*/
   while(((*bp) & 0x7) != 0) ++(*bp);
@@ -1243,7 +1668,9 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
 
   /*read the literal data: LEN bytes are now stored in the out buffer*/
   if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
-  for(n = 0; n < LEN; ++n) out->data[(*pos)++] = in[p++];
+  if(LEN) memcpy(out->data + *pos, in + p, LEN);
+  *pos += LEN;
+  p += LEN;
 
   (*bp) = p * 8;
 
@@ -1286,10 +1713,12 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
 {
   unsigned error;
   ucvector v;
+  const LodePNGAllocator* previous = lodepng_set_allocator(settings->allocator);
   ucvector_init_buffer(&v, *out, *outsize);
   error = lodepng_inflatev(&v, in, insize, settings);
   *out = v.data;
   *outsize = v.size;
+  lodepng_set_allocator(previous);
   return error;
 }
 
@@ -1317,10 +1746,63 @@ static unsigned inflate(unsigned char** out, size_t* outsize,
 
 static const size_t MAX_SUPPORTED_DEFLATE_LENGTH = 258;
 
-/*bitlen is the size in bits of the code*/
-static void addHuffmanSymbol(size_t* bp, ucvector* compressed, unsigned code, unsigned bitlen)
+/*
+Writes the deflate bit stream, first bit in the least significant bit of a byte. The bits
+collect in a 64-bit accumulator and go to the output 32 bits at a time.
+*/
+typedef struct BitWriter
 {
-  addBitsToStreamReversed(bp, compressed, code, bitlen);
+  ucvector* out;
+  unsigned long long buffer; /*the bits not yet in out, the first in the least significant bit*/
+  unsigned count; /*number of bits in buffer, less than 32 between calls*/
+  unsigned error; /*set to 83 if out could not grow, then nothing more is written*/
+} BitWriter;
+
+static void BitWriter_init(BitWriter* writer, ucvector* out)
+{
+  writer->out = out;
+  writer->buffer = 0;
+  writer->count = 0;
+  writer->error = 0;
+}
+
+/*moves nbytes bytes from the accumulator to the output*/
+static void BitWriter_store(BitWriter* writer, unsigned nbytes)
+{
+  ucvector* out = writer->out;
+  unsigned i;
+  if(out->size + nbytes > out->allocsize && !ucvector_reserve(out, out->size + nbytes))
+  {
+    writer->error = 83; /*alloc fail*/
+  }
+  if(!writer->error)
+  {
+    for(i = 0; i != nbytes; ++i) out->data[out->size + i] = (unsigned char)(writer->buffer >> (8u * i));
+    out->size += nbytes;
+  }
+  writer->buffer >>= 8u * nbytes;
+  writer->count -= 8u * nbytes;
+}
+
+/*appends the nbits (at most 32) lowest bits of value, the higher bits of value must be 0*/
+static void writeBits(BitWriter* writer, unsigned value, unsigned nbits)
+{
+  writer->buffer |= (unsigned long long)value << writer->count;
+  writer->count += nbits;
+  if(writer->count >= 32) BitWriter_store(writer, 4);
+}
+
+/*writes the remaining bits, with 0 bits up to the byte boundary*/
+static void BitWriter_flush(BitWriter* writer)
+{
+  writer->count = (writer->count + 7u) & ~7u;
+  BitWriter_store(writer, writer->count / 8u);
+}
+
+/*code is in the order of the bits in the stream, see HuffmanTree_makeFromLengths2*/
+static void addHuffmanSymbol(BitWriter* writer, unsigned code, unsigned bitlen)
+{
+  writeBits(writer, code, bitlen);
 }
 
 /*search the index in the array, that has the largest value smaller than or equal to the given value,
@@ -1378,9 +1860,20 @@ typedef struct Hash
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+/*initialize hash table, also to start over with an already used one*/
+static void hash_reset(Hash* hash, unsigned windowsize)
 {
   unsigned i;
+  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
+
+  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+}
+
+static unsigned hash_init(Hash* hash, unsigned windowsize)
+{
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
@@ -1394,14 +1887,7 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
     return 83; /*alloc fail*/
   }
 
-  /*initialize hash table*/
-  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
-
-  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
-
+  hash_reset(hash, windowsize);
   return 0;
 }
 
@@ -1416,6 +1902,97 @@ static void hash_cleanup(Hash* hash)
   lodepng_free(hash->chainz);
 }
 
+/*the buffers of one encoder thread, kept in a LodePNGEncoderContext*/
+typedef struct EncoderScratch
+{
+  Hash hash;
+  unsigned hashwindowsize; /*windowsize the hash was allocated for, 0 if not allocated*/
+  uivector lz77; /*output of encodeMatches*/
+  ucvector attempts; /*five filtered scanlines, for the adaptive filter strategies*/
+} EncoderScratch;
+
+struct LodePNGEncoderContext
+{
+  EncoderScratch* scratch;
+  unsigned numscratch;
+};
+
+/*the context allocates with the default allocator, whatever the encode using it has set*/
+LodePNGEncoderContext* lodepng_encoder_context_new(void)
+{
+  const LodePNGAllocator* previous = lodepng_set_allocator(0);
+  LodePNGEncoderContext* context = (LodePNGEncoderContext*)lodepng_malloc(sizeof(LodePNGEncoderContext));
+  lodepng_set_allocator(previous);
+  if(!context) return 0;
+  context->scratch = 0;
+  context->numscratch = 0;
+  return context;
+}
+
+void lodepng_encoder_context_delete(LodePNGEncoderContext* context)
+{
+  unsigned i;
+  const LodePNGAllocator* previous;
+  if(!context) return;
+  previous = lodepng_set_allocator(0);
+  for(i = 0; i != context->numscratch; ++i)
+  {
+    if(context->scratch[i].hashwindowsize) hash_cleanup(&context->scratch[i].hash);
+    uivector_cleanup(&context->scratch[i].lz77);
+    ucvector_cleanup(&context->scratch[i].attempts);
+  }
+  lodepng_free(context->scratch);
+  lodepng_free(context);
+  lodepng_set_allocator(previous);
+}
+
+/*
+The buffers for encoder thread index, or NULL without context (or if out of memory).
+Call with the highest index used before starting threads, it may move the scratch array.
+*/
+static EncoderScratch* encoder_scratch(LodePNGEncoderContext* context, unsigned index)
+{
+  if(!context) return 0;
+  if(index >= context->numscratch)
+  {
+    unsigned i;
+    const LodePNGAllocator* previous = lodepng_set_allocator(0);
+    EncoderScratch* scratch = (EncoderScratch*)lodepng_realloc(context->scratch,
+                                                               sizeof(EncoderScratch) * (index + 1));
+    lodepng_set_allocator(previous);
+    if(!scratch) return 0;
+    for(i = context->numscratch; i <= index; ++i)
+    {
+      scratch[i].hashwindowsize = 0;
+      uivector_init(&scratch[i].lz77);
+      ucvector_init(&scratch[i].attempts);
+    }
+    context->scratch = scratch;
+    context->numscratch = index + 1;
+  }
+  return &context->scratch[index];
+}
+
+/*the hash of scratch, reset, or allocated if it is new or had another windowsize*/
+static unsigned scratch_hash(EncoderScratch* scratch, unsigned windowsize)
+{
+  unsigned error;
+  const LodePNGAllocator* previous;
+  if(scratch->hashwindowsize == windowsize)
+  {
+    hash_reset(&scratch->hash, windowsize);
+    return 0;
+  }
+  previous = lodepng_set_allocator(0);
+  if(scratch->hashwindowsize) hash_cleanup(&scratch->hash);
+  scratch->hashwindowsize = 0;
+  error = hash_init(&scratch->hash, windowsize);
+  if(error) hash_cleanup(&scratch->hash);
+  else scratch->hashwindowsize = windowsize;
+  lodepng_set_allocator(previous);
+  return error;
+}
+
 
 
 static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
@@ -1472,13 +2049,18 @@ the "dictionary". A brute force search through all possible distances would be s
 this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
-                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           const unsigned char* in, size_t inpos, size_t insize,
+                           const LodePNGCompressSettings* settings)
 {
   size_t pos;
   unsigned i, error = 0;
+  unsigned windowsize = settings->windowsize;
+  unsigned minmatch = settings->minmatch;
+  unsigned nicematch = settings->nicematch;
+  unsigned lazymatching = settings->lazymatching;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned maxchainlength = settings->maxchainlength ? settings->maxchainlength
+                          : windowsize >= 8192 ? windowsize : windowsize / 8;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1648,6 +2230,207 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*
+LZ77-encode the data like encodeLZ77, but only with matches at distance 1 to 4 (a
+run of equal pixels of up to 4 bytes each, or of a repeated byte), and greedily.
+No hash table is needed for this.
+*/
+static unsigned encodeRLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize,
+                          const LodePNGCompressSettings* settings)
+{
+  size_t pos = inpos;
+  unsigned minmatch = settings->minmatch < 3 ? 3 : settings->minmatch;
+
+  while(pos < insize)
+  {
+    size_t maxlength = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? insize - pos : MAX_SUPPORTED_DEFLATE_LENGTH;
+    size_t length = 0, distance = 0, d;
+    for(d = 1; d <= 4 && d <= pos; ++d)
+    {
+      size_t l = 0;
+      while(l != maxlength && in[pos + l] == in[pos + l - d]) ++l;
+      if(l > length)
+      {
+        length = l;
+        distance = d;
+        if(l == maxlength) break;
+      }
+    }
+
+    if(length >= minmatch)
+    {
+      addLengthDistance(out, length, distance);
+      pos += length;
+    }
+    else
+    {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    }
+  }
+
+  return 0;
+}
+
+/*hash of the 4 bytes at data for encodeLZ77Fast, the caller ensures they exist*/
+static unsigned getHash4(const unsigned char* data)
+{
+  unsigned v = (unsigned)data[0] | ((unsigned)data[1] << 8u) | ((unsigned)data[2] << 16u) | ((unsigned)data[3] << 24u);
+  /*multiplicative (Fibonacci) hashing: the top 16 bits of the product depend on all 4 bytes*/
+  return ((v * 2654435761u) & 0xffffffffu) >> 16u;
+}
+
+/*length of the common prefix of a and b, at most maxlength*/
+static unsigned matchLength(const unsigned char* a, const unsigned char* b, unsigned maxlength)
+{
+  unsigned length = 0;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  /*8 bytes per step: the lowest set bit of the xor is in the first differing byte*/
+  while(length + 8 <= maxlength)
+  {
+    unsigned long long x, y;
+    memcpy(&x, a + length, 8);
+    memcpy(&y, b + length, 8);
+    if(x != y) return length + ((unsigned)__builtin_ctzll(x ^ y) >> 3u);
+    length += 8;
+  }
+#endif
+  while(length != maxlength && a[length] == b[length]) ++length;
+  return length;
+}
+
+/*adds pos to the 4-byte hash chains of encodeLZ77Fast, it only uses head and chain of the hash*/
+static void updateHashChain4(Hash* hash, const unsigned char* in, size_t pos, size_t insize, unsigned windowsize)
+{
+  unsigned wpos = (unsigned)(pos & (windowsize - 1));
+  unsigned hashval;
+  if(pos + 4 > insize) return; /*can not be matched, see findMatch4*/
+  hashval = getHash4(&in[pos]);
+  /*same value as index indicates the end of the chain*/
+  hash->chain[wpos] = (unsigned short)(hash->head[hashval] == -1 ? wpos : (unsigned)hash->head[hashval]);
+  hash->head[hashval] = (int)wpos;
+}
+
+/*
+The longest match for in[pos] in its 4-byte hash chain, trying at most maxchainlength
+earlier positions. All positions before pos must be in the hash chains, this adds pos.
+Returns the length, or 0, and the distance in *offset.
+*/
+static unsigned findMatch4(Hash* hash, const unsigned char* in, size_t pos, size_t insize,
+                           unsigned windowsize, unsigned maxchainlength, unsigned nicematch, unsigned* offset)
+{
+  unsigned wpos = (unsigned)(pos & (windowsize - 1));
+  unsigned maxlength = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? (unsigned)(insize - pos)
+                     : MAX_SUPPORTED_DEFLATE_LENGTH;
+  unsigned chainlength, length = 0, prev_offset = 0;
+  int hashpos;
+
+  *offset = 0;
+  if(maxlength < 4) return 0; /*too near the end to hash, only 3 byte matches would be possible*/
+  hashpos = hash->head[getHash4(&in[pos])];
+  updateHashChain4(hash, in, pos, insize, windowsize);
+  if(hashpos == -1) return 0;
+  if(nicematch > maxlength) nicematch = maxlength;
+
+  for(chainlength = 0; chainlength != maxchainlength; ++chainlength)
+  {
+    /*every position is added in order, so a slot holds the latest position with that index,
+    current_offset bytes back. The offsets grow along the chain until it wraps around the window.*/
+    unsigned current_offset = (unsigned)hashpos < wpos ? wpos - (unsigned)hashpos
+                            : wpos - (unsigned)hashpos + windowsize;
+    const unsigned char* backptr = &in[pos - current_offset];
+    if(current_offset <= prev_offset) break;
+    prev_offset = current_offset;
+
+    /*only compare candidates that can be longer than the current match*/
+    if(backptr[length] == in[pos + length])
+    {
+      unsigned current_length = matchLength(backptr, &in[pos], maxlength);
+      if(current_length > length)
+      {
+        length = current_length;
+        *offset = current_offset;
+        if(length >= nicematch) break;
+      }
+    }
+
+    if(hash->chain[hashpos] == hashpos) break;
+    hashpos = hash->chain[hashpos];
+  }
+
+  return length;
+}
+
+/*
+LZ77-encode the data like encodeLZ77, but with one chain of 4-byte hashes, comparing
+8 bytes at a time. The zero run chains are not needed since long runs compare quickly.
+Much faster, especially on repetitive images, at about the same compression.
+*/
+static unsigned encodeLZ77Fast(uivector* out, Hash* hash,
+                               const unsigned char* in, size_t inpos, size_t insize,
+                               const LodePNGCompressSettings* settings)
+{
+  size_t pos = inpos;
+  size_t hashed = inpos; /*the positions before this are in the hash chains*/
+  unsigned windowsize = settings->windowsize;
+  unsigned minmatch = settings->minmatch < 3 ? 3 : settings->minmatch;
+  unsigned nicematch = settings->nicematch;
+  unsigned maxchainlength = settings->maxchainlength ? settings->maxchainlength
+                          : windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
+
+  if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+  if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+  if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+
+  while(pos < insize)
+  {
+    unsigned length, offset;
+
+    for(; hashed < pos; ++hashed) updateHashChain4(hash, in, hashed, insize, windowsize);
+    length = findMatch4(hash, in, pos, insize, windowsize, maxchainlength, nicematch, &offset);
+    hashed = pos + 1;
+    if(length == 3 && offset > 4096) length = 0; /*more extra bits than it saves*/
+
+    /*lazy matching: output a literal instead while the match at the next byte is longer*/
+    while(settings->lazymatching && length >= minmatch && length <= maxlazymatch && length < nicematch)
+    {
+      unsigned nextoffset;
+      unsigned nextlength = findMatch4(hash, in, pos + 1, insize, windowsize, maxchainlength, nicematch,
+                                       &nextoffset);
+      hashed = pos + 2;
+      if(nextlength == 3 && nextoffset > 4096) nextlength = 0;
+      if(nextlength <= length) break;
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+      length = nextlength;
+      offset = nextoffset;
+    }
+
+    if(length >= minmatch)
+    {
+      addLengthDistance(out, length, offset);
+      pos += length;
+    }
+    else
+    {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    }
+  }
+
+  return 0;
+}
+
+/*LZ77-encode with the method selected in the settings*/
+static unsigned encodeMatches(uivector* out, Hash* hash, const unsigned char* in, size_t inpos, size_t insize,
+                              const LodePNGCompressSettings* settings)
+{
+  if(settings->rle) return encodeRLE(out, in, inpos, insize, settings);
+  if(settings->fastmatch) return encodeLZ77Fast(out, hash, in, inpos, insize, settings);
+  return encodeLZ77(out, hash, in, inpos, insize, settings);
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
 static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
@@ -1655,8 +2438,10 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
-  size_t i, j, numdeflateblocks = (datasize + 65534) / 65535;
+  size_t i, numdeflateblocks = (datasize + 65534) / 65535;
   unsigned datapos = 0;
+  /*empty input still needs one final (empty) block for a valid stream*/
+  if(numdeflateblocks == 0) numdeflateblocks = 1;
   for(i = 0; i != numdeflateblocks; ++i)
   {
     unsigned BFINAL, BTYPE, LEN, NLEN;
@@ -1678,10 +2463,9 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     ucvector_push_back(out, (unsigned char)(NLEN >> 8));
 
     /*Decompressed data*/
-    for(j = 0; j < 65535 && datapos < datasize; ++j)
-    {
-      ucvector_push_back(out, data[datapos++]);
-    }
+    if(!ucvector_resize(out, out->size + LEN)) return 83; /*alloc fail*/
+    memcpy(out->data + out->size - LEN, data + datapos, LEN);
+    datapos += LEN;
   }
 
   return 0;
@@ -1692,14 +2476,15 @@ write the lz77-encoded data, which has lit, len and dist codes, to compressed st
 tree_ll: the tree for lit and len codes.
 tree_d: the tree for distance codes.
 */
-static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encoded,
+static void writeLZ77data(BitWriter* writer, const uivector* lz77_encoded,
                           const HuffmanTree* tree_ll, const HuffmanTree* tree_d)
 {
   size_t i = 0;
   for(i = 0; i != lz77_encoded->size; ++i)
   {
     unsigned val = lz77_encoded->data[i];
-    addHuffmanSymbol(bp, out, HuffmanTree_getCode(tree_ll, val), HuffmanTree_getLength(tree_ll, val));
+    unsigned code = HuffmanTree_getCode(tree_ll, val);
+    unsigned bitlen = HuffmanTree_getLength(tree_ll, val);
     if(val > 256) /*for a length code, 3 more things have to be added*/
     {
       unsigned length_index = val - FIRST_LENGTH_CODE_INDEX;
@@ -1712,16 +2497,20 @@ static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encode
       unsigned n_distance_extra_bits = DISTANCEEXTRA[distance_index];
       unsigned distance_extra_bits = lz77_encoded->data[++i];
 
-      addBitsToStream(bp, out, length_extra_bits, n_length_extra_bits);
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(tree_d, distance_code),
-                       HuffmanTree_getLength(tree_d, distance_code));
-      addBitsToStream(bp, out, distance_extra_bits, n_distance_extra_bits);
+      /*each code with its extra bits fits in one write: at most 15 + 5 and 15 + 13 bits*/
+      writeBits(writer, code | (length_extra_bits << bitlen), bitlen + n_length_extra_bits);
+      bitlen = HuffmanTree_getLength(tree_d, distance_code);
+      writeBits(writer, HuffmanTree_getCode(tree_d, distance_code) | (distance_extra_bits << bitlen),
+                bitlen + n_distance_extra_bits);
     }
+    else addHuffmanSymbol(writer, code, bitlen);
   }
 }
 
 /*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
-static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
+/*lz77_encoded: buffer for the lz77 encoded data, represented with integers since there will also be
+length and distance codes in it*/
+static unsigned deflateDynamic(BitWriter* writer, Hash* hash, uivector* lz77_encoded,
                                const unsigned char* data, size_t datapos, size_t dataend,
                                const LodePNGCompressSettings* settings, unsigned final)
 {
@@ -1738,8 +2527,6 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   the code length code lengths ("clcl").
   */
 
-  /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  uivector lz77_encoded;
   HuffmanTree tree_ll; /*tree for lit,len values*/
   HuffmanTree tree_d; /*tree for distance codes*/
   HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
@@ -1765,7 +2552,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   size_t numcodes_ll, numcodes_d, i;
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
+  lz77_encoded->size = 0;
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
   HuffmanTree_init(&tree_cl);
@@ -1782,27 +2569,26 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   {
     if(settings->use_lz77)
     {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeMatches(lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     }
     else
     {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; ++i) lz77_encoded.data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
+      if(!uivector_resize(lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
+      for(i = datapos; i < dataend; ++i) lz77_encoded->data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
     }
 
     if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83 /*alloc fail*/);
     if(!uivector_resizev(&frequencies_d, 30, 0)) ERROR_BREAK(83 /*alloc fail*/);
 
     /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i != lz77_encoded.size; ++i)
+    for(i = 0; i != lz77_encoded->size; ++i)
     {
-      unsigned symbol = lz77_encoded.data[i];
+      unsigned symbol = lz77_encoded->data[i];
       ++frequencies_ll.data[symbol];
       if(symbol > 256)
       {
-        unsigned dist = lz77_encoded.data[i + 2];
+        unsigned dist = lz77_encoded->data[i + 2];
         ++frequencies_d.data[dist];
         i += 3;
       }
@@ -1912,9 +2698,9 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     */
 
     /*Write block type*/
-    addBitToStream(bp, out, BFINAL);
-    addBitToStream(bp, out, 0); /*first bit of BTYPE "dynamic"*/
-    addBitToStream(bp, out, 1); /*second bit of BTYPE "dynamic"*/
+    writeBits(writer, BFINAL, 1);
+    writeBits(writer, 0, 1); /*first bit of BTYPE "dynamic"*/
+    writeBits(writer, 1, 1); /*second bit of BTYPE "dynamic"*/
 
     /*write the HLIT, HDIST and HCLEN values*/
     HLIT = (unsigned)(numcodes_ll - 257);
@@ -1922,37 +2708,36 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     HCLEN = (unsigned)bitlen_cl.size - 4;
     /*trim zeroes for HCLEN. HLIT and HDIST were already trimmed at tree creation*/
     while(!bitlen_cl.data[HCLEN + 4 - 1] && HCLEN > 0) --HCLEN;
-    addBitsToStream(bp, out, HLIT, 5);
-    addBitsToStream(bp, out, HDIST, 5);
-    addBitsToStream(bp, out, HCLEN, 4);
+    writeBits(writer, HLIT, 5);
+    writeBits(writer, HDIST, 5);
+    writeBits(writer, HCLEN, 4);
 
     /*write the code lenghts of the code length alphabet*/
-    for(i = 0; i != HCLEN + 4; ++i) addBitsToStream(bp, out, bitlen_cl.data[i], 3);
+    for(i = 0; i != HCLEN + 4; ++i) writeBits(writer, bitlen_cl.data[i], 3);
 
     /*write the lenghts of the lit/len AND the dist alphabet*/
     for(i = 0; i != bitlen_lld_e.size; ++i)
     {
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_cl, bitlen_lld_e.data[i]),
+      addHuffmanSymbol(writer, HuffmanTree_getCode(&tree_cl, bitlen_lld_e.data[i]),
                        HuffmanTree_getLength(&tree_cl, bitlen_lld_e.data[i]));
       /*extra bits of repeat codes*/
-      if(bitlen_lld_e.data[i] == 16) addBitsToStream(bp, out, bitlen_lld_e.data[++i], 2);
-      else if(bitlen_lld_e.data[i] == 17) addBitsToStream(bp, out, bitlen_lld_e.data[++i], 3);
-      else if(bitlen_lld_e.data[i] == 18) addBitsToStream(bp, out, bitlen_lld_e.data[++i], 7);
+      if(bitlen_lld_e.data[i] == 16) writeBits(writer, bitlen_lld_e.data[++i], 2);
+      else if(bitlen_lld_e.data[i] == 17) writeBits(writer, bitlen_lld_e.data[++i], 3);
+      else if(bitlen_lld_e.data[i] == 18) writeBits(writer, bitlen_lld_e.data[++i], 7);
     }
 
     /*write the compressed data symbols*/
-    writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
+    writeLZ77data(writer, lz77_encoded, &tree_ll, &tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
     if(HuffmanTree_getLength(&tree_ll, 256) == 0) ERROR_BREAK(64);
 
     /*write the end code*/
-    addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
+    addHuffmanSymbol(writer, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
 
     break; /*end of error-while*/
   }
 
   /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
@@ -1966,7 +2751,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
+static unsigned deflateFixed(BitWriter* writer, Hash* hash, uivector* lz77_encoded,
                              const unsigned char* data,
                              size_t datapos, size_t dataend,
                              const LodePNGCompressSettings* settings, unsigned final)
@@ -1984,28 +2769,25 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   generateFixedLitLenTree(&tree_ll);
   generateFixedDistanceTree(&tree_d);
 
-  addBitToStream(bp, out, BFINAL);
-  addBitToStream(bp, out, 1); /*first bit of BTYPE*/
-  addBitToStream(bp, out, 0); /*second bit of BTYPE*/
+  writeBits(writer, BFINAL, 1);
+  writeBits(writer, 1, 1); /*first bit of BTYPE*/
+  writeBits(writer, 0, 1); /*second bit of BTYPE*/
 
   if(settings->use_lz77) /*LZ77 encoded*/
   {
-    uivector lz77_encoded;
-    uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
-    if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
-    uivector_cleanup(&lz77_encoded);
+    lz77_encoded->size = 0;
+    error = encodeMatches(lz77_encoded, hash, data, datapos, dataend, settings);
+    if(!error) writeLZ77data(writer, lz77_encoded, &tree_ll, &tree_d);
   }
   else /*no LZ77, but still will be Huffman compressed*/
   {
     for(i = datapos; i < dataend; ++i)
     {
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, data[i]), HuffmanTree_getLength(&tree_ll, data[i]));
+      addHuffmanSymbol(writer, HuffmanTree_getCode(&tree_ll, data[i]), HuffmanTree_getLength(&tree_ll, data[i]));
     }
   }
   /*add END code*/
-  if(!error) addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
+  if(!error) addHuffmanSymbol(writer, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
 
   /*cleanup*/
   HuffmanTree_cleanup(&tree_ll);
@@ -2014,17 +2796,56 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*
+Adds the positions [start, end) to the hash chains the way encodeLZ77 would have, so
+that the following data can refer back to them.
+*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t start, size_t end, size_t insize,
+                       const LodePNGCompressSettings* settings)
+{
+  size_t pos;
+  unsigned windowsize = settings->windowsize;
+  unsigned numzeros = 0;
+  if(settings->fastmatch)
+  {
+    for(pos = start; pos < end; ++pos) updateHashChain4(hash, in, pos, insize, windowsize);
+    return;
+  }
+  for(pos = start; pos < end; ++pos)
+  {
+    unsigned hashval = getHash(in, insize, pos);
+    if(hashval == 0)
+    {
+      if(numzeros == 0) numzeros = countZeros(in, insize, pos);
+      else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
+    }
+    else
+    {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, numzeros);
+  }
+}
+
+/*
+Deflates in[start, end) with btype 1 or 2. Matches may refer back into the window
+before start. If final is not set, the output ends with a sync flush (an empty stored
+block) instead of a final block, so that more deflate data can be appended to it.
+Uses the hash and lz77 buffer of scratch if given, allocates its own otherwise.
+*/
+static unsigned deflateRange(ucvector* out, const unsigned char* in, size_t start, size_t end,
+                             const LodePNGCompressSettings* settings, unsigned final, EncoderScratch* scratch)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
-  size_t bp = 0; /*the bit pointer*/
-  Hash hash;
-
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
+  BitWriter writer;
+  size_t insize = end - start;
+  Hash ownhash;
+  uivector ownlz77;
+  Hash* hash = scratch ? &scratch->hash : &ownhash;
+  uivector* lz77 = scratch ? &scratch->lz77 : &ownlz77;
+
+  if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
@@ -2036,35 +2857,79 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
+  error = scratch ? scratch_hash(scratch, settings->windowsize) : hash_init(&ownhash, settings->windowsize);
   if(error) return error;
+  if(scratch)
+  {
+    /*room for the LZ77 output of any block (4 values per match of at least 3 bytes), so it
+    never grows during the encode, with the allocator of the encode*/
+    size_t maxblock = blocksize < insize ? blocksize : insize;
+    const LodePNGAllocator* previous = lodepng_set_allocator(0);
+    if(!uivector_reserve(lz77, (maxblock + maxblock / 3 + 4) * sizeof(unsigned))) error = 83; /*alloc fail*/
+    lodepng_set_allocator(previous);
+    if(error) return error;
+  }
+  else uivector_init(&ownlz77);
+  BitWriter_init(&writer, out);
+  /*enough for most blocks, the writer grows it further if needed*/
+  ucvector_reserve(out, out->size + insize / 4 + 64);
+
+  if(start > 0 && settings->use_lz77 && !settings->rle)
+  {
+    size_t window = start < settings->windowsize ? start : settings->windowsize;
+    hash_prime(hash, in, start - window, start, end, settings);
+  }
 
   for(i = 0; i != numdeflateblocks && !error; ++i)
   {
-    unsigned final = (i == numdeflateblocks - 1);
-    size_t start = i * blocksize;
-    size_t end = start + blocksize;
-    if(end > insize) end = insize;
+    unsigned finalblock = final && (i == numdeflateblocks - 1);
+    size_t blockstart = start + i * blocksize;
+    size_t blockend = blockstart + blocksize;
+    if(blockend > end) blockend = end;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(&writer, hash, lz77, in, blockstart, blockend, settings, finalblock);
+    else if(settings->btype == 2) error = deflateDynamic(&writer, hash, lz77, in, blockstart, blockend, settings, finalblock);
   }
 
-  hash_cleanup(&hash);
+  if(!error && !final)
+  {
+    /*empty stored block: BFINAL 0, BTYPE 00, padding to the byte boundary, LEN 0, NLEN 65535*/
+    writeBits(&writer, 0, 3);
+    BitWriter_flush(&writer);
+    writeBits(&writer, 0xffff0000u, 32);
+  }
+  BitWriter_flush(&writer);
+  if(!error) error = writer.error;
+
+  if(!scratch)
+  {
+    hash_cleanup(&ownhash);
+    uivector_cleanup(&ownlz77);
+  }
 
   return error;
 }
 
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings)
+{
+  if(settings->btype > 2) return 61;
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else return deflateRange(out, in, 0, insize, settings, 1, encoder_scratch(settings->context, 0));
+}
+
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings)
 {
   unsigned error;
   ucvector v;
+  const LodePNGAllocator* previous = lodepng_set_allocator(settings->allocator);
   ucvector_init_buffer(&v, *out, *outsize);
   error = lodepng_deflatev(&v, in, insize, settings);
   *out = v.data;
   *outsize = v.size;
+  lodepng_set_allocator(previous);
   return error;
 }
 
@@ -2088,11 +2953,158 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+/*
+The SIMD versions below add whole blocks of 16 or 32 bytes at a time: s1 gets
+the plain sum of the block, s2 the sum weighted by the distance to the end of
+the block, plus block size times the s1 from before the block. The latter is
+accumulated as a sum of the previous per-block s1 vectors (v_ps) and only
+scaled once at the end of each run. Runs are 5536 bytes, a multiple of 32
+below the 5550 limit of the scalar loop, and len must be a multiple of the
+block size.
+*/
+#ifdef LODEPNG_SIMD_X86
+__attribute__((target("sse2")))
+static unsigned adler32_hsum_sse2(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+  return (unsigned)_mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2")))
+static void update_adler32_sse2(unsigned* s1, unsigned* s2, const unsigned char* data, unsigned len)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i weights_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+  const __m128i weights_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+  unsigned a = *s1, b = *s2;
+
+  while(len > 0)
+  {
+    unsigned amount = len > 5536 ? 5536 : len;
+    __m128i v_s1 = zero, v_ps = zero, v_s2 = zero;
+    unsigned i;
+    len -= amount;
+    b += a * amount;
+    for(i = 0; i < amount; i += 16)
+    {
+      __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), weights_lo));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), weights_hi));
+    }
+    data += amount;
+    a += adler32_hsum_sse2(v_s1);
+    b += (adler32_hsum_sse2(v_ps) % 65521) * 16 + adler32_hsum_sse2(v_s2);
+    a %= 65521;
+    b %= 65521;
+  }
+
+  *s1 = a;
+  *s2 = b;
+}
+
+__attribute__((target("avx2")))
+static void update_adler32_avx2(unsigned* s1, unsigned* s2, const unsigned char* data, unsigned len)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                           16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  unsigned a = *s1, b = *s2;
+
+  while(len > 0)
+  {
+    unsigned amount = len > 5536 ? 5536 : len;
+    __m256i v_s1 = zero, v_ps = zero, v_s2 = zero;
+    unsigned i;
+    len -= amount;
+    b += a * amount;
+    for(i = 0; i < amount; i += 32)
+    {
+      __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + i));
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      /*pairs of byte * weight fit in 16 bits: 255 * (32 + 31) < 32768*/
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, weights), ones));
+    }
+    data += amount;
+    a += adler32_hsum_sse2(_mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1)));
+    b += (adler32_hsum_sse2(_mm_add_epi32(_mm256_castsi256_si128(v_ps), _mm256_extracti128_si256(v_ps, 1)))
+          % 65521) * 32;
+    b += adler32_hsum_sse2(_mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1)));
+    a %= 65521;
+    b %= 65521;
+  }
+
+  *s1 = a;
+  *s2 = b;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+static void update_adler32_neon(unsigned* s1, unsigned* s2, const unsigned char* data, unsigned len)
+{
+  static const unsigned char weights[16] = {16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+  const uint8x8_t weights_lo = vld1_u8(weights);
+  const uint8x8_t weights_hi = vld1_u8(weights + 8);
+  unsigned a = *s1, b = *s2;
+
+  while(len > 0)
+  {
+    unsigned amount = len > 5536 ? 5536 : len;
+    uint32x4_t v_s1 = vdupq_n_u32(0), v_ps = vdupq_n_u32(0), v_s2 = vdupq_n_u32(0);
+    unsigned i;
+    len -= amount;
+    b += a * amount;
+    for(i = 0; i < amount; i += 16)
+    {
+      uint8x16_t bytes = vld1q_u8(data + i);
+      uint16x8_t weighted = vmull_u8(vget_low_u8(bytes), weights_lo);
+      weighted = vmlal_u8(weighted, vget_high_u8(bytes), weights_hi);
+      v_ps = vaddq_u32(v_ps, v_s1);
+      v_s1 = vpadalq_u16(v_s1, vpaddlq_u8(bytes));
+      v_s2 = vpadalq_u16(v_s2, weighted);
+    }
+    data += amount;
+    a += vaddvq_u32(v_s1);
+    b += (vaddvq_u32(v_ps) % 65521) * 16 + vaddvq_u32(v_s2);
+    a %= 65521;
+    b %= 65521;
+  }
+
+  *s1 = a;
+  *s2 = b;
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
 static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
 {
    unsigned s1 = adler & 0xffff;
    unsigned s2 = (adler >> 16) & 0xffff;
 
+#if defined(LODEPNG_SIMD_X86)
+  if(len >= 64)
+  {
+    unsigned amount = len & ~31u;
+    if(__builtin_cpu_supports("avx2")) update_adler32_avx2(&s1, &s2, data, amount);
+    else if(__builtin_cpu_supports("sse2")) update_adler32_sse2(&s1, &s2, data, amount);
+    else amount = 0;
+    data += amount;
+    len -= amount;
+  }
+#elif defined(LODEPNG_SIMD_NEON)
+  if(len >= 64)
+  {
+    unsigned amount = len & ~15u;
+    update_adler32_neon(&s1, &s2, data, amount);
+    data += amount;
+    len -= amount;
+  }
+#endif
+
+  /*scalar loop for the remaining bytes, and without SIMD support*/
   while(len > 0)
   {
     /*at least 5550 sums can be done before the sums overflow, saving a lot of module divisions*/
@@ -2123,8 +3135,8 @@ static unsigned adler32(const unsigned char* data, unsigned len)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+static unsigned zlibDecompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                               size_t insize, const LodePNGDecompressSettings* settings)
 {
   unsigned error = 0;
   unsigned CM, CINFO, FDICT;
@@ -2168,6 +3180,15 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
   return 0; /*no error*/
 }
 
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  const LodePNGAllocator* previous = lodepng_set_allocator(settings->allocator);
+  unsigned error = zlibDecompress(out, outsize, in, insize, settings);
+  lodepng_set_allocator(previous);
+  return error;
+}
+
 static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                 size_t insize, const LodePNGDecompressSettings* settings)
 {
@@ -2185,13 +3206,112 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
-unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                               size_t insize, const LodePNGCompressSettings* settings)
+#ifdef LODEPNG_COMPILE_THREADS
+/*the adler32 of the concatenation of two inputs, given their adler32s and the length of the second*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
+{
+  unsigned rem = (unsigned)(len2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521;
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + 65521 - rem;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s2 >= 65521 * 2) s2 -= 65521 * 2;
+  if(s2 >= 65521) s2 -= 65521;
+  return (s2 << 16) | s1;
+}
+
+typedef struct DeflateSegment
+{
+  const unsigned char* in;
+  size_t start, end;
+  const LodePNGCompressSettings* settings;
+  unsigned final;
+  EncoderScratch* scratch;
+  ucvector out;
+  unsigned adler;
+  unsigned error;
+} DeflateSegment;
+
+static void* deflateSegmentThread(void* arg)
+{
+  DeflateSegment* segment = (DeflateSegment*)arg;
+  segment->error = deflateRange(&segment->out, segment->in, segment->start, segment->end,
+                                segment->settings, segment->final, segment->scratch);
+  segment->adler = update_adler32(1u, segment->in + segment->start, (unsigned)(segment->end - segment->start));
+  return 0;
+}
+
+/*smallest input per thread in zlibCompressParallel*/
+#define DEFLATE_MIN_SEGMENT 65536
+
+/*
+The deflate data and adler32 for lodepng_zlib_compress, computed on settings->numthreads
+threads (pigz style): each thread deflates a segment of the input, starting at a multiple
+of align bytes, with the window before it as dictionary. Returns 1 if it did not apply.
+*/
+static unsigned zlibCompressParallel(ucvector* out, unsigned* adler, const unsigned char* in, size_t insize,
+                                     const LodePNGCompressSettings* settings, size_t align, unsigned* error)
+{
+  DeflateSegment* segments;
+  unsigned i, numsegments = settings->numthreads;
+  unsigned usescratch;
+  size_t segmentsize;
+
+  if(settings->custom_deflate || settings->btype == 0 || settings->btype > 2) return 1;
+  if(numsegments > insize / DEFLATE_MIN_SEGMENT) numsegments = (unsigned)(insize / DEFLATE_MIN_SEGMENT);
+  if(numsegments < 2) return 1;
+
+  segmentsize = insize / numsegments;
+  segments = (DeflateSegment*)lodepng_malloc(sizeof(DeflateSegment) * numsegments);
+  if(!segments) return 1;
+  /*allocate the buffers of all threads first, growing the context later could move them*/
+  usescratch = encoder_scratch(settings->context, numsegments - 1) != 0;
+
+  for(i = 0; i != numsegments; ++i)
+  {
+    segments[i].in = in;
+    segments[i].start = i == 0 ? 0 : segments[i - 1].end;
+    segments[i].end = i + 1 == numsegments ? insize : (segmentsize * (i + 1)) / align * align;
+    if(segments[i].end < segments[i].start) segments[i].end = segments[i].start;
+    segments[i].settings = settings;
+    segments[i].final = i + 1 == numsegments;
+    segments[i].scratch = usescratch ? encoder_scratch(settings->context, i) : 0;
+    ucvector_init(&segments[i].out);
+  }
+
+  lodepng_parallel(deflateSegmentThread, segments, sizeof(DeflateSegment), numsegments);
+
+  *error = 0;
+  for(i = 0; i != numsegments; ++i)
+  {
+    if(!*error) *error = segments[i].error;
+    if(!*error)
+    {
+      if(ucvector_resize(out, out->size + segments[i].out.size))
+      {
+        memcpy(out->data + out->size - segments[i].out.size, segments[i].out.data, segments[i].out.size);
+      }
+      else *error = 83; /*alloc fail*/
+      *adler = i == 0 ? segments[i].adler
+             : adler32_combine(*adler, segments[i].adler, segments[i].end - segments[i].start);
+    }
+    ucvector_cleanup(&segments[i].out);
+  }
+  lodepng_free(segments);
+
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*lodepng_zlib_compress, where segments for multithreaded deflate start at multiples of align*/
+static unsigned zlibCompressAligned(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                    size_t insize, const LodePNGCompressSettings* settings, size_t align)
 {
   /*initially, *out must be NULL and outsize 0, if you just give some random *out
   that's pointing to a non allocated buffer, this'll crash*/
   ucvector outv;
-  size_t i;
   unsigned error;
   unsigned char* deflatedata = 0;
   size_t deflatesize = 0;
@@ -2210,12 +3330,32 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   ucvector_push_back(&outv, (unsigned char)(CMFFLG >> 8));
   ucvector_push_back(&outv, (unsigned char)(CMFFLG & 255));
 
+#ifdef LODEPNG_COMPILE_THREADS
+  if(settings->numthreads > 1)
+  {
+    unsigned ADLER32 = 1;
+    if(!zlibCompressParallel(&outv, &ADLER32, in, insize, settings, align, &error))
+    {
+      if(!error) lodepng_add32bitInt(&outv, ADLER32);
+      *out = outv.data;
+      *outsize = outv.size;
+      return error;
+    }
+  }
+#else /*LODEPNG_COMPILE_THREADS*/
+  (void)align;
+#endif /*LODEPNG_COMPILE_THREADS*/
+
   error = deflate(&deflatedata, &deflatesize, in, insize, settings);
 
   if(!error)
   {
     unsigned ADLER32 = adler32(in, (unsigned)insize);
-    for(i = 0; i != deflatesize; ++i) ucvector_push_back(&outv, deflatedata[i]);
+    if(ucvector_resize(&outv, outv.size + deflatesize))
+    {
+      memcpy(outv.data + outv.size - deflatesize, deflatedata, deflatesize);
+    }
+    else error = 83; /*alloc fail*/
     lodepng_free(deflatedata);
     lodepng_add32bitInt(&outv, ADLER32);
   }
@@ -2226,9 +3366,18 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   return error;
 }
 
-/* compress using the default or custom zlib function */
+unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                               size_t insize, const LodePNGCompressSettings* settings)
+{
+  const LodePNGAllocator* previous = lodepng_set_allocator(settings->allocator);
+  unsigned error = zlibCompressAligned(out, outsize, in, insize, settings, 1);
+  lodepng_set_allocator(previous);
+  return error;
+}
+
+/* compress using the default or custom zlib function, align: see zlibCompressAligned */
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                              size_t insize, const LodePNGCompressSettings* settings)
+                              size_t insize, const LodePNGCompressSettings* settings, size_t align)
 {
   if(settings->custom_zlib)
   {
@@ -2236,7 +3385,7 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
   }
   else
   {
-    return lodepng_zlib_compress(out, outsize, in, insize, settings);
+    return zlibCompressAligned(out, outsize, in, insize, settings, align);
   }
 }
 
@@ -2254,8 +3403,9 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                              size_t insize, const LodePNGCompressSettings* settings)
+                              size_t insize, const LodePNGCompressSettings* settings, size_t align)
 {
+  (void)align;
   if(!settings->custom_zlib) return 87; /*no custom zlib function provided */
   return settings->custom_zlib(out, outsize, in, insize, settings);
 }
@@ -2279,13 +3429,56 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchainlength = 0;
+  settings->rle = 0;
+  settings->fastmatch = 0;
+  settings->numthreads = 0;
+  settings->context = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
+  settings->allocator = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+void lodepng_compress_settings_level(LodePNGCompressSettings* settings, unsigned level)
+{
+  /*windowsize, maxchainlength, nicematch and lazymatching for levels 2 to 9*/
+  static const unsigned LEVELS[8][4] = {
+    {  2048,    1,  32, 0 },
+    {  2048,    4,  64, 0 },
+    {  2048,   16, 128, 1 },
+    {  2048,   64, 128, 1 },
+    {  2048,    0, 128, 1 }, /*the default settings*/
+    {  8192, 1024, 258, 1 },
+    { 32768, 4096, 258, 1 },
+    { 32768,    0, 258, 1 }
+  };
+
+  if(level > 9) level = 9;
+
+  settings->btype = level == 0 ? 0 : 2;
+  settings->use_lz77 = 1;
+  settings->minmatch = 3;
+  settings->rle = level == 1;
+  settings->fastmatch = level >= 2;
+  if(level < 2)
+  {
+    settings->windowsize = DEFAULT_WINDOWSIZE;
+    settings->maxchainlength = 0;
+    settings->nicematch = 128;
+    settings->lazymatching = 0;
+  }
+  else
+  {
+    settings->windowsize = LEVELS[level - 2][0];
+    settings->maxchainlength = LEVELS[level - 2][1];
+    settings->nicematch = LEVELS[level - 2][2];
+    settings->lazymatching = LEVELS[level - 2][3];
+  }
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2299,9 +3492,10 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings)
   settings->custom_zlib = 0;
   settings->custom_inflate = 0;
   settings->custom_context = 0;
+  settings->allocator = 0;
 }
 
-const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0};
+const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0};
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -2319,52 +3513,434 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 
 
 #ifndef LODEPNG_NO_COMPILE_CRC
-/* CRC polynomial: 0xedb88320 */
-static unsigned lodepng_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
-   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
-   498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
-   997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
-   901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
-   671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
-  1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
-  1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
-  1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
-  1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
-  1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
-  3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
-  3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
-  4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
-  3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
-  3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
-  3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
-  2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
-  2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
-  2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
-  2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
-  3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+/*
+CRC polynomial: 0xedb88320. lodepng_crc32_table[0] is the usual byte-at-a-time
+table, lodepng_crc32_table[k][i] is the CRC of byte i followed by k zero bytes,
+which lets the slice-by-8 loop below look up 8 input bytes independently.
+*/
+static const unsigned lodepng_crc32_table[8][256] = {
+  {
+             0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
+     249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
+     498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
+     325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
+     997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
+     901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
+     651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
+     671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
+    1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
+    2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
+    1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
+    1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
+    1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
+    1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
+    1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
+    1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
+    3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
+    3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
+    4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
+    4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
+    3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
+    3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
+    3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
+    3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
+    2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
+    2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
+    2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
+    2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
+    2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
+    2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
+    3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
+    3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+  },
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
 };
 
+/*
+Hardware CRC paths (see LODEPNG_COMPILE_SIMD). All of these work on the running
+(inverted) CRC register value r.
+*/
+static unsigned lodepng_crc32_slice8(unsigned r, const unsigned char* data, size_t length)
+{
+  while(length >= 8)
+  {
+    unsigned a = r ^ (data[0] | ((unsigned)data[1] << 8) | ((unsigned)data[2] << 16) | ((unsigned)data[3] << 24));
+    unsigned b = data[4] | ((unsigned)data[5] << 8) | ((unsigned)data[6] << 16) | ((unsigned)data[7] << 24);
+    r = lodepng_crc32_table[7][a & 0xff] ^ lodepng_crc32_table[6][(a >> 8) & 0xff]
+      ^ lodepng_crc32_table[5][(a >> 16) & 0xff] ^ lodepng_crc32_table[4][(a >> 24) & 0xff]
+      ^ lodepng_crc32_table[3][b & 0xff] ^ lodepng_crc32_table[2][(b >> 8) & 0xff]
+      ^ lodepng_crc32_table[1][(b >> 16) & 0xff] ^ lodepng_crc32_table[0][(b >> 24) & 0xff];
+    data += 8;
+    length -= 8;
+  }
+  while(length--)
+  {
+    r = lodepng_crc32_table[0][(r ^ *data++) & 0xff] ^ (r >> 8);
+  }
+  return r;
+}
+
+#ifdef LODEPNG_SIMD_X86
+/*
+Folds 64 bytes at a time with carry-less multiplies, then reduces the 128-bit
+remainder with a Barrett reduction, as described in Intel's "Fast CRC
+Computation for Generic Polynomials Using PCLMULQDQ Instruction". The constants
+are those of the bit-reflected CRC-32 polynomial from that paper. length must
+be at least 64 and a multiple of 16.
+*/
+__attribute__((target("pclmul,sse2")))
+static unsigned lodepng_crc32_pclmul(unsigned r, const unsigned char* data, size_t length)
+{
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+  const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)r));
+  data += 64;
+  length -= 64;
+
+  /*fold the four 128-bit lanes forward by 64 bytes*/
+  while(length >= 64)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+    data += 64;
+    length -= 64;
+  }
+
+  /*fold the lanes into one*/
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  /*remaining 16-byte blocks*/
+  while(length >= 16)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+    data += 16;
+    length -= 16;
+  }
+
+  /*128 to 64 bits*/
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /*Barrett reduction to 32 bits*/
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_ARM_CRC32
+#ifdef LODEPNG_SIMD_ARM_CRC32_HWCAP
+__attribute__((target("+crc")))
+#endif /*LODEPNG_SIMD_ARM_CRC32_HWCAP*/
+static unsigned lodepng_crc32_arm(unsigned r, const unsigned char* data, size_t length)
+{
+  while(length >= 8)
+  {
+    uint64_t v;
+    memcpy(&v, data, 8); /*aarch64 Linux is little endian*/
+    r = __crc32d(r, v);
+    data += 8;
+    length -= 8;
+  }
+  while(length--) r = __crc32b(r, *data++);
+  return r;
+}
+#endif /*LODEPNG_SIMD_ARM_CRC32*/
+
 /*Return the CRC of the bytes buf[0..len-1].*/
 unsigned lodepng_crc32(const unsigned char* data, size_t length)
 {
   unsigned r = 0xffffffffu;
-  size_t i;
-  for(i = 0; i < length; ++i)
-  {
-    r = lodepng_crc32_table[(r ^ data[i]) & 0xff] ^ (r >> 8);
-  }
-  return r ^ 0xffffffffu;
+#if defined(LODEPNG_SIMD_X86)
+  /*below a few blocks the setup and final reduction cost more than they save*/
+  if(length >= 128 && __builtin_cpu_supports("pclmul"))
+  {
+    size_t n = length & ~(size_t)15;
+    r = lodepng_crc32_pclmul(r, data, n);
+    data += n;
+    length -= n;
+  }
+#elif defined(LODEPNG_SIMD_ARM_CRC32)
+#ifdef LODEPNG_SIMD_ARM_CRC32_HWCAP
+  if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+#endif /*LODEPNG_SIMD_ARM_CRC32_HWCAP*/
+    return lodepng_crc32_arm(r, data, length) ^ 0xffffffffu;
+#endif
+  return lodepng_crc32_slice8(r, data, length) ^ 0xffffffffu;
 }
 #else /* !LODEPNG_NO_COMPILE_CRC */
 unsigned lodepng_crc32(const unsigned char* data, size_t length);
@@ -2512,7 +4088,6 @@ unsigned lodepng_chunk_append(unsigned char** out, size_t* outlength, const unsi
 unsigned lodepng_chunk_create(unsigned char** out, size_t* outlength, unsigned length,
                               const char* type, const unsigned char* data)
 {
-  unsigned i;
   unsigned char *chunk, *new_buffer;
   size_t new_length = (*outlength) + length + 12;
   if(new_length < length + 12 || new_length < (*outlength)) return 77; /*integer overflow happened*/
@@ -2532,7 +4107,7 @@ unsigned lodepng_chunk_create(unsigned char** out, size_t* outlength, unsigned l
   chunk[7] = (unsigned char)type[3];
 
   /*3: the data*/
-  for(i = 0; i != length; ++i) chunk[8 + i] = data[i];
+  if(length) memcpy(chunk + 8, data, length);
 
   /*4: CRC (of the chunkname characters and the data)*/
   lodepng_chunk_generate_crc(chunk);
@@ -3843,6 +5418,55 @@ static unsigned char paethPredictor(short a, short b, short c)
   else return (unsigned char)a;
 }
 
+#ifdef LODEPNG_SIMD_X86
+/*paethPredictor on eight 16-bit lanes holding unsigned chars*/
+__attribute__((target("sse2")))
+static __m128i paethPredictor_sse2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  __m128i smallest, use_a, use_b;
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  /*same tie breaking as paethPredictor: a, then b, then c*/
+  smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  use_a = _mm_cmpeq_epi16(smallest, pa);
+  use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb));
+  return _mm_or_si128(_mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)),
+                      _mm_andnot_si128(_mm_or_si128(use_a, use_b), c));
+}
+
+/*paethPredictor on sixteen 16-bit lanes holding unsigned chars*/
+__attribute__((target("avx2")))
+static __m256i paethPredictor_avx2(__m256i a, __m256i b, __m256i c)
+{
+  __m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+  __m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+  __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(_mm256_sub_epi16(b, c), _mm256_sub_epi16(a, c)));
+  __m256i smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+  return _mm256_blendv_epi8(_mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(smallest, pb)),
+                            a, _mm256_cmpeq_epi16(smallest, pa));
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+/*paethPredictor on eight 16-bit lanes holding unsigned chars*/
+static int16x8_t paethPredictor_neon(int16x8_t a, int16x8_t b, int16x8_t c)
+{
+  int16x8_t pa = vsubq_s16(b, c);
+  int16x8_t pb = vsubq_s16(a, c);
+  int16x8_t pc = vabsq_s16(vaddq_s16(pa, pb));
+  int16x8_t smallest;
+  pa = vabsq_s16(pa);
+  pb = vabsq_s16(pb);
+  smallest = vminq_s16(pc, vminq_s16(pa, pb));
+  return vbslq_s16(vceqq_s16(smallest, pa), a, vbslq_s16(vceqq_s16(smallest, pb), b, c));
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -3966,6 +5590,152 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+/*
+SIMD versions of unfilterScanline, for the rows that have a previous row. Up works
+on whole vectors. Sub, Average and Paeth depend on the pixel to the left, so they
+go a pixel at a time with the bytes of the pixel in parallel, which only pays off
+for bytewidth 3 and 4. Return 1 if the scanline was handled.
+*/
+#ifdef LODEPNG_SIMD_X86
+__attribute__((target("sse2")))
+static __m128i unfilterLoad_sse2(const unsigned char* p, size_t bytewidth)
+{
+  unsigned v = 0;
+  memcpy(&v, p, bytewidth);
+  return _mm_cvtsi32_si128((int)v);
+}
+
+__attribute__((target("sse2")))
+static void unfilterStore_sse2(unsigned char* p, __m128i v, size_t bytewidth)
+{
+  unsigned u = (unsigned)_mm_cvtsi128_si32(v);
+  memcpy(p, &u, bytewidth);
+}
+
+__attribute__((target("sse2")))
+static unsigned unfilterScanline_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                      size_t bytewidth, unsigned char filterType, size_t length)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, b, c = zero, d;
+  size_t i;
+
+  if(filterType == 2)
+  {
+    for(i = 0; i + 16 <= length; i += 16)
+    {
+      d = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(scanline + i)),
+                       _mm_loadu_si128((const __m128i*)(precon + i)));
+      _mm_storeu_si128((__m128i*)(recon + i), d);
+    }
+    for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+    return 1;
+  }
+
+  if(bytewidth != 3 && bytewidth != 4) return 0;
+
+  switch(filterType)
+  {
+    case 1:
+      for(i = 0; i != length; i += bytewidth)
+      {
+        a = _mm_add_epi8(a, unfilterLoad_sse2(scanline + i, bytewidth));
+        unfilterStore_sse2(recon + i, a, bytewidth);
+      }
+      return 1;
+    case 3:
+      for(i = 0; i != length; i += bytewidth)
+      {
+        b = unfilterLoad_sse2(precon + i, bytewidth);
+        /*_mm_avg_epu8 rounds up, subtract the carried low bit to round down*/
+        d = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+        a = _mm_add_epi8(d, unfilterLoad_sse2(scanline + i, bytewidth));
+        unfilterStore_sse2(recon + i, a, bytewidth);
+      }
+      return 1;
+    case 4:
+      for(i = 0; i != length; i += bytewidth)
+      {
+        /*a and c (left of the current pixel) start at 0 and are kept widened*/
+        b = _mm_unpacklo_epi8(unfilterLoad_sse2(precon + i, bytewidth), zero);
+        d = paethPredictor_sse2(a, b, c);
+        d = _mm_add_epi8(_mm_packus_epi16(d, d), unfilterLoad_sse2(scanline + i, bytewidth));
+        unfilterStore_sse2(recon + i, d, bytewidth);
+        a = _mm_unpacklo_epi8(d, zero);
+        c = b;
+      }
+      return 1;
+    default: return 0;
+  }
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+static uint8x8_t unfilterLoad_neon(const unsigned char* p, size_t bytewidth)
+{
+  uint64_t v = 0;
+  memcpy(&v, p, bytewidth);
+  return vcreate_u8(v);
+}
+
+static void unfilterStore_neon(unsigned char* p, uint8x8_t v, size_t bytewidth)
+{
+  uint64_t u = vget_lane_u64(vreinterpret_u64_u8(v), 0);
+  memcpy(p, &u, bytewidth);
+}
+
+static unsigned unfilterScanline_neon(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                      size_t bytewidth, unsigned char filterType, size_t length)
+{
+  uint8x8_t a = vdup_n_u8(0), b, d;
+  int16x8_t wa = vdupq_n_s16(0), wb, wc = vdupq_n_s16(0);
+  size_t i;
+
+  if(filterType == 2)
+  {
+    for(i = 0; i + 16 <= length; i += 16)
+    {
+      vst1q_u8(recon + i, vaddq_u8(vld1q_u8(scanline + i), vld1q_u8(precon + i)));
+    }
+    for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+    return 1;
+  }
+
+  if(bytewidth != 3 && bytewidth != 4) return 0;
+
+  switch(filterType)
+  {
+    case 1:
+      for(i = 0; i != length; i += bytewidth)
+      {
+        a = vadd_u8(a, unfilterLoad_neon(scanline + i, bytewidth));
+        unfilterStore_neon(recon + i, a, bytewidth);
+      }
+      return 1;
+    case 3:
+      for(i = 0; i != length; i += bytewidth)
+      {
+        b = unfilterLoad_neon(precon + i, bytewidth);
+        a = vadd_u8(vhadd_u8(a, b), unfilterLoad_neon(scanline + i, bytewidth));
+        unfilterStore_neon(recon + i, a, bytewidth);
+      }
+      return 1;
+    case 4:
+      for(i = 0; i != length; i += bytewidth)
+      {
+        wb = vreinterpretq_s16_u16(vmovl_u8(unfilterLoad_neon(precon + i, bytewidth)));
+        d = vmovn_u16(vreinterpretq_u16_s16(paethPredictor_neon(wa, wb, wc)));
+        d = vadd_u8(d, unfilterLoad_neon(scanline + i, bytewidth));
+        unfilterStore_neon(recon + i, d, bytewidth);
+        wa = vreinterpretq_s16_u16(vmovl_u8(d));
+        wc = wb;
+      }
+      return 1;
+    default: return 0;
+  }
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length)
 {
@@ -3979,6 +5749,13 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#if defined(LODEPNG_SIMD_X86)
+  if((precon || filterType == 1) && __builtin_cpu_supports("sse2")
+     && unfilterScanline_sse2(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#elif defined(LODEPNG_SIMD_NEON)
+  if((precon || filterType == 1)
+     && unfilterScanline_neon(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif
   switch(filterType)
   {
     case 0:
@@ -4720,9 +6497,10 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   ucvector_cleanup(&scanlines);
 }
 
-unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
-                        LodePNGState* state,
-                        const unsigned char* in, size_t insize)
+/*lodepng_decode with the allocator already set*/
+static unsigned decodeImage(unsigned char** out, unsigned* w, unsigned* h,
+                            LodePNGState* state,
+                            const unsigned char* in, size_t insize)
 {
   *out = 0;
   decodeGeneric(out, w, h, state, in, insize);
@@ -4765,6 +6543,16 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
   return state->error;
 }
 
+unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
+                        LodePNGState* state,
+                        const unsigned char* in, size_t insize)
+{
+  const LodePNGAllocator* previous = lodepng_set_allocator(state->decoder.zlibsettings.allocator);
+  unsigned error = decodeImage(out, w, h, state, in, insize);
+  lodepng_set_allocator(previous);
+  return error;
+}
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -4842,8 +6630,15 @@ void lodepng_state_init(LodePNGState* state)
 
 void lodepng_state_cleanup(LodePNGState* state)
 {
+#ifdef LODEPNG_COMPILE_DECODER
+  /*a decode may have put memory from its allocator in the info*/
+  const LodePNGAllocator* previous = lodepng_set_allocator(state->decoder.zlibsettings.allocator);
+#endif /*LODEPNG_COMPILE_DECODER*/
   lodepng_color_mode_cleanup(&state->info_raw);
   lodepng_info_cleanup(&state->info_png);
+#ifdef LODEPNG_COMPILE_DECODER
+  lodepng_set_allocator(previous);
+#endif /*LODEPNG_COMPILE_DECODER*/
 }
 
 void lodepng_state_copy(LodePNGState* dest, const LodePNGState* source)
@@ -4968,15 +6763,16 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
   return error;
 }
 
+/*rowsize: size of a filtered scanline, multithreaded deflate segments start at a row*/
 static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
+                              LodePNGCompressSettings* zlibsettings, size_t rowsize)
 {
   ucvector zlibdata;
   unsigned error = 0;
 
   /*compress with the Zlib compressor*/
   ucvector_init(&zlibdata);
-  error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
+  error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings, rowsize);
   if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
   ucvector_cleanup(&zlibdata);
 
@@ -5023,7 +6819,7 @@ static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* te
   ucvector_push_back(&data, 0); /*compression method: 0*/
 
   error = zlib_compress(&compressed.data, &compressed.size,
-                        (unsigned char*)textstring, textsize, zlibsettings);
+                        (unsigned char*)textstring, textsize, zlibsettings, 1);
   if(!error)
   {
     for(i = 0; i != compressed.size; ++i) ucvector_push_back(&data, compressed.data[i]);
@@ -5059,7 +6855,7 @@ static unsigned addChunk_iTXt(ucvector* out, unsigned compressed, const char* ke
     ucvector compressed_data;
     ucvector_init(&compressed_data);
     error = zlib_compress(&compressed_data.data, &compressed_data.size,
-                          (unsigned char*)textstring, textsize, zlibsettings);
+                          (unsigned char*)textstring, textsize, zlibsettings, 1);
     if(!error)
     {
       for(i = 0; i != compressed_data.size; ++i) ucvector_push_back(&data, compressed_data.data[i]);
@@ -5141,6 +6937,163 @@ static unsigned addChunk_pHYs(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*
+SIMD versions of the filterScanline loops that start at bytewidth, for the rows
+that have a previous row (and Sub, which never uses it). Every output byte only
+depends on the input, so this works for any bytewidth. Return the index of the
+first byte not done.
+*/
+#ifdef LODEPNG_SIMD_X86
+__attribute__((target("sse2")))
+static size_t filterScanline_sse2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                  size_t length, size_t bytewidth, unsigned char filterType)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i;
+  for(i = bytewidth; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    __m128i b, c, p;
+    if(filterType == 1)
+    {
+      p = a;
+    }
+    else
+    {
+      b = _mm_loadu_si128((const __m128i*)(prevline + i));
+      if(filterType == 2)
+      {
+        p = b;
+      }
+      else if(filterType == 3)
+      {
+        /*_mm_avg_epu8 rounds up, subtract the carried low bit to round down*/
+        p = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+      }
+      else
+      {
+        c = _mm_loadu_si128((const __m128i*)(prevline + i - bytewidth));
+        p = _mm_packus_epi16(
+            paethPredictor_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+            paethPredictor_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+      }
+    }
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, p));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t filterScanline_avx2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                  size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i;
+  for(i = bytewidth; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i a = _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth));
+    __m256i b, c, p;
+    if(filterType == 1)
+    {
+      p = a;
+    }
+    else
+    {
+      b = _mm256_loadu_si256((const __m256i*)(prevline + i));
+      if(filterType == 2)
+      {
+        p = b;
+      }
+      else if(filterType == 3)
+      {
+        p = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+      }
+      else
+      {
+        __m256i lo, hi;
+        c = _mm256_loadu_si256((const __m256i*)(prevline + i - bytewidth));
+        lo = paethPredictor_avx2(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)),
+                                 _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)),
+                                 _mm256_cvtepu8_epi16(_mm256_castsi256_si128(c)));
+        hi = paethPredictor_avx2(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)),
+                                 _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)),
+                                 _mm256_cvtepu8_epi16(_mm256_extracti128_si256(c, 1)));
+        /*packus works per 128-bit half, put the 64-bit quarters back in order*/
+        p = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+      }
+    }
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_sub_epi8(x, p));
+  }
+  return i;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+static size_t filterScanline_neon(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                  size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i;
+  for(i = bytewidth; i + 16 <= length; i += 16)
+  {
+    uint8x16_t x = vld1q_u8(scanline + i);
+    uint8x16_t a = vld1q_u8(scanline + i - bytewidth);
+    uint8x16_t b, c, p;
+    if(filterType == 1)
+    {
+      p = a;
+    }
+    else
+    {
+      b = vld1q_u8(prevline + i);
+      if(filterType == 2)
+      {
+        p = b;
+      }
+      else if(filterType == 3)
+      {
+        p = vhaddq_u8(a, b);
+      }
+      else
+      {
+        int16x8_t lo, hi;
+        c = vld1q_u8(prevline + i - bytewidth);
+        lo = paethPredictor_neon(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(a))),
+                                 vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(b))),
+                                 vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(c))));
+        hi = paethPredictor_neon(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(a))),
+                                 vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(b))),
+                                 vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(c))));
+        p = vcombine_u8(vmovn_u16(vreinterpretq_u16_s16(lo)), vmovn_u16(vreinterpretq_u16_s16(hi)));
+      }
+    }
+    vst1q_u8(out + i, vsubq_u8(x, p));
+  }
+  return i;
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+/*runs the best available version of the above, returns bytewidth if there is none*/
+static size_t filterScanlineSIMD(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t length, size_t bytewidth, unsigned char filterType)
+{
+#if defined(LODEPNG_SIMD_X86)
+  if(__builtin_cpu_supports("avx2"))
+  {
+    size_t i = filterScanline_avx2(out, scanline, prevline, length, bytewidth, filterType);
+    /*the remaining up to 31 bytes*/
+    return i + filterScanline_sse2(out + i - bytewidth, scanline + i - bytewidth,
+                                   prevline ? prevline + i - bytewidth : 0, length - i + bytewidth,
+                                   bytewidth, filterType) - bytewidth;
+  }
+  if(__builtin_cpu_supports("sse2")) return filterScanline_sse2(out, scanline, prevline, length, bytewidth, filterType);
+#elif defined(LODEPNG_SIMD_NEON)
+  return filterScanline_neon(out, scanline, prevline, length, bytewidth, filterType);
+#endif
+  (void)out; (void)scanline; (void)prevline; (void)length; (void)filterType;
+  return bytewidth;
+}
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType)
 {
@@ -5152,12 +7105,15 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+      i = filterScanlineSIMD(out, scanline, prevline, length, bytewidth, filterType);
+      for(; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline)
       {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - prevline[i];
+        i = filterScanlineSIMD(out, scanline, prevline, length, bytewidth, filterType);
+        for(; i < length; ++i) out[i] = scanline[i] - prevline[i];
       }
       else
       {
@@ -5168,7 +7124,8 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       if(prevline)
       {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+        i = filterScanlineSIMD(out, scanline, prevline, length, bytewidth, filterType);
+        for(; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
       }
       else
       {
@@ -5181,7 +7138,8 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i)
+        i = filterScanlineSIMD(out, scanline, prevline, length, bytewidth, filterType);
+        for(; i < length; ++i)
         {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
@@ -5206,21 +7164,48 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*points attempt to five buffers of linebytes, taken from scratch if given*/
+static unsigned filterAttempts(unsigned char* attempt[5], EncoderScratch* scratch, size_t linebytes)
 {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
-  the scanlines with 1 extra byte per scanline
-  */
+  unsigned type;
+  if(scratch)
+  {
+    const LodePNGAllocator* previous = lodepng_set_allocator(0);
+    unsigned ok = ucvector_resize(&scratch->attempts, linebytes * 5);
+    lodepng_set_allocator(previous);
+    if(!ok) return 83; /*alloc fail*/
+    for(type = 0; type != 5; ++type) attempt[type] = &scratch->attempts.data[linebytes * type];
+    return 0;
+  }
+  for(type = 0; type != 5; ++type) attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+  for(type = 0; type != 5; ++type)
+  {
+    if(!attempt[type])
+    {
+      for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+      return 83; /*alloc fail*/
+    }
+  }
+  return 0;
+}
+
+static void filterAttemptsCleanup(unsigned char* attempt[5], EncoderScratch* scratch)
+{
+  unsigned type;
+  if(!scratch) for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+}
 
+/*filters the rows [y0, y1) of the image, see filter. scratch is optional*/
+static unsigned filterRows(unsigned char* out, const unsigned char* in, unsigned w, unsigned y0, unsigned y1,
+                           const LodePNGColorMode* info, const LodePNGEncoderSettings* settings,
+                           EncoderScratch* scratch)
+{
   unsigned bpp = lodepng_get_bpp(info);
   /*the width of a scanline in bytes, not including the filter type*/
   size_t linebytes = (w * bpp + 7) / 8;
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
+  const unsigned char* prevline = y0 ? &in[(y0 - 1) * linebytes] : 0;
   unsigned x, y;
   unsigned error = 0;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
@@ -5245,7 +7230,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
   if(strategy == LFS_ZERO)
   {
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
@@ -5262,15 +7247,12 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     size_t smallest = 0;
     unsigned char type, bestType = 0;
 
-    for(type = 0; type != 5; ++type)
-    {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
-    }
+    error = filterAttempts(attempt, scratch, linebytes);
+    if(error) return error;
 
     if(!error)
     {
-      for(y = 0; y != h; ++y)
+      for(y = y0; y != y1; ++y)
       {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type)
@@ -5311,7 +7293,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       }
     }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    filterAttemptsCleanup(attempt, scratch);
   }
   else if(strategy == LFS_ENTROPY)
   {
@@ -5321,13 +7303,10 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     unsigned type, bestType = 0;
     unsigned count[256];
 
-    for(type = 0; type != 5; ++type)
-    {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
-    }
+    error = filterAttempts(attempt, scratch, linebytes);
+    if(error) return error;
 
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
       /*try the 5 filter types*/
       for(type = 0; type != 5; ++type)
@@ -5357,11 +7336,11 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    filterAttemptsCleanup(attempt, scratch);
   }
   else if(strategy == LFS_PREDEFINED)
   {
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
@@ -5391,12 +7370,11 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
-    for(type = 0; type != 5; ++type)
-    {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
-    }
-    for(y = 0; y != h; ++y) /*try the 5 filter types*/
+    zlibsettings.numthreads = 0; /*scanlines are too small to split*/
+    zlibsettings.context = 0; /*the context buffers may be in use by other threads*/
+    error = filterAttempts(attempt, scratch, linebytes);
+    if(error) return error;
+    for(y = y0; y != y1; ++y) /*try the 5 filter types*/
     {
       for(type = 0; type != 5; ++type)
       {
@@ -5406,7 +7384,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
         filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
         size[type] = 0;
         dummy = 0;
-        zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
+        zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings, 1);
         lodepng_free(dummy);
         /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
         if(type == 0 || size[type] < smallest)
@@ -5419,13 +7397,76 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
       for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    filterAttemptsCleanup(attempt, scratch);
   }
   else return 88; /* unknown filter strategy */
 
   return error;
 }
 
+#ifdef LODEPNG_COMPILE_THREADS
+typedef struct FilterRows
+{
+  unsigned char* out;
+  const unsigned char* in;
+  unsigned w, y0, y1;
+  const LodePNGColorMode* info;
+  const LodePNGEncoderSettings* settings;
+  EncoderScratch* scratch;
+  unsigned error;
+} FilterRows;
+
+static void* filterRowsThread(void* arg)
+{
+  FilterRows* rows = (FilterRows*)arg;
+  rows->error = filterRows(rows->out, rows->in, rows->w, rows->y0, rows->y1, rows->info, rows->settings,
+                           rows->scratch);
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+#ifdef LODEPNG_COMPILE_THREADS
+  /*every row only depends on the input, so they can be filtered in any order*/
+  unsigned numthreads = settings->zlibsettings.numthreads;
+  if(numthreads > h) numthreads = h;
+  if(numthreads > 1)
+  {
+    unsigned i, error = 0;
+    FilterRows* jobs = (FilterRows*)lodepng_malloc(sizeof(FilterRows) * numthreads);
+    if(jobs)
+    {
+      /*allocate the buffers of all threads first, growing the context later could move them*/
+      unsigned usescratch = encoder_scratch(settings->zlibsettings.context, numthreads - 1) != 0;
+      for(i = 0; i != numthreads; ++i)
+      {
+        jobs[i].out = out;
+        jobs[i].in = in;
+        jobs[i].w = w;
+        jobs[i].y0 = (unsigned)((size_t)h * i / numthreads);
+        jobs[i].y1 = (unsigned)((size_t)h * (i + 1) / numthreads);
+        jobs[i].info = info;
+        jobs[i].settings = settings;
+        jobs[i].scratch = usescratch ? encoder_scratch(settings->zlibsettings.context, i) : 0;
+      }
+      lodepng_parallel(filterRowsThread, jobs, sizeof(FilterRows), numthreads);
+      for(i = 0; i != numthreads; ++i) if(!error) error = jobs[i].error;
+      lodepng_free(jobs);
+      return error;
+    }
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+  return filterRows(out, in, w, 0, h, info, settings, encoder_scratch(settings->zlibsettings.context, 0));
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h)
 {
@@ -5637,9 +7678,10 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state)
+/*lodepng_encode with the allocator already set*/
+static unsigned encodeImage(unsigned char** out, size_t* outsize,
+                            const unsigned char* image, unsigned w, unsigned h,
+                            LodePNGState* state)
 {
   LodePNGInfo info;
   ucvector outv;
@@ -5747,7 +7789,8 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings,
+                                 info.interlace_method == 0 ? 1 + (w * lodepng_get_bpp(&info.color) + 7) / 8 : 1);
     if(state->error) break;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
@@ -5830,6 +7873,16 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   return state->error;
 }
 
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state)
+{
+  const LodePNGAllocator* previous = lodepng_set_allocator(state->encoder.zlibsettings.allocator);
+  unsigned error = encodeImage(out, outsize, image, w, h, state);
+  lodepng_set_allocator(previous);
+  return error;
+}
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5893,6 +7946,14 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 }
 
+void lodepng_encoder_settings_level(LodePNGEncoderSettings* settings, unsigned level)
+{
+  lodepng_compress_settings_level(&settings->zlibsettings, level);
+  /*trying all filters costs more than the fast LZ77 levels themselves, and rle
+  only finds the runs of equal pixels in unfiltered rows*/
+  settings->filter_strategy = level <= 2 ? LFS_ZERO : LFS_MINSUM;
+}
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_PNG*/
 
@@ -6029,6 +8090,16 @@ unsigned save_file(const std::vector<unsigned char>& buffer, const std::string&
 }
 #endif /* LODEPNG_COMPILE_DISK */
 
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+/*frees an output of the C functions, which came from allocator*/
+static void freeWith(const LodePNGAllocator* allocator, void* ptr)
+{
+  const LodePNGAllocator* previous = lodepng_set_allocator(allocator);
+  lodepng_free(ptr);
+  lodepng_set_allocator(previous);
+}
+#endif /* defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER) */
+
 #ifdef LODEPNG_COMPILE_ZLIB
 #ifdef LODEPNG_COMPILE_DECODER
 unsigned decompress(std::vector<unsigned char>& out, const unsigned char* in, size_t insize,
@@ -6040,7 +8111,7 @@ unsigned decompress(std::vector<unsigned char>& out, const unsigned char* in, si
   if(buffer)
   {
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-    lodepng_free(buffer);
+    freeWith(settings.allocator, buffer);
   }
   return error;
 }
@@ -6058,11 +8129,11 @@ unsigned compress(std::vector<unsigned char>& out, const unsigned char* in, size
 {
   unsigned char* buffer = 0;
   size_t buffersize = 0;
-  unsigned error = zlib_compress(&buffer, &buffersize, in, insize, &settings);
+  unsigned error = zlib_compress(&buffer, &buffersize, in, insize, &settings, 1);
   if(buffer)
   {
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-    lodepng_free(buffer);
+    freeWith(settings.allocator, buffer);
   }
   return error;
 }
@@ -6136,7 +8207,7 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
     size_t buffersize = lodepng_get_raw_size(w, h, &state.info_raw);
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
   }
-  lodepng_free(buffer);
+  freeWith(state.decoder.zlibsettings.allocator, buffer);
   return error;
 }
 
@@ -6192,7 +8263,7 @@ unsigned encode(std::vector<unsigned char>& out,
   if(buffer)
   {
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-    lodepng_free(buffer);
+    freeWith(state.encoder.zlibsettings.allocator, buffer);
   }
   return error;
 }
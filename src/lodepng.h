@@ -74,6 +74,15 @@ source files with custom allocators.*/
 #ifndef LODEPNG_NO_COMPILE_ALLOCATORS
 #define LODEPNG_COMPILE_ALLOCATORS
 #endif
+/*SIMD versions of the checksums, selected at runtime where the instructions are
+optional (x86 with gcc or clang, aarch64)*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+#define LODEPNG_COMPILE_SIMD
+#endif
+/*filtering and deflating on several POSIX threads, see numthreads in LodePNGCompressSettings*/
+#if !defined(LODEPNG_NO_COMPILE_THREADS) && (defined(__unix__) || defined(__APPLE__))
+#define LODEPNG_COMPILE_THREADS
+#endif
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -250,6 +259,40 @@ unsigned encode(const std::string& filename,
 const char* lodepng_error_text(unsigned code);
 #endif /*LODEPNG_COMPILE_ERROR_TEXT*/
 
+/*
+Allocation callbacks, used instead of malloc, realloc and free by everything that an
+encode or decode with the allocator setting of LodePNGCompressSettings or
+LodePNGDecompressSettings set to them allocates, also on the encoder threads. Memory
+handed out from such a call (the output, and the info read into the LodePNGState by a
+decode) comes from the allocator: free it with it, lodepng_state_cleanup uses the one
+of the decoder settings. The realloc callback must act like realloc for a null pointer.
+Only with LODEPNG_COMPILE_ALLOCATORS, the lodepng_malloc of your own project is used
+as is otherwise.
+*/
+typedef struct LodePNGAllocator
+{
+  void* (*allocate)(void* user, size_t size);
+  void* (*reallocate)(void* user, void* ptr, size_t size);
+  void (*deallocate)(void* user, void* ptr);
+  void* user; /*passed to the callbacks*/
+} LodePNGAllocator;
+
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+/*
+A bump allocator: allocations are taken one after the other from large blocks and
+freeing only gives back the most recent one, so one encode or decode costs a handful of
+mallocs. lodepng_arena_reset releases everything at once and merges the blocks into one
+as large as all of them, so the next image of the same size needs no malloc at all.
+blocksize is the minimum size of new blocks, 0 for 1 MiB. Pointers that are not from the
+arena are passed on to realloc and free. It may be used by several threads at once.
+*/
+typedef struct LodePNGArena LodePNGArena;
+LodePNGArena* lodepng_arena_new(size_t blocksize);
+const LodePNGAllocator* lodepng_arena_allocator(LodePNGArena* arena);
+void lodepng_arena_reset(LodePNGArena* arena);
+void lodepng_arena_delete(LodePNGArena* arena);
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Settings for zlib decompression*/
 typedef struct LodePNGDecompressSettings LodePNGDecompressSettings;
@@ -269,6 +312,8 @@ struct LodePNGDecompressSettings
                              const LodePNGDecompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  const LodePNGAllocator* allocator; /*allocation callbacks, see LodePNGAllocator. Default: null*/
 };
 
 extern const LodePNGDecompressSettings lodepng_default_decompress_settings;
@@ -276,6 +321,18 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*
+Buffers of the encoder that can be kept from one encode to the next: the LZ77 hash
+chains, the LZ77 output and the filter attempts, one set per encoder thread. Create
+one with lodepng_encoder_context_new and point the context setting of
+LodePNGCompressSettings to it to stop allocating and clearing these for every image.
+It may only be used by one encode at a time. lodepng_encoder_context_delete frees it.
+Its buffers never come from the allocator setting, so it may outlive an arena reset.
+*/
+typedef struct LodePNGEncoderContext LodePNGEncoderContext;
+LodePNGEncoderContext* lodepng_encoder_context_new(void);
+void lodepng_encoder_context_delete(LodePNGEncoderContext* context);
+
 /*
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
@@ -290,6 +347,22 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*maximum number of earlier positions to try per byte, 0 to derive it from windowsize: windowsize / 8,
+  or windowsize itself from 8192 on. Default: 0*/
+  unsigned maxchainlength;
+  /*instead of the hash chains, only look for repeats of the previous 1 to 4 bytes (runs of equal
+  pixels when not filtering). Much faster, and good for images with large flat areas. Default: false*/
+  unsigned rle;
+  /*find matches with 4-byte hashes in a single chain, comparing 8 bytes at a time, instead of
+  the 3-byte hashes with a separate chain for runs of zeros. Several times faster on images
+  with many repeats, the output is about as small. Default: false*/
+  unsigned fastmatch;
+  /*filter and deflate row-aligned segments of the image on this many threads, joined with
+  sync flushes, each segment primed with the window before it as dictionary. The output
+  is slightly larger than with one thread. Only with LODEPNG_COMPILE_THREADS. Default: 0*/
+  unsigned numthreads;
+  /*buffers reused between encodes, see LodePNGEncoderContext. Default: null*/
+  LodePNGEncoderContext* context;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -303,10 +376,19 @@ struct LodePNGCompressSettings /*deflate = compress*/
                              const LodePNGCompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  const LodePNGAllocator* allocator; /*allocation callbacks, see LodePNGAllocator. Default: null*/
 };
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+/*
+Sets the LZ77 and Huffman settings to a zlib-like compression level: 0 only stores,
+1 uses rle, 2 and 3 take the first match (2 only tries one position per byte), 4 to
+9 use lazy matching with longer chains and larger windows. Levels from 2 on use
+fastmatch, 6 has the default window and chain settings. Levels above 9 are treated as 9.
+*/
+void lodepng_compress_settings_level(LodePNGCompressSettings* settings, unsigned level);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -614,6 +696,8 @@ typedef struct LodePNGEncoderSettings
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+/*Sets zlibsettings with lodepng_compress_settings_level, and does not filter at levels 0 to 2*/
+void lodepng_encoder_settings_level(LodePNGEncoderSettings* settings, unsigned level);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
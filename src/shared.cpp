@@ -1,143 +1,1398 @@
+#include <algorithm>
+#include <assert.h>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
 #include <math.h>
+#include <mutex>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 #include "lodepng.h"
 #include "shared.h"
 
 void
-save_data(struct Pixel *data, int width, int height, int depth)
+get_output_opts(struct output_opts *opts)
 {
-    std::vector<unsigned char> image;
-    image.reserve(width * height * depth * 4);
+    const char *tmp;
 
-    FILE *dataFile = fopen("data.csv", "w");
+    memset(opts, 0, sizeof(*opts));
 
-    fprintf(dataFile, "z:int,");
-    fprintf(dataFile, "GIID.z:int,");
+    tmp = getenv("OUTPUT");
+    if (tmp == NULL || strcmp(tmp, "full") == 0) {
+        opts->mode = OUTPUT_FULL;
+    } else if (strcmp(tmp, "image") == 0) {
+        opts->mode = OUTPUT_IMAGE;
+    } else if (strcmp(tmp, "stats") == 0) {
+        opts->mode = OUTPUT_STATS;
+    } else if (strcmp(tmp, "checksum") == 0) {
+        opts->mode = OUTPUT_CHECKSUM;
+    } else {
+        fprintf(stderr, "unknown OUTPUT=%s, expected full, image, stats or checksum\n", tmp);
+        exit(2);
+    }
+
+    tmp = getenv("OUTPUT_ASYNC");
+    opts->async = tmp ? atoi(tmp) > 0 : -1;
+
+    tmp = getenv("OUTPUT_MMAP");
+    opts->mmap = tmp == NULL || atoi(tmp) > 0;
+
+    tmp = getenv("OUTPUT_COMPRESS");
+    opts->compress = tmp != NULL && atoi(tmp) > 0;
+
+    tmp = getenv("OUTPUT_DELTA");
+    opts->delta = tmp != NULL && atoi(tmp) > 0;
+
+    tmp = getenv("OUTPUT_LEVEL");
+    opts->level = tmp ? atoi(tmp) : -1;
+    if (opts->level > 9)
+        opts->level = 9;
+
+    /* threads used to format data.csv and compress the png, values that are
+     * not a count in 1..256 are ignored like an unset variable */
+    tmp = getenv("OUTPUT_THREADS");
+    if (tmp) {
+        char *end;
+        long threads = strtol(tmp, &end, 10);
+        if (end != tmp && *end == '\0' && threads > 0 && threads <= 256)
+            opts->threads = (unsigned)threads;
+        else
+            fprintf(stderr, "ignoring OUTPUT_THREADS=%s, expected 1 to 256\n", tmp);
+    }
+    if (opts->threads == 0)
+        opts->threads = std::thread::hardware_concurrency();
+    if (opts->threads == 0)
+        opts->threads = 1;
+
+    tmp = getenv("CHECKSUM");
+    if (tmp) {
+        opts->expected_checksum = (uint32_t)strtoul(tmp, NULL, 16);
+        opts->has_expected_checksum = 1;
+    }
+}
+
+static int
+save_checksum(const struct Pixel *data, int width, int height, int depth,
+        const struct output_opts *opts, const char *suffix)
+{
+    size_t size = sizeof(struct Pixel) * width * height * depth;
+    uint32_t crc = lodepng_crc32((const unsigned char *)data, size);
+
+    char name[256];
+    snprintf(name, sizeof(name), "checksum%s.txt", suffix);
+
+    FILE *f = fopen(name, "w");
+    if (!f) {
+        perror(name);
+        return 1;
+    }
+    fprintf(f, "%08x\n", crc);
+    fclose(f);
+
+    if (opts->has_expected_checksum && crc != opts->expected_checksum) {
+        fprintf(stderr, "checksum mismatch: got %08x, expected %08x\n",
+                crc, opts->expected_checksum);
+        return 1;
+    }
+
+    return 0;
+}
+
+static const char csv_header[] =
+    "z:int,"
+    "GIID.z:int,"
+
+    "y:int,"
+    "GIID.y:int,"
+
+    "x:int,"
+    "GIID.x:int,"
+
+    "WGID.z:int,"
+    "NumWG.z:int,"
+
+    "WGID.y:int,"
+    "NumWG.y:int,"
+
+    "WGID.x:int,"
+    "NumWG.x:int,"
+
+    "LIID.z:int,"
+    "WGS.z:int,"
+
+    "LIID.y:int,"
+    "WGS.y:int,"
+
+    "LIID.x:int,"
+    "WGS.x:int,"
+
+    "LIIndex:int,"
+
+    "SGID:int,"
+    "NumSG:int,"
+
+    "SGIID:int,"
+    "SGS:int,"
+
+    "rFloat:string,"
+    "rChar:int,"
+    "gFloat:string,"
+    "gChar:int,"
+    "bFloat:string,"
+    "bChar:int,"
+    "aFloat:string,"
+    "aChar:int\n";
+
+/* upper bound of a formatted row: 27 integers, 4 floats printed with %f
+ * (which can take up to 48 characters), separators and the newline */
+#define CSV_ROW_MAX (27 * 10 + 4 * 48 + 32)
+
+static inline unsigned
+u32_len(uint32_t v)
+{
+    unsigned n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+static inline char *
+put_u32(char *p, uint32_t v)
+{
+    char tmp[10];
+    unsigned n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n)
+        *p++ = tmp[--n];
+    return p;
+}
+
+/*
+ * A float scaled by 10^6 is exact in a double (24 + 14 significant bits),
+ * so rounding it to the nearest integer gives the same digits as printf's
+ * "%f". Returns false for values that have to go through snprintf.
+ */
+static inline bool
+float_fixed(float f, uint64_t *scaled)
+{
+    double d = fabs((double)f * 1e6);
+    if (!(d < 1e15))
+        return false;
+    *scaled = (uint64_t)nearbyint(d);
+    return true;
+}
+
+static inline unsigned
+float_len(float f)
+{
+    uint64_t s;
+    if (!float_fixed(f, &s))
+        return snprintf(NULL, 0, "%f", f);
+
+    unsigned n = (signbit(f) ? 1 : 0) + 7;
+    s /= 1000000;
+    do {
+        s /= 10;
+        n++;
+    } while (s);
+    return n;
+}
+
+static inline char *
+put_float(char *p, float f)
+{
+    uint64_t s;
+    if (!float_fixed(f, &s))
+        return p + sprintf(p, "%f", f);
+
+    if (signbit(f))
+        *p++ = '-';
+
+    uint64_t ip = s / 1000000;
+    uint32_t fp = s % 1000000;
+
+    char tmp[20];
+    unsigned n = 0;
+    do {
+        tmp[n++] = '0' + ip % 10;
+        ip /= 10;
+    } while (ip);
+    while (n)
+        *p++ = tmp[--n];
+
+    *p++ = '.';
+    for (int d = 5; d >= 0; --d) {
+        p[d] = '0' + fp % 10;
+        fp /= 10;
+    }
+    return p + 6;
+}
+
+static inline uint32_t
+to_char(float f)
+{
+    return (unsigned char)(255.0f * f);
+}
+
+/* the values of a row of data.csv, in column order */
+static inline void
+csv_row_values(const struct Pixel *d, size_t i, int width, int height, uint32_t v[23])
+{
+    size_t plane = (size_t)width * height;
+
+    v[0] = i / plane;
+    v[1] = d->globalInvocationID.z;
+    v[2] = (i % plane) / width;
+    v[3] = d->globalInvocationID.y;
+    v[4] = (i % plane) % width;
+    v[5] = d->globalInvocationID.x;
+    v[6] = d->workGroupID.z;
+    v[7] = d->numWorkGroups.z;
+    v[8] = d->workGroupID.y;
+    v[9] = d->numWorkGroups.y;
+    v[10] = d->workGroupID.x;
+    v[11] = d->numWorkGroups.x;
+    v[12] = d->localInvocationID.z;
+    v[13] = d->workGroupSize.z;
+    v[14] = d->localInvocationID.y;
+    v[15] = d->workGroupSize.y;
+    v[16] = d->localInvocationID.x;
+    v[17] = d->workGroupSize.x;
+    v[18] = d->localInvocationIndex.x;
+    v[19] = d->subgroup.x; // SGID
+    v[20] = d->subgroup.w; // NumSG
+    v[21] = d->subgroup.y; // SGIID
+    v[22] = d->subgroup.z; // SGS
+}
+
+static size_t
+csv_row_len(const struct Pixel *d, size_t i, int width, int height)
+{
+    uint32_t v[23];
+    csv_row_values(d, i, width, height, v);
+
+    size_t len = 30 + 1; // separators and newline
+    for (int c = 0; c < 23; ++c)
+        len += u32_len(v[c]);
+
+    const float *rgba = &d->r;
+    for (int c = 0; c < 4; ++c)
+        len += float_len(rgba[c]) + u32_len(to_char(rgba[c]));
+
+    return len;
+}
+
+static char *
+csv_row_format(char *p, const struct Pixel *d, size_t i, int width, int height)
+{
+    uint32_t v[23];
+    csv_row_values(d, i, width, height, v);
+
+    for (int c = 0; c < 23; ++c) {
+        p = put_u32(p, v[c]);
+        *p++ = ',';
+    }
+
+    const float *rgba = &d->r;
+    for (int c = 0; c < 4; ++c) {
+        p = put_float(p, rgba[c]);
+        *p++ = ',';
+        p = put_u32(p, to_char(rgba[c]));
+        *p++ = c == 3 ? '\n' : ',';
+    }
+
+    return p;
+}
+
+/* all columns of data.csv */
+struct csv_full_rows {
+    const struct Pixel *data;
+    size_t count;
+    int width, height;
+
+    const char *header() const { return csv_header; }
+    size_t header_len() const { return sizeof(csv_header) - 1; }
+    size_t len(size_t i) const { return csv_row_len(&data[i], i, width, height); }
+    char *format(char *p, size_t i) const { return csv_row_format(p, &data[i], i, width, height); }
+};
+
+/* maps a new file of the given size for writing, returns NULL on failure */
+static char *
+map_file(const char *name, size_t size, int *fd)
+{
+    *fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (*fd < 0) {
+        perror(name);
+        return NULL;
+    }
+
+    if (ftruncate(*fd, size)) {
+        perror("ftruncate");
+        close(*fd);
+        return NULL;
+    }
+
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        close(*fd);
+        return NULL;
+    }
+
+    return (char *)ptr;
+}
+
+static int
+unmap_file(char *ptr, size_t size, int fd)
+{
+    int ret = munmap(ptr, size);
+    if (ret)
+        perror("munmap");
+    if (close(fd)) {
+        perror("close");
+        ret = 1;
+    }
+    return ret != 0;
+}
+
+/*
+ * Formats rows straight into the page cache: every thread first computes
+ * the exact length of its share of rows, which gives the file size and the
+ * offset each thread writes at, then formats its rows into the mapping.
+ */
+template <typename Rows>
+static int
+save_csv_mmap(const Rows &rows, const char *name, unsigned nthreads)
+{
+    size_t count = rows.count;
+
+    if (nthreads > count)
+        nthreads = count ? count : 1;
+
+    std::vector<size_t> offsets(nthreads + 1);
+    std::vector<std::thread> threads;
+
+    offsets[0] = rows.header_len();
+    for (unsigned t = 0; t < nthreads; ++t) {
+        threads.push_back(std::thread([=, &rows, &offsets] {
+            size_t len = 0;
+            for (size_t i = count * t / nthreads; i < count * (t + 1) / nthreads; ++i)
+                len += rows.len(i);
+            offsets[t + 1] = len;
+        }));
+    }
+    for (std::thread &t : threads)
+        t.join();
+    threads.clear();
+
+    for (unsigned t = 0; t < nthreads; ++t)
+        offsets[t + 1] += offsets[t];
+
+    size_t size = offsets[nthreads];
+    int fd;
+    char *map = map_file(name, size, &fd);
+    if (!map)
+        return -1;
+
+    memcpy(map, rows.header(), rows.header_len());
+    for (unsigned t = 0; t < nthreads; ++t) {
+        threads.push_back(std::thread([=, &rows, &offsets] {
+            char *p = map + offsets[t];
+            for (size_t i = count * t / nthreads; i < count * (t + 1) / nthreads; ++i)
+                p = rows.format(p, i);
+            assert(p == map + offsets[t + 1]);
+        }));
+    }
+    for (std::thread &t : threads)
+        t.join();
+
+    return unmap_file(map, size, fd);
+}
+
+template <typename Rows>
+static int
+save_csv_stdio(const Rows &rows, const char *name)
+{
+    FILE *dataFile = fopen(name, "w");
+    if (!dataFile) {
+        perror(name);
+        return 1;
+    }
+
+    fwrite(rows.header(), 1, rows.header_len(), dataFile);
+
+    std::vector<char> buf(1 << 16);
+    char *p = buf.data();
+    for (size_t i = 0; i < rows.count; ++i) {
+        if (p + CSV_ROW_MAX > buf.data() + buf.size()) {
+            fwrite(buf.data(), 1, p - buf.data(), dataFile);
+            p = buf.data();
+        }
+        p = rows.format(p, i);
+    }
+    fwrite(buf.data(), 1, p - buf.data(), dataFile);
+
+    if (fclose(dataFile)) {
+        perror(name);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* rows are formatted into chunks of about this size, each of which is
+ * compressed into its own gzip member (concatenated members are a valid
+ * gzip file) */
+#define GZIP_CHUNK_SIZE (4 << 20)
+
+struct gzip_chunk {
+    std::vector<char> text;
+    size_t seq;
+};
+
+static void
+put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/*
+ * Formats rows on the calling thread while nthreads threads deflate the
+ * formatted chunks. Chunks are compressed independently, but written in
+ * order.
+ */
+template <typename Rows>
+static int
+save_csv_gzip(const Rows &rows, const char *name, unsigned nthreads, int level)
+{
+    size_t count = rows.count;
+
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    if (level >= 0)
+        lodepng_compress_settings_level(&settings, level);
+
+    FILE *f = fopen(name, "wb");
+    if (!f) {
+        perror(name);
+        return 1;
+    }
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<gzip_chunk *> queue;
+    bool done = false;
+    size_t next_write = 0;
+    int ret = 0;
+
+    auto compress = [&] {
+        /* every thread reuses its hash chains for all of its chunks */
+        LodePNGCompressSettings own = settings;
+        own.context = lodepng_encoder_context_new();
+
+        std::unique_lock<std::mutex> l(lock);
+
+        for (;;) {
+            while (queue.empty() && !done)
+                cond.wait(l);
+            if (queue.empty())
+                break;
+
+            gzip_chunk *chunk = queue.front();
+            queue.pop_front();
+            cond.notify_all();
+            l.unlock();
+
+            const unsigned char *in = (const unsigned char *)chunk->text.data();
+            size_t insize = chunk->text.size();
+            unsigned char *out = NULL;
+            size_t outsize = 0;
+            unsigned error = lodepng_deflate(&out, &outsize, in, insize, &own);
+
+            /* member header: magic, deflate, no flags, no mtime, unix */
+            unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+            unsigned char trailer[8];
+            put_le32(trailer, lodepng_crc32(in, insize));
+            put_le32(trailer + 4, (uint32_t)insize);
+
+            l.lock();
+            while (next_write != chunk->seq)
+                cond.wait(l);
+
+            if (error) {
+                fprintf(stderr, "deflate error %u: %s\n", error, lodepng_error_text(error));
+                ret = 1;
+            } else if (!ret) {
+                if (fwrite(header, sizeof(header), 1, f) != 1 ||
+                        fwrite(out, outsize, 1, f) != 1 ||
+                        fwrite(trailer, sizeof(trailer), 1, f) != 1) {
+                    perror(name);
+                    ret = 1;
+                }
+            }
+            next_write++;
+            cond.notify_all();
+
+            free(out);
+            delete chunk;
+        }
+
+        lodepng_encoder_context_delete(own.context);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; ++t)
+        threads.push_back(std::thread(compress));
+
+    gzip_chunk *chunk = new gzip_chunk;
+    chunk->seq = 0;
+    chunk->text.resize(GZIP_CHUNK_SIZE);
+    memcpy(chunk->text.data(), rows.header(), rows.header_len());
+    char *p = chunk->text.data() + rows.header_len();
+
+    for (size_t i = 0; i <= count; ++i) {
+        char *end = chunk->text.data() + chunk->text.size();
+        if (i == count || p + CSV_ROW_MAX > end) {
+            chunk->text.resize(p - chunk->text.data());
+            size_t seq = chunk->seq;
+
+            {
+                std::unique_lock<std::mutex> l(lock);
+                /* don't run too far ahead of the compressors */
+                while (queue.size() >= 2 * nthreads)
+                    cond.wait(l);
+                queue.push_back(chunk);
+                cond.notify_all();
+            }
+
+            if (i == count)
+                break;
+
+            chunk = new gzip_chunk;
+            chunk->seq = seq + 1;
+            chunk->text.resize(GZIP_CHUNK_SIZE);
+            p = chunk->text.data();
+        }
+
+        p = rows.format(p, i);
+    }
+
+    {
+        std::unique_lock<std::mutex> l(lock);
+        done = true;
+        cond.notify_all();
+    }
+    for (std::thread &t : threads)
+        t.join();
+
+    if (fclose(f)) {
+        perror(name);
+        ret = 1;
+    }
+
+    return ret;
+}
+
+/*
+ * Modelled ("delta") dump. Most columns are either constant, an affine
+ * function of the x, y, z coordinates of the row, or follow from the group
+ * and subgroup sizes the way the dispatch is expected to hand out IDs.
+ * Those are described once in data_model.csv and data.csv only gets the
+ * remaining columns.
+ */
+enum csv_column_kind {
+    COLUMN_AFFINE,   /* c0 + dx * x + dy * y + dz * z, constant if all d are 0 */
+    COLUMN_DISPATCH, /* equal to the expected ID everywhere */
+    COLUMN_DELTA,    /* written, as the difference to the expected ID */
+    COLUMN_ROW,      /* written as is */
+    COLUMN_CHAR,     /* (unsigned char)(255 * the preceding float column) */
+};
+
+/* integer columns, in the order of csv_row_values() */
+#define CSV_INT_COLUMNS 23
+/* rFloat, rChar, gFloat, ... */
+#define CSV_COLUMNS (CSV_INT_COLUMNS + 8)
+
+struct csv_column {
+    std::string name;
+    enum csv_column_kind kind;
+    uint32_t c0, dx, dy, dz;
+};
+
+/* the expected IDs, for the columns which have one */
+static inline bool
+csv_expected(const uint32_t v[CSV_INT_COLUMNS], int c, uint32_t *e)
+{
+    /* per dimension: GIID, WGID, WGS column */
+    static const int dims[3][3] = { { 1, 6, 13 }, { 3, 8, 15 }, { 5, 10, 17 } };
+
+    for (int d = 0; d < 3; ++d) {
+        uint32_t giid = v[dims[d][0]], wgs = v[dims[d][2]];
+        if (c == dims[d][1]) { /* WGID */
+            *e = wgs ? giid / wgs : 0;
+            return true;
+        }
+        if (c == dims[d][1] + 6) { /* LIID */
+            *e = wgs ? giid % wgs : 0;
+            return true;
+        }
+    }
+
+    uint32_t sgs = v[22];
+    switch (c) {
+    case 18: /* LIIndex */
+        *e = (v[12] * v[15] + v[14]) * v[17] + v[16];
+        return true;
+    case 19: /* SGID */
+        *e = sgs ? v[18] / sgs : 0;
+        return true;
+    case 20: /* NumSG */
+        *e = sgs ? (v[13] * v[15] * v[17] + sgs - 1) / sgs : 0;
+        return true;
+    case 21: /* SGIID */
+        *e = sgs ? v[18] % sgs : 0;
+        return true;
+    }
+
+    return false;
+}
 
-    fprintf(dataFile, "y:int,");
-    fprintf(dataFile, "GIID.y:int,");
+/* the residual columns of data.csv */
+struct csv_residual_rows {
+    const struct Pixel *data;
+    size_t count;
+    int width, height;
 
-    fprintf(dataFile, "x:int,");
-    fprintf(dataFile, "GIID.x:int,");
+    std::string head;
+    /* indices of written integer columns and whether they are deltas */
+    std::vector<int> ints;
+    std::vector<bool> delta;
+    /* indices (0-3) of written float columns */
+    std::vector<int> floats;
 
-    fprintf(dataFile, "WGID.z:int,");
-    fprintf(dataFile, "NumWG.z:int,");
+    const char *header() const { return head.c_str(); }
+    size_t header_len() const { return head.size(); }
 
-    fprintf(dataFile, "WGID.y:int,");
-    fprintf(dataFile, "NumWG.y:int,");
+    size_t len(size_t i) const
+    {
+        uint32_t v[CSV_INT_COLUMNS];
+        csv_row_values(&data[i], i, width, height, v);
 
-    fprintf(dataFile, "WGID.x:int,");
-    fprintf(dataFile, "NumWG.x:int,");
+        /* a separator or the newline per column, a row of only modelled
+         * columns is still a newline */
+        size_t len = ints.empty() && floats.empty() ? 1 : ints.size() + floats.size();
+        for (size_t c = 0; c < ints.size(); ++c) {
+            uint32_t val = v[ints[c]];
+            if (delta[c]) {
+                uint32_t e = 0;
+                csv_expected(v, ints[c], &e);
+                int32_t diff = (int32_t)(val - e);
+                len += diff < 0 ? 1 + u32_len(-(uint32_t)diff) : u32_len(diff);
+            } else {
+                len += u32_len(val);
+            }
+        }
 
-    fprintf(dataFile, "LIID.z:int,");
-    fprintf(dataFile, "WGS.z:int,");
+        const float *rgba = &data[i].r;
+        for (int f : floats)
+            len += float_len(rgba[f]);
 
-    fprintf(dataFile, "LIID.y:int,");
-    fprintf(dataFile, "WGS.y:int,");
+        return len;
+    }
 
-    fprintf(dataFile, "LIID.x:int,");
-    fprintf(dataFile, "WGS.x:int,");
+    char *format(char *p, size_t i) const
+    {
+        uint32_t v[CSV_INT_COLUMNS];
+        csv_row_values(&data[i], i, width, height, v);
 
-    fprintf(dataFile, "LIIndex:int,");
+        for (size_t c = 0; c < ints.size(); ++c) {
+            uint32_t val = v[ints[c]];
+            if (delta[c]) {
+                uint32_t e = 0;
+                csv_expected(v, ints[c], &e);
+                int32_t diff = (int32_t)(val - e);
+                if (diff < 0) {
+                    *p++ = '-';
+                    p = put_u32(p, -(uint32_t)diff);
+                } else {
+                    p = put_u32(p, diff);
+                }
+            } else {
+                p = put_u32(p, val);
+            }
+            *p++ = ',';
+        }
 
-    fprintf(dataFile, "SGID:int,");
-    fprintf(dataFile, "NumSG:int,");
+        const float *rgba = &data[i].r;
+        for (int f : floats) {
+            p = put_float(p, rgba[f]);
+            *p++ = ',';
+        }
 
-    fprintf(dataFile, "SGIID:int,");
-    fprintf(dataFile, "SGS:int,");
+        /* replace the last separator */
+        if (!ints.empty() || !floats.empty())
+            p[-1] = '\n';
+        else
+            *p++ = '\n';
 
-    fprintf(dataFile, "rFloat:string,");
-    fprintf(dataFile, "rChar:int,");
-    fprintf(dataFile, "gFloat:string,");
-    fprintf(dataFile, "gChar:int,");
-    fprintf(dataFile, "bFloat:string,");
-    fprintf(dataFile, "bChar:int,");
-    fprintf(dataFile, "aFloat:string,");
-    fprintf(dataFile, "aChar:int\n");
+        return p;
+    }
+};
 
-    for (int i = 0; i < width * height * depth; ++i) {
-        fprintf(dataFile, "%u,", i  / (width * height));
-        fprintf(dataFile, "%u,", data[i].globalInvocationID.z);
+/* finds the model of every column, see csv_column_kind */
+static void
+csv_fit_columns(const struct Pixel *data, int width, int height, int depth,
+        struct csv_column columns[CSV_COLUMNS])
+{
+    size_t count = (size_t)width * height * depth;
+    size_t plane = (size_t)width * height;
+
+    /* names, from the header */
+    const char *h = csv_header;
+    for (int c = 0; c < CSV_COLUMNS; ++c) {
+        size_t n = strcspn(h, ",\n");
+        columns[c].name.assign(h, n);
+        h += n + 1;
+    }
 
-        fprintf(dataFile, "%u,", (i % (width * height)) / width);
-        fprintf(dataFile, "%u,", data[i].globalInvocationID.y);
+    /* coefficients from the neighbours of the first row, verified below */
+    uint32_t v0[CSV_INT_COLUMNS], vx[CSV_INT_COLUMNS], vy[CSV_INT_COLUMNS], vz[CSV_INT_COLUMNS];
+    csv_row_values(&data[0], 0, width, height, v0);
+    csv_row_values(&data[width > 1 ? 1 : 0], width > 1 ? 1 : 0, width, height, vx);
+    csv_row_values(&data[height > 1 ? width : 0], height > 1 ? width : 0, width, height, vy);
+    csv_row_values(&data[depth > 1 ? plane : 0], depth > 1 ? plane : 0, width, height, vz);
 
-        fprintf(dataFile, "%u,", (i % (width * height)) % width);
-        fprintf(dataFile, "%u,", data[i].globalInvocationID.x);
+    bool affine[CSV_INT_COLUMNS], dispatch[CSV_INT_COLUMNS];
+    for (int c = 0; c < CSV_INT_COLUMNS; ++c) {
+        columns[c].c0 = v0[c];
+        columns[c].dx = vx[c] - v0[c];
+        columns[c].dy = vy[c] - v0[c];
+        columns[c].dz = vz[c] - v0[c];
+        affine[c] = true;
+        uint32_t e;
+        dispatch[c] = csv_expected(v0, c, &e);
+    }
 
-        fprintf(dataFile, "%u,", data[i].workGroupID.z);
-        fprintf(dataFile, "%u,", data[i].numWorkGroups.z);
+    uint32_t rgba0[4];
+    bool constant[4];
+    memcpy(rgba0, &data[0].r, sizeof(rgba0));
+    for (int f = 0; f < 4; ++f)
+        constant[f] = true;
 
-        fprintf(dataFile, "%u,", data[i].workGroupID.y);
-        fprintf(dataFile, "%u,", data[i].numWorkGroups.y);
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t v[CSV_INT_COLUMNS];
+        csv_row_values(&data[i], i, width, height, v);
 
-        fprintf(dataFile, "%u,", data[i].workGroupID.x);
-        fprintf(dataFile, "%u,", data[i].numWorkGroups.x);
+        uint32_t z = v[0], y = v[2], x = v[4];
+        for (int c = 0; c < CSV_INT_COLUMNS; ++c) {
+            const struct csv_column *col = &columns[c];
+            affine[c] &= v[c] == col->c0 + col->dx * x + col->dy * y + col->dz * z;
 
-        fprintf(dataFile, "%u,", data[i].localInvocationID.z);
-        fprintf(dataFile, "%u,", data[i].workGroupSize.z);
+            uint32_t e;
+            if (dispatch[c] && csv_expected(v, c, &e))
+                dispatch[c] = v[c] == e;
+        }
 
-        fprintf(dataFile, "%u,", data[i].localInvocationID.y);
-        fprintf(dataFile, "%u,", data[i].workGroupSize.y);
+        uint32_t rgba[4];
+        memcpy(rgba, &data[i].r, sizeof(rgba));
+        for (int f = 0; f < 4; ++f)
+            constant[f] &= rgba[f] == rgba0[f];
+    }
 
-        fprintf(dataFile, "%u,", data[i].localInvocationID.x);
-        fprintf(dataFile, "%u,", data[i].workGroupSize.x);
+    for (int c = 0; c < CSV_INT_COLUMNS; ++c) {
+        uint32_t e;
+        if (affine[c])
+            columns[c].kind = COLUMN_AFFINE;
+        else if (dispatch[c])
+            columns[c].kind = COLUMN_DISPATCH;
+        else if (csv_expected(v0, c, &e))
+            columns[c].kind = COLUMN_DELTA;
+        else
+            columns[c].kind = COLUMN_ROW;
+    }
 
-        fprintf(dataFile, "%u,", data[i].localInvocationIndex.x);
+    for (int f = 0; f < 4; ++f) {
+        struct csv_column *col = &columns[CSV_INT_COLUMNS + 2 * f];
+        col->kind = constant[f] ? COLUMN_AFFINE : COLUMN_ROW;
+        col->c0 = rgba0[f];
+        col->dx = col->dy = col->dz = 0;
 
-        fprintf(dataFile, "%u,", data[i].subgroup.x); // SGID
-        fprintf(dataFile, "%u,", data[i].subgroup.w); // NumSG
+        col[1].kind = COLUMN_CHAR;
+    }
+}
 
-        fprintf(dataFile, "%u,", data[i].subgroup.y); // SGIID
-        fprintf(dataFile, "%u,", data[i].subgroup.z); // SGS
+static int
+save_csv_model(const struct csv_column columns[CSV_COLUMNS], int width, int height,
+        int depth, const char *name)
+{
+    /* in the order of csv_column_kind */
+    static const char *const kinds[] = { "affine", "dispatch", "delta", "row", "char" };
 
-        fprintf(dataFile, "%f,", data[i].r);
-        fprintf(dataFile, "%u,", (unsigned char)(255.0f * (data[i].r)));
-        fprintf(dataFile, "%f,", data[i].g);
-        fprintf(dataFile, "%u,", (unsigned char)(255.0f * (data[i].g)));
-        fprintf(dataFile, "%f,", data[i].b);
-        fprintf(dataFile, "%u,", (unsigned char)(255.0f * (data[i].b)));
-        fprintf(dataFile, "%f,", data[i].a);
-        fprintf(dataFile, "%u", (unsigned char)(255.0f * (data[i].a)));
+    FILE *f = fopen(name, "w");
+    if (!f) {
+        perror(name);
+        return 1;
+    }
 
-        fprintf(dataFile, "\n");
+    fprintf(f, "column:string,kind:string,value:string,dx:int,dy:int,dz:int\n");
+    fprintf(f, "width,size,%d,0,0,0\n", width);
+    fprintf(f, "height,size,%d,0,0,0\n", height);
+    fprintf(f, "depth,size,%d,0,0,0\n", depth);
 
-        image.push_back((unsigned char)(255.0f * (data[i].r)));
-        image.push_back((unsigned char)(255.0f * (data[i].g)));
-        image.push_back((unsigned char)(255.0f * (data[i].b)));
-        image.push_back((unsigned char)(255.0f * (data[i].a)));
+    for (int c = 0; c < CSV_COLUMNS; ++c) {
+        const struct csv_column *col = &columns[c];
+        if (c >= CSV_INT_COLUMNS && col->kind == COLUMN_AFFINE) {
+            float value;
+            memcpy(&value, &col->c0, sizeof(value));
+            fprintf(f, "%s,constant,%f,0,0,0\n", col->name.c_str(), value);
+        } else if (col->kind == COLUMN_AFFINE) {
+            bool constant = col->dx == 0 && col->dy == 0 && col->dz == 0;
+            fprintf(f, "%s,%s,%u,%d,%d,%d\n", col->name.c_str(),
+                    constant ? "constant" : "affine", col->c0,
+                    (int32_t)col->dx, (int32_t)col->dy, (int32_t)col->dz);
+        } else {
+            fprintf(f, "%s,%s,,,,\n", col->name.c_str(), kinds[col->kind]);
+        }
     }
 
-    fclose(dataFile);
+    if (fclose(f)) {
+        perror(name);
+        return 1;
+    }
 
-    unsigned error;
+    return 0;
+}
 
+template <typename Rows>
+static int
+write_csv(const Rows &rows, const char *name, const struct output_opts *opts)
+{
+    if (opts->compress) {
+        std::string gz = std::string(name) + ".gz";
+        return save_csv_gzip(rows, gz.c_str(), opts->threads, opts->level);
+    }
+
+    if (opts->mmap) {
+        int ret = save_csv_mmap(rows, name, opts->threads);
+        if (ret >= 0)
+            return ret;
+        /* e.g. a file system without mmap support, try again with stdio */
+    }
+
+    return save_csv_stdio(rows, name);
+}
+
+static int
+save_csv(const struct Pixel *data, int width, int height, int depth,
+        const struct output_opts *opts, const char *suffix)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "data%s.csv", suffix);
+
+    size_t count = (size_t)width * height * depth;
+
+    if (!opts->delta) {
+        struct csv_full_rows rows = { data, count, width, height };
+        return write_csv(rows, name, opts);
+    }
+
+    struct csv_column columns[CSV_COLUMNS];
+    csv_fit_columns(data, width, height, depth, columns);
+
+    char model_name[256];
+    snprintf(model_name, sizeof(model_name), "data%s_model.csv", suffix);
+    if (save_csv_model(columns, width, height, depth, model_name))
+        return 1;
+
+    struct csv_residual_rows rows;
+    rows.data = data;
+    rows.count = count;
+    rows.width = width;
+    rows.height = height;
+    for (int c = 0; c < CSV_COLUMNS; ++c) {
+        const struct csv_column *col = &columns[c];
+        if (col->kind != COLUMN_ROW && col->kind != COLUMN_DELTA)
+            continue;
+
+        if (c < CSV_INT_COLUMNS) {
+            rows.ints.push_back(c);
+            rows.delta.push_back(col->kind == COLUMN_DELTA);
+        } else {
+            rows.floats.push_back((c - CSV_INT_COLUMNS) / 2);
+        }
+        rows.head += col->name + ",";
+    }
+    if (!rows.head.empty())
+        rows.head.back() = '\n';
+    else
+        rows.head = "\n";
+
+    return write_csv(rows, name, opts);
+}
+
+struct png_encoder_context {
+    LodePNGEncoderContext *context = lodepng_encoder_context_new();
+    /* everything else one encode allocates, released at once after it */
+    LodePNGArena *arena = lodepng_arena_new(0);
+    ~png_encoder_context()
+    {
+        lodepng_encoder_context_delete(context);
+        lodepng_arena_delete(arena);
+    }
+};
+
+static int
+save_png(const struct Pixel *data, int width, int height, int depth,
+        const struct output_opts *opts, const char *suffix)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "result%s.png", suffix);
+
+    /* depth slices are laid out in a grid of columns x (depth / columns)
+     * this could be done on the GPU if the purpose of this test
+     * would be to this as quickly as possible */
     const bool grid = true;
+    int columns = 1;
     if (grid) {
-        /* this could be done on the GPU if the purpose of this test
-         * would be to this as quickly as possible */
-        std::vector<unsigned char> image2;
-        image2.reserve(width * height * depth * 4);
-        int columns = (int)ceil(sqrt(depth));
+        columns = (int)ceil(sqrt(depth));
         while (depth % columns != 0)
             columns++;
+    }
+
+    std::vector<unsigned char> image((size_t)width * height * depth * 4);
+    unsigned char *p = image.data();
 
-        for (int r = 0; r < depth / columns; ++r) {
-            for (int h = 0; h < height; ++h) {
-                for (int c = 0; c < columns; ++c) {
-                    std::vector<unsigned char>::iterator it =
-                            image.begin() + 4 * ((r * columns + c) * width * height + h * width);
-                    image2.insert(image2.end(), it, it + width * 4);
+    for (int r = 0; r < depth / columns; ++r) {
+        for (int h = 0; h < height; ++h) {
+            for (int c = 0; c < columns; ++c) {
+                const struct Pixel *row =
+                        data + (size_t)(r * columns + c) * width * height + (size_t)h * width;
+                for (int w = 0; w < width; ++w) {
+                    *p++ = to_char(row[w].r);
+                    *p++ = to_char(row[w].g);
+                    *p++ = to_char(row[w].b);
+                    *p++ = to_char(row[w].a);
                 }
             }
         }
-        error = lodepng::encode("result.png", image2, width * columns, height * depth / columns);
-    } else {
-        error = lodepng::encode("result.png", image, width, height * depth);
     }
 
-    if (error)
+    /* encoder buffers kept for all images written by this thread */
+    static thread_local png_encoder_context encoder;
+
+    lodepng::State state;
+    if (opts->level >= 0)
+        lodepng_encoder_settings_level(&state.encoder, opts->level);
+    state.encoder.zlibsettings.numthreads = opts->threads;
+    state.encoder.zlibsettings.context = encoder.context;
+    state.encoder.zlibsettings.allocator = lodepng_arena_allocator(encoder.arena);
+
+    std::vector<unsigned char> png;
+    unsigned error = lodepng::encode(png, image, width * columns, height * depth / columns, state);
+    lodepng_arena_reset(encoder.arena);
+    if (error) {
         printf("encoder error %d: %s", error, lodepng_error_text(error));
+        return 1;
+    }
+
+    /* lodepng owns the buffer it encodes into, so the file is written from
+     * it directly, a mapping would only add a copy */
+    if (lodepng::save_file(png, name)) {
+        fprintf(stderr, "failed to write %s\n", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+int
+save_data(const struct Pixel *data, int width, int height, int depth,
+        const struct output_opts *opts, const char *suffix)
+{
+    if (!suffix)
+        suffix = "";
+
+    switch (opts->mode) {
+    case OUTPUT_FULL:
+        if (save_csv(data, width, height, depth, opts, suffix))
+            return 1;
+        return save_png(data, width, height, depth, opts, suffix);
+    case OUTPUT_IMAGE:
+        return save_png(data, width, height, depth, opts, suffix);
+    case OUTPUT_STATS:
+        return 0;
+    case OUTPUT_CHECKSUM:
+        return save_checksum(data, width, height, depth, opts, suffix);
+    }
+
+    return 1;
+}
+
+int
+get_subgroup_stats(const struct Pixel *data, int width, int height, int depth,
+        struct subgroup_stats *stats)
+{
+    size_t count = (size_t)width * height * depth;
+
+    *stats = {};
+    for (size_t i = 0; i < count; ++i) {
+        const struct uvec4 *sg = &data[i].localInvocationIndex;
+        if (sg->w == 0)
+            continue;
+        stats->subgroups++;
+        stats->lane_iterations += sg->y;
+        stats->lane_slots += (uint64_t)sg->z * sg->w;
+    }
+
+    return stats->subgroups > 0;
+}
+
+static uint64_t
+sample_clock(const uint32_t c[2])
+{
+    return (uint64_t)c[1] << 32 | c[0];
+}
+
+static bool
+sample_recorded(const struct instrument_sample *s)
+{
+    return sample_clock(s->start) != 0 || sample_clock(s->end) != 0;
+}
+
+int
+save_instrumentation(const struct instrument_sample *samples, size_t count,
+        const char *suffix)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "instrument%s.csv", suffix ? suffix : "");
+
+    uint64_t first = UINT64_MAX;
+    for (size_t i = 0; i < count; ++i) {
+        if (sample_recorded(&samples[i]))
+            first = std::min(first, sample_clock(samples[i].start));
+    }
+
+    FILE *f = fopen(name, "w");
+    if (!f) {
+        perror(name);
+        return 1;
+    }
+
+    fprintf(f, "workgroup:int,subgroup:int,start_clock:int,end_clock:int,cycles:int,iterations:int,active_lanes:int,lane_mask:string\n");
+    for (size_t i = 0; i < count; ++i) {
+        const struct instrument_sample *s = &samples[i];
+        if (!sample_recorded(s))
+            continue;
+        uint64_t start = sample_clock(s->start), end = sample_clock(s->end);
+        /* the mask in hex, lane 0 in the last digit */
+        fprintf(f, "%u,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%u,%u,%08x%08x%08x%08x\n",
+                s->workgroup, s->subgroup, start - first, end - first, end - start,
+                s->iterations, s->active_lanes, s->lane_mask[3], s->lane_mask[2],
+                s->lane_mask[1], s->lane_mask[0]);
+    }
+
+    if (fclose(f)) {
+        perror(name);
+        return 1;
+    }
+    return 0;
+}
+
+/* empty fields are only kept for CSV columns, not in lists of words */
+static std::vector<std::string>
+split(const std::string &str, const char *separators, bool keep_empty)
+{
+    std::vector<std::string> fields;
+    size_t pos = 0;
+
+    for (;;) {
+        size_t end = str.find_first_of(separators, pos);
+        std::string field = str.substr(pos, end == std::string::npos ? end : end - pos);
+        if (!field.empty() || keep_empty)
+            fields.push_back(field);
+        if (end == std::string::npos)
+            return fields;
+        pos = end + 1;
+    }
+}
+
+static void
+add_define(struct kernel_variant *v, const std::string &name, int value, const char *file)
+{
+    for (unsigned i = 0; i < v->num_defines; ++i) {
+        if (name == v->defines[i].name) {
+            v->defines[i].value = value;
+            return;
+        }
+    }
+
+    if (v->num_defines == VARIANT_MAX_DEFINES || name.size() >= sizeof(v->defines[0].name)) {
+        fprintf(stderr, "%s: too many or too long defines\n", file);
+        exit(2);
+    }
+    snprintf(v->defines[v->num_defines].name, sizeof(v->defines[0].name), "%s", name.c_str());
+    v->defines[v->num_defines].value = value;
+    v->num_defines++;
+}
+
+unsigned
+get_kernel_variants(const char *backend, struct kernel_variant **variants)
+{
+    const char *file = getenv("VARIANTS_FILE");
+    if (!file)
+        file = "shaders/variants.csv";
+
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        perror(file);
+        exit(2);
+    }
+
+    /* name, defines, backends, pixel of every row */
+    std::vector<std::vector<std::string>> rows;
+    std::vector<std::string> all_defines;
+    char line[1024];
+    bool header = true;
+    while (fgets(line, sizeof(line), f)) {
+        std::string str(line, strcspn(line, "\r\n"));
+        if (header || str.empty()) {
+            header = false;
+            continue;
+        }
+
+        std::vector<std::string> row = split(str, ",", true);
+        if (row.size() < 4) {
+            fprintf(stderr, "%s: malformed row '%s'\n", file, str.c_str());
+            exit(2);
+        }
+        for (const std::string &def : split(row[1], " ", false)) {
+            std::string name = def.substr(0, def.find('='));
+            if (std::find(all_defines.begin(), all_defines.end(), name) == all_defines.end())
+                all_defines.push_back(name);
+        }
+        rows.push_back(row);
+    }
+    fclose(f);
+
+    const char *tmp = getenv("VARIANTS");
+    std::vector<std::string> names = split(tmp ? tmp : "bruteforce", " ,", false);
+    if (names.empty()) {
+        fprintf(stderr, "VARIANTS is empty\n");
+        exit(2);
+    }
+
+    *variants = (struct kernel_variant *)calloc(names.size(), sizeof(**variants));
+    if (!*variants) {
+        perror("calloc");
+        exit(2);
+    }
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        struct kernel_variant *v = &(*variants)[i];
+        const std::vector<std::string> *row = NULL;
+        for (const std::vector<std::string> &r : rows) {
+            if (r[0] == names[i])
+                row = &r;
+        }
+        if (!row) {
+            fprintf(stderr, "unknown variant %s, registered in %s are:", names[i].c_str(), file);
+            for (const std::vector<std::string> &r : rows)
+                fprintf(stderr, " %s", r[0].c_str());
+            fprintf(stderr, "\n");
+            exit(2);
+        }
+
+        std::vector<std::string> backends = split((*row)[2], " ", false);
+        if (std::find(backends.begin(), backends.end(), backend) == backends.end()) {
+            fprintf(stderr, "variant %s doesn't run on %s, only on %s\n",
+                    names[i].c_str(), backend, (*row)[2].c_str());
+            exit(2);
+        }
+
+        if (names[i].size() >= sizeof(v->name)) {
+            fprintf(stderr, "%s: variant name %s is too long\n", file, names[i].c_str());
+            exit(2);
+        }
+        snprintf(v->name, sizeof(v->name), "%s", names[i].c_str());
+
+        for (const std::string &name : all_defines)
+            add_define(v, name, 0, file);
+        for (const std::string &def : split((*row)[1], " ", false)) {
+            size_t eq = def.find('=');
+            add_define(v, def.substr(0, eq),
+                    eq == std::string::npos ? 1 : atoi(def.c_str() + eq + 1), file);
+        }
+
+        if ((*row)[3] == "ids") {
+            v->pixel = PIXEL_IDS;
+        } else if ((*row)[3] == "subgroup_stats") {
+            v->pixel = PIXEL_SUBGROUP_STATS;
+        } else {
+            fprintf(stderr, "%s: unknown pixel semantics %s\n", file, (*row)[3].c_str());
+            exit(2);
+        }
+    }
+
+    return names.size();
+}
+
+int
+kernel_variant_define(const struct kernel_variant *v, const char *name)
+{
+    for (unsigned i = 0; i < v->num_defines; ++i) {
+        if (strcmp(v->defines[i].name, name) == 0)
+            return v->defines[i].value;
+    }
+    return 0;
+}
+
+unsigned
+kernel_variant_points(const struct kernel_variant *v)
+{
+    return kernel_variant_define(v, "PACKED") ? 2 : 1;
+}
+
+/* DRM_IOCTL_I915_GETPARAM and I915_PARAM_EU_TOTAL of i915_drm.h, which isn't
+ * necessarily installed */
+struct i915_getparam {
+    int param;
+    int *value;
+};
+#define I915_GETPARAM _IOWR('d', 0x40 + 0x06, struct i915_getparam)
+#define I915_PARAM_EU_TOTAL 34
+
+static unsigned
+get_eu_count(const char *device)
+{
+    const char *tmp = getenv("EU_COUNT");
+    if (tmp && atoi(tmp) > 0)
+        return atoi(tmp);
+
+    if (!device)
+        device = getenv("DRI_DEVICE");
+    if (!device)
+        device = "/dev/dri/renderD128";
+
+    /* the EUs left enabled by fusing, not the ones of the full die */
+    int eus = 0;
+    struct i915_getparam gp = { I915_PARAM_EU_TOTAL, &eus };
+    int fd = open(device, O_RDWR);
+    if (fd >= 0) {
+        if (ioctl(fd, I915_GETPARAM, &gp) != 0)
+            eus = 0;
+        close(fd);
+    }
+    if (eus <= 0) {
+        fprintf(stderr, "can't get the EU count of %s, set EU_COUNT=\n", device);
+        exit(2);
+    }
+    return eus;
+}
+
+unsigned
+get_persistent_groups(const char *device, unsigned invocations,
+        unsigned tiles, unsigned max_groups)
+{
+    static unsigned eus;
+    if (!eus)
+        eus = get_eu_count(device);
+
+    const char *tmp = getenv("EU_THREADS");
+    unsigned threads = tmp && atoi(tmp) > 0 ? atoi(tmp) : 7;
+    tmp = getenv("EU_SIMD");
+    unsigned simd = tmp && atoi(tmp) > 0 ? atoi(tmp) : 16;
+
+    uint64_t groups = (uint64_t)eus * threads / ((invocations + simd - 1) / simd);
+    groups = std::min<uint64_t>(groups, std::min(tiles, max_groups));
+    return std::max<uint64_t>(groups, 1);
+}
+
+unsigned
+get_coarsen_factors(unsigned factors[MAX_COARSEN_FACTORS])
+{
+    const char *tmp = getenv("COARSEN");
+    std::vector<std::string> words = split(tmp ? tmp : "1", " ,", false);
+    if (words.empty() || words.size() > MAX_COARSEN_FACTORS) {
+        fprintf(stderr, "COARSEN needs 1 to %d factors\n", MAX_COARSEN_FACTORS);
+        exit(2);
+    }
+
+    for (size_t i = 0; i < words.size(); ++i) {
+        int c = atoi(words[i].c_str());
+        if (c < 1 || c > 64) {
+            fprintf(stderr, "COARSEN factor %s isn't in 1..64\n", words[i].c_str());
+            exit(2);
+        }
+        factors[i] = c;
+    }
+
+    return words.size();
+}
+
+struct color_reference {
+    std::vector<float> colors;
+};
+
+struct color_reference *
+color_reference_create(void)
+{
+    return new color_reference;
+}
+
+int
+color_reference_check(struct color_reference *ref, const struct kernel_variant *v,
+        const struct Pixel *data, int width, int height, int depth,
+        struct color_error *err)
+{
+    size_t count = (size_t)width * height * depth;
+
+    if (ref->colors.empty()) {
+        if (strcmp(v->name, "bruteforce") != 0)
+            return 0;
+        ref->colors.resize(count * 4);
+        for (size_t i = 0; i < count; ++i)
+            memcpy(&ref->colors[i * 4], &data[i].r, 4 * sizeof(float));
+        return 0;
+    }
+
+    double sum = 0;
+    *err = {};
+    for (size_t i = 0; i < count; ++i) {
+        const float *c = &data[i].r;
+        const float *expected = &ref->colors[i * 4];
+        bool differs = false;
+        for (int k = 0; k < 4; ++k) {
+            float diff = fabsf(c[k] - expected[k]);
+            err->max = std::max(err->max, diff);
+            sum += diff;
+            differs |= diff != 0;
+        }
+        err->pixels += differs;
+    }
+    err->mean = sum / (count * 4);
+
+    return 1;
+}
+
+void
+color_reference_destroy(struct color_reference *ref)
+{
+    delete ref;
 }
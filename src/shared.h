@@ -1,6 +1,7 @@
 #ifndef COMPUTE_SHARED
 #define COMPUTE_SHARED
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -21,7 +22,173 @@ struct Pixel {
     struct uvec4 subgroup;
 };
 
-void save_data(struct Pixel *data, int width, int height, int depth);
+enum output_mode {
+    OUTPUT_FULL,     /* data.csv and result.png */
+    OUTPUT_IMAGE,    /* result.png only */
+    OUTPUT_STATS,    /* nothing, only stats.csv written by the harness */
+    OUTPUT_CHECKSUM, /* checksum.txt with the CRC32 of the whole buffer */
+};
+
+struct output_opts {
+    enum output_mode mode;
+
+    /* expected checksum, only checked if has_expected_checksum is set */
+    uint32_t expected_checksum;
+    int has_expected_checksum;
+
+    /* write on a background thread; -1 means only when running more than
+     * one configuration */
+    int async;
+
+    /* format data.csv straight into a mapping of the file */
+    int mmap;
+    /* write data.csv.gz instead of data.csv */
+    int compress;
+    /* describe constant and predictable columns once in data_model.csv
+     * and write only the remaining ones to data.csv */
+    int delta;
+    /* zlib-like compression level 0-9 for result.png and data.csv.gz,
+     * -1 keeps the lodepng defaults (6 but with the slower, older match
+     * finder) */
+    int level;
+    /* number of threads formatting data.csv when mmap is used, or
+     * compressing it when compress is set, and encoding result.png */
+    unsigned threads;
+};
+
+/* fills opts from OUTPUT=, OUTPUT_ASYNC=, OUTPUT_MMAP=, OUTPUT_COMPRESS=,
+ * OUTPUT_DELTA=, OUTPUT_LEVEL=, OUTPUT_THREADS= and CHECKSUM= environment
+ * variables */
+void get_output_opts(struct output_opts *opts);
+
+/* suffix (may be NULL) is appended to the base name of every file written,
+ * returns 0 on success, non-zero if writing failed or checksum didn't match */
+int save_data(const struct Pixel *data, int width, int height, int depth,
+        const struct output_opts *opts, const char *suffix);
+
+/*
+ * Kernel variants of shaders/shader.comp, registered in shaders/variants.csv
+ * (VARIANTS_FILE=) with the defines selecting them, the backends they run on
+ * and what the Pixel fields hold. Every variant writes the same std140 Pixel
+ * array, which is read back the same way. run_vulkan.sh builds one SPIR-V per
+ * variant from the same file.
+ */
+enum variant_pixel {
+    PIXEL_IDS,            /* the built-in IDs of the invocation */
+    PIXEL_SUBGROUP_STATS, /* and struct subgroup_stats of its subgroup */
+};
+
+#define VARIANT_MAX_DEFINES 16
+
+struct kernel_define {
+    char name[32];
+    int value;
+};
+
+struct kernel_variant {
+    char name[32];
+    /* every define set by any registered variant, 0 where this one doesn't
+     * set it, so that patching all of them leaves none undefined */
+    struct kernel_define defines[VARIANT_MAX_DEFINES];
+    unsigned num_defines;
+    enum variant_pixel pixel;
+};
+
+/* the variants named by VARIANTS= (separated by spaces or commas, default
+ * bruteforce), in that order; exits if one isn't registered or doesn't run
+ * on backend ("gl", "vulkan" or "cpu"). *variants is freed with free() */
+unsigned get_kernel_variants(const char *backend, struct kernel_variant **variants);
+
+/* value the variant gives the define, 0 if it doesn't set it */
+int kernel_variant_define(const struct kernel_variant *v, const char *name);
+
+/* pixels along x one invocation computes (2 with PACKED), the harnesses
+ * divide the number of workgroups along x by it and the coarsening factor */
+unsigned kernel_variant_points(const struct kernel_variant *v);
+
+/* workgroups a PERSISTENT kernel is dispatched with: as many as the device
+ * keeps resident, EU_COUNT= EUs (asked from the i915 driver of the DRM device,
+ * DRI_DEVICE= or /dev/dri/renderD128 if NULL, when unset) times EU_THREADS=
+ * hardware threads (default 7) of EU_SIMD= invocations (default 16), divided
+ * by the threads a workgroup of invocations takes; at least 1 and at most
+ * tiles (the workgroups of the grid) and max_groups
+ * (maxComputeWorkGroupCount[0]). Exits if the EU count can't be found */
+unsigned get_persistent_groups(const char *device, unsigned invocations,
+        unsigned tiles, unsigned max_groups);
+
+#define MAX_COARSEN_FACTORS 16
+
+/* thread coarsening factors of COARSEN= (separated by spaces or commas,
+ * default 1), with C every invocation computes C times the pixels of its
+ * variant along x; exits if one isn't in 1..64 */
+unsigned get_coarsen_factors(unsigned factors[MAX_COARSEN_FACTORS]);
+
+/* colour difference of a variant's image to the one of bruteforce, the
+ * reference fp32 kernel */
+struct color_error {
+    float max;       /* largest difference of a channel */
+    double mean;     /* mean difference of all channels */
+    uint64_t pixels; /* pixels differing at all */
+};
+
+/* the colours of the first bruteforce image, the colours don't depend on
+ * the workgroup size */
+struct color_reference;
+
+struct color_reference *color_reference_create(void);
+/* keeps the colours of data if there are none yet and v is bruteforce,
+ * otherwise compares them with the kept ones; returns 1 if err was filled
+ * in, 0 if there was nothing to compare with */
+int color_reference_check(struct color_reference *ref, const struct kernel_variant *v,
+        const struct Pixel *data, int width, int height, int depth,
+        struct color_error *err);
+void color_reference_destroy(struct color_reference *ref);
+
+/* SUBGROUP_OPS kernel: one invocation per subgroup stores, in
+ * localInvocationIndex.yzw, the loop iterations run by its lanes, the ones
+ * the subgroup ran and its lanes with a pixel */
+struct subgroup_stats {
+    uint64_t subgroups;
+    uint64_t lane_iterations;
+    /* iterations the subgroup ran, times its lanes with a pixel */
+    uint64_t lane_slots;
+};
+
+/* sums the per-subgroup stats of data, returns 0 if there are none */
+int get_subgroup_stats(const struct Pixel *data, int width, int height, int depth,
+        struct subgroup_stats *stats);
+
+/* INSTRUMENT=1: what shader.comp records, in a third buffer, for every
+ * invocation with a pixel, at its index in the rows of ceil(width / points)
+ * invocations; the ones without a pixel leave their sample zeroed */
+struct instrument_sample {
+    uint32_t start[2], end[2]; /* clock2x32ARB(), low word first */
+    uint32_t iterations;       /* of the Mandelbrot loop, all runs and repeats */
+    uint32_t workgroup;        /* index of the workgroup in the grid */
+    uint32_t subgroup;         /* gl_SubgroupID, 0 without subgroups (GL) */
+    uint32_t active_lanes;     /* the subgroup's lanes with a pixel */
+    uint32_t lane_mask[4];     /* their ballot, lane i in bit i % 32 of word i / 32 */
+};
+
+/* writes the recorded samples of count to instrument<suffix>.csv, with the
+ * clocks relative to the first start; scripts/latency.sh makes histograms of
+ * it. Returns 0 on success */
+int save_instrumentation(const struct instrument_sample *samples, size_t count,
+        const char *suffix);
+
+/*
+ * Output pipeline: submit() copies the buffer and hands it to a writer
+ * thread, so that the caller can reuse (and redispatch into) the GPU buffer
+ * while the previous result is still being encoded. Without async the data
+ * is written synchronously from the caller's buffer.
+ */
+struct output_writer;
+
+struct output_writer *output_writer_create(const struct output_opts *opts, int async);
+void output_writer_submit(struct output_writer *writer, const struct Pixel *data,
+        int width, int height, int depth, const char *suffix);
+/* waits for all pending writes and frees writer, returns non-zero if any failed */
+int output_writer_finish(struct output_writer *writer);
 
 #ifdef __cplusplus
 }
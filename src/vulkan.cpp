@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <stdexcept>
 #include <cmath>
+#include <cinttypes>
 
 #include "renderdoc.h"
 #include "shared.h"
@@ -18,6 +19,15 @@ static int DEPTH;
 static int WORKGROUP_SIZE_X;
 static int WORKGROUP_SIZE_Y;
 static int WORKGROUP_SIZE_Z;
+// thread coarsening factor, pixels along x per invocation of the variant
+static unsigned COARSEN;
+
+struct WorkgroupSize {
+    int x, y, z;
+};
+
+// All configurations to run, WORKGROUP_SIZE_* hold the current one.
+static std::vector<WorkgroupSize> configs;
 
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
@@ -102,6 +112,16 @@ private:
         
     uint32_t bufferSize; // size of `buffer` in bytes.
 
+    // the tile counter PERSISTENT variants take their tiles from, zeroed
+    // before every dispatch
+    VkBuffer queueBuffer;
+    VkDeviceMemory queueBufferMemory;
+
+    // the samples of INSTRUMENT, one per pixel at most
+    VkBuffer samplesBuffer;
+    VkDeviceMemory samplesBufferMemory;
+    uint32_t samplesSize;
+
     std::vector<const char *> enabledLayers;
 
     /*
@@ -139,8 +159,26 @@ private:
         bool show_csv;
     } perf;
 
+    struct output_opts output;
+
+    // VARIANTS= of shaders/variants.csv, run_vulkan.sh built comp_<name>.spv for each
+    struct kernel_variant *variants;
+    unsigned numVariants;
+    const struct kernel_variant *variant; // the current one
+
+    // COARSEN= factors, the specialization constant COARSEN holds the current one
+    unsigned coarsenFactors[MAX_COARSEN_FACTORS];
+    unsigned numCoarsen;
+
+    // workgroups the current PERSISTENT variant is dispatched with
+    unsigned persistentGroups;
+
+    // INSTRUMENT=, the shaders were built with it and write instrument_samples
+    // with VK_KHR_shader_clock to binding 2
+    bool instrument;
+
 public:
-    void run() {
+    int run() {
         const char *tmp;
 
         tmp = getenv("PERF_ENABLED");
@@ -149,6 +187,14 @@ public:
         tmp = getenv("CSV");
         perf.show_csv = tmp != NULL && atoi(tmp) > 0;
 
+        get_output_opts(&output);
+
+        numVariants = get_kernel_variants("vulkan", &variants);
+        numCoarsen = get_coarsen_factors(coarsenFactors);
+
+        tmp = getenv("INSTRUMENT");
+        instrument = tmp != NULL && atoi(tmp) > 0;
+
         FILE *statsFile = NULL;
 
         if (perf.enabled && perf.show_csv) {
@@ -157,7 +203,7 @@ public:
                 perror("fopen stats.csv");
                 exit(2);
             }
-            fprintf(statsFile, "x:int,y:int,z:int,time_ns:int,threads:int,invocations:int,simd:int,thread_occupancy_pct:int,cpu_time_ns:int\n");
+            fprintf(statsFile, "x:int,y:int,z:int,time_ns:int,threads:int,invocations:int,simd:int,thread_occupancy_pct:int,cpu_time_ns:int,variant:string,coarsen:int\n");
         }
 
         RENDERDOC_API_1_4_1 *rdoc_api = NULL;
@@ -171,6 +217,7 @@ public:
 
         // Buffer size of the storage buffer that will contain the rendered mandelbrot set.
         bufferSize = sizeof(Pixel) * WIDTH * HEIGHT * DEPTH;
+        samplesSize = sizeof(instrument_sample) * (instrument ? WIDTH * HEIGHT * DEPTH : 1);
 
         // Initialize vulkan:
         createInstance();
@@ -185,7 +232,6 @@ public:
         createBuffer();
         createDescriptorSetLayout();
         createDescriptorSet();
-        createComputePipeline();
 
         if (perf.enabled) {
             VkAcquireProfilingLockInfoKHR lockInfo;
@@ -206,7 +252,6 @@ public:
         allocateCommandBuffers();
         if (perf.enabled)
             createResetCommandBuffer();
-        createCommandBuffer();
 
         unsigned warmup, average;
         if (perf.enabled) {
@@ -225,97 +270,152 @@ public:
             warmup = 0;
             average = 1;
         }
-        uint64_t overall_cpu_time = 0, overall_gpu_time = 0;
-
-        for (unsigned i = 0; i < warmup + average; ++i) {
-            if (perf.enabled) {
-                struct timespec start, end;
-                if (clock_gettime(CLOCK_MONOTONIC, &start))
-                    abort();
-
-                // Finally, run the recorded command buffer.
-                for (uint32_t counterPass = 0; counterPass < perf.numPasses; counterPass++) {
-                  VkPerformanceQuerySubmitInfoKHR performanceQuerySubmitInfo;
-                  performanceQuerySubmitInfo.sType = VK_STRUCTURE_TYPE_PERFORMANCE_QUERY_SUBMIT_INFO_KHR;
-                  performanceQuerySubmitInfo.pNext = NULL;
-                  performanceQuerySubmitInfo.counterPassIndex = counterPass;
-
-                  runCommandBuffer(&commandBuffers[0], NULL);
-                  runCommandBuffer(&commandBuffers[1], &performanceQuerySubmitInfo);
-                }
 
-                if (clock_gettime(CLOCK_MONOTONIC, &end))
-                    abort();
-
-                size_t cntrs = perf.selectedCounters.size();
-                std::vector<VkPerformanceCounterResultKHR> recordedCounters(cntrs);
-
-                VK_CHECK_RESULT(vkGetQueryPoolResults(device, perf.queryPoolKHR, 0, 1,
-                        sizeof(VkPerformanceCounterResultKHR) * cntrs,
-                        recordedCounters.data(),
-                        sizeof(VkPerformanceCounterResultKHR),
-                        0));
-                if (0) {
-                    int i = 0;
-                    for (auto c : recordedCounters) {
-                        printf("counter: %d, value: ", i);
-                        switch(perf.storages[i]) {
-                        case VK_PERFORMANCE_COUNTER_STORAGE_INT32_KHR:
-                            printf("%d\n", c.int32);
-                            break;
-                        case VK_PERFORMANCE_COUNTER_STORAGE_UINT32_KHR:
-                            printf("%u\n", c.uint32);
-                            break;
-                        case VK_PERFORMANCE_COUNTER_STORAGE_INT64_KHR:
-                            printf("%ld\n", c.int64);
-                            break;
-                        case VK_PERFORMANCE_COUNTER_STORAGE_UINT64_KHR:
-                            printf("%lu\n", c.uint64);
-                            break;
-                        case VK_PERFORMANCE_COUNTER_STORAGE_FLOAT32_KHR:
-                            printf("%f\n", c.float32);
-                            break;
-                        case VK_PERFORMANCE_COUNTER_STORAGE_FLOAT64_KHR:
-                            printf("%g\n", c.float64);
-                            break;
-                        case VK_PERFORMANCE_COUNTER_STORAGE_MAX_ENUM_KHR:
-                            assert(0);
-                            break;
+        unsigned numRuns = numVariants * numCoarsen * configs.size();
+        struct output_writer *writer = output_writer_create(&output, numRuns > 1);
+        struct color_reference *reference = color_reference_create();
+
+        // all configurations of the first coarsening factor of the first
+        // variant, then of the next factor, then of the next variant
+        for (unsigned r = 0; r < numRuns; ++r) {
+            const WorkgroupSize &cfg = configs[r % configs.size()];
+            variant = &variants[r / (numCoarsen * configs.size())];
+            COARSEN = coarsenFactors[r / configs.size() % numCoarsen];
+            WORKGROUP_SIZE_X = cfg.x;
+            WORKGROUP_SIZE_Y = cfg.y;
+            WORKGROUP_SIZE_Z = cfg.z;
+
+            createComputePipeline();
+            createCommandBuffer();
+            if (instrument)
+                clearInstrumentation();
+
+            uint64_t overall_cpu_time = 0, overall_gpu_time = 0;
+
+            for (unsigned i = 0; i < warmup + average; ++i) {
+                if (perf.enabled) {
+                    struct timespec start, end;
+                    if (clock_gettime(CLOCK_MONOTONIC, &start))
+                        abort();
+
+                    // Finally, run the recorded command buffer.
+                    for (uint32_t counterPass = 0; counterPass < perf.numPasses; counterPass++) {
+                      VkPerformanceQuerySubmitInfoKHR performanceQuerySubmitInfo;
+                      performanceQuerySubmitInfo.sType = VK_STRUCTURE_TYPE_PERFORMANCE_QUERY_SUBMIT_INFO_KHR;
+                      performanceQuerySubmitInfo.pNext = NULL;
+                      performanceQuerySubmitInfo.counterPassIndex = counterPass;
+
+                      runCommandBuffer(&commandBuffers[0], NULL);
+                      runCommandBuffer(&commandBuffers[1], &performanceQuerySubmitInfo);
+                    }
+
+                    if (clock_gettime(CLOCK_MONOTONIC, &end))
+                        abort();
+
+                    size_t cntrs = perf.selectedCounters.size();
+                    std::vector<VkPerformanceCounterResultKHR> recordedCounters(cntrs);
+
+                    VK_CHECK_RESULT(vkGetQueryPoolResults(device, perf.queryPoolKHR, 0, 1,
+                            sizeof(VkPerformanceCounterResultKHR) * cntrs,
+                            recordedCounters.data(),
+                            sizeof(VkPerformanceCounterResultKHR),
+                            0));
+                    if (0) {
+                        int i = 0;
+                        for (auto c : recordedCounters) {
+                            printf("counter: %d, value: ", i);
+                            switch(perf.storages[i]) {
+                            case VK_PERFORMANCE_COUNTER_STORAGE_INT32_KHR:
+                                printf("%d\n", c.int32);
+                                break;
+                            case VK_PERFORMANCE_COUNTER_STORAGE_UINT32_KHR:
+                                printf("%u\n", c.uint32);
+                                break;
+                            case VK_PERFORMANCE_COUNTER_STORAGE_INT64_KHR:
+                                printf("%" PRId64 "\n", c.int64);
+                                break;
+                            case VK_PERFORMANCE_COUNTER_STORAGE_UINT64_KHR:
+                                printf("%" PRIu64 "\n", c.uint64);
+                                break;
+                            case VK_PERFORMANCE_COUNTER_STORAGE_FLOAT32_KHR:
+                                printf("%f\n", c.float32);
+                                break;
+                            case VK_PERFORMANCE_COUNTER_STORAGE_FLOAT64_KHR:
+                                printf("%g\n", c.float64);
+                                break;
+                            case VK_PERFORMANCE_COUNTER_STORAGE_MAX_ENUM_KHR:
+                                assert(0);
+                                break;
+                            }
+                            i++;
                         }
-                        i++;
                     }
-                }
 
-                std::vector<uint64_t> recordedCountersPipeline(1);
-                VK_CHECK_RESULT(vkGetQueryPoolResults(device, perf.queryPoolPipeline, 0, 1,
-                        sizeof(uint64_t) * 1,
-                        recordedCountersPipeline.data(),
-                        sizeof(uint64_t),
-                        0));
-
-                uint64_t cpu_time_ns = 1000ULL * 1000 * 1000 * (end.tv_sec - start.tv_sec) +
-                        end.tv_nsec - start.tv_nsec;
-
-                if (i >= warmup) {
-                    if (perf.show_csv) {
-                        fprintf(statsFile, "%d,%d,%d,", WORKGROUP_SIZE_X, WORKGROUP_SIZE_Y, WORKGROUP_SIZE_Z);
-                        fprintf(statsFile, "%lu,", recordedCounters[perf.GPUTimeElapsedIdx].uint64);
-                        fprintf(statsFile, "%lu,", recordedCounters[perf.CSThreadsDispatchedIdx].uint64);
-                        fprintf(statsFile, "%lu,", recordedCountersPipeline[0]);
-                        fprintf(statsFile, "%lu,", recordedCountersPipeline[0] / recordedCounters[perf.CSThreadsDispatchedIdx].uint64);
-                        fprintf(statsFile, "%d,", (int)(recordedCounters[perf.EUThreadOccupaccyIdx].float32));
-                        fprintf(statsFile, "%lu\n", cpu_time_ns);
-                    } else {
-                        printf("EU Thread Occupancy:   %f %%\n", recordedCounters[perf.EUThreadOccupaccyIdx].float32);
-                        printf("CS Threads Dispatched: %lu\n", recordedCounters[perf.CSThreadsDispatchedIdx].uint64);
-                        printf("GPU Time Elapsed:      %lu ns\n", recordedCounters[perf.GPUTimeElapsedIdx].uint64);
-                        printf("CS Invocations:        %lu\n", recordedCountersPipeline[0]);
-                        printf("CPU Time Elapsed:      %lu ns\n", cpu_time_ns);
+                    std::vector<uint64_t> recordedCountersPipeline(1);
+                    VK_CHECK_RESULT(vkGetQueryPoolResults(device, perf.queryPoolPipeline, 0, 1,
+                            sizeof(uint64_t) * 1,
+                            recordedCountersPipeline.data(),
+                            sizeof(uint64_t),
+                            0));
+
+                    uint64_t cpu_time_ns = 1000ULL * 1000 * 1000 * (end.tv_sec - start.tv_sec) +
+                            end.tv_nsec - start.tv_nsec;
+
+                    if (i >= warmup) {
+                        if (perf.show_csv) {
+                            fprintf(statsFile, "%d,%d,%d,", WORKGROUP_SIZE_X, WORKGROUP_SIZE_Y, WORKGROUP_SIZE_Z);
+                            fprintf(statsFile, "%" PRIu64 ",", recordedCounters[perf.GPUTimeElapsedIdx].uint64);
+                            fprintf(statsFile, "%" PRIu64 ",", recordedCounters[perf.CSThreadsDispatchedIdx].uint64);
+                            fprintf(statsFile, "%" PRIu64 ",", recordedCountersPipeline[0]);
+                            fprintf(statsFile, "%" PRIu64 ",", recordedCountersPipeline[0] / recordedCounters[perf.CSThreadsDispatchedIdx].uint64);
+                            fprintf(statsFile, "%d,", (int)(recordedCounters[perf.EUThreadOccupaccyIdx].float32));
+                            fprintf(statsFile, "%" PRIu64 ",", cpu_time_ns);
+                            fprintf(statsFile, "%s,", variant->name);
+                            fprintf(statsFile, "%u\n", COARSEN);
+                        } else {
+                            printf("EU Thread Occupancy:   %f %%\n", recordedCounters[perf.EUThreadOccupaccyIdx].float32);
+                            printf("CS Threads Dispatched: %" PRIu64 "\n", recordedCounters[perf.CSThreadsDispatchedIdx].uint64);
+                            printf("GPU Time Elapsed:      %" PRIu64 " ns\n", recordedCounters[perf.GPUTimeElapsedIdx].uint64);
+                            printf("CS Invocations:        %" PRIu64 "\n", recordedCountersPipeline[0]);
+                            printf("CPU Time Elapsed:      %" PRIu64 " ns\n", cpu_time_ns);
+                            if (kernel_variant_define(variant, "PERSISTENT"))
+                                printf("Persistent Workgroups: %u\n", persistentGroups);
+                        }
                     }
+                } else {
+                    runCommandBuffer(&commandBuffers[1], NULL);
                 }
-            } else {
-                runCommandBuffer(&commandBuffers[1], NULL);
             }
+
+            if (perf.enabled && !perf.show_csv) {
+                printf("Average GPU Time Elapsed:      %" PRIu64 " ns\n", overall_gpu_time / average);
+                printf("Average CPU Time Elapsed:      %" PRIu64 " ns\n", overall_cpu_time / average);
+            }
+
+            if (variant->pixel == PIXEL_SUBGROUP_STATS)
+                printSubgroupStats();
+
+            if (numVariants * numCoarsen > 1)
+                printColorError(reference);
+
+            char suffix[64] = "";
+            if (numVariants > 1)
+                snprintf(suffix, sizeof(suffix), "_%s", variant->name);
+            if (numCoarsen > 1)
+                snprintf(suffix + strlen(suffix), sizeof(suffix) - strlen(suffix), "_c%u", COARSEN);
+            if (configs.size() > 1)
+                snprintf(suffix + strlen(suffix), sizeof(suffix) - strlen(suffix), "_%dx%dx%d",
+                        WORKGROUP_SIZE_X, WORKGROUP_SIZE_Y, WORKGROUP_SIZE_Z);
+
+            if (instrument)
+                saveInstrumentation(suffix);
+
+            // The former command rendered a mandelbrot set to a buffer.
+            // Hand it over to the writer, which saves it as a png on disk.
+            if (output.mode != OUTPUT_STATS)
+                saveRenderedImage(writer, suffix);
+
+            destroyComputePipeline();
         }
 
         if (perf.enabled) {
@@ -325,32 +425,73 @@ public:
             assert(vkReleaseProfilingLockKHR != NULL);
 
             vkReleaseProfilingLockKHR(device);
-
-            if (perf.show_csv) {
-                // taking average is on the user's side
-            } else {
-                printf("Average GPU Time Elapsed:      %lu ns\n", overall_gpu_time / average);
-                printf("Average CPU Time Elapsed:      %lu ns\n", overall_cpu_time / average);
-            }
         }
 
-        // The former command rendered a mandelbrot set to a buffer.
-        // Save that buffer as a png on disk.
-        saveRenderedImage();
+        int ret = output_writer_finish(writer);
+        color_reference_destroy(reference);
+        free(variants);
         if (rdoc_api)
             rdoc_api->EndFrameCapture(NULL, NULL);
 
         // Clean up all vulkan resources.
         cleanup();
+
+        return ret;
+    }
+
+    // how much of the time subgroups spent in the Mandelbrot loop their lanes did useful work
+    void printSubgroupStats() {
+        void* mappedMemory = NULL;
+        vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &mappedMemory);
+
+        struct subgroup_stats stats;
+        if (get_subgroup_stats((Pixel *)mappedMemory, WIDTH, HEIGHT, DEPTH, &stats)) {
+            printf("Subgroups:                %" PRIu64 "\n", stats.subgroups);
+            printf("Subgroup Lane Efficiency: %d %%\n",
+                    (int)(100 * stats.lane_iterations / stats.lane_slots));
+        }
+
+        vkUnmapMemory(device, bufferMemory);
     }
 
-    void saveRenderedImage() {
+    // how far the colours are from the ones of bruteforce, if that ran before
+    void printColorError(struct color_reference *reference) {
+        void* mappedMemory = NULL;
+        vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &mappedMemory);
+
+        struct color_error err;
+        if (color_reference_check(reference, variant, (Pixel *)mappedMemory, WIDTH, HEIGHT, DEPTH, &err))
+            printf("Colour Error vs bruteforce: max %f, mean %g, %" PRIu64 " pixels differ\n",
+                    err.max, err.mean, err.pixels);
+
+        vkUnmapMemory(device, bufferMemory);
+    }
+
+    // the samples of INSTRUMENT, zeroed before the first dispatch of the configuration
+    void clearInstrumentation() {
+        void* mappedMemory = NULL;
+        vkMapMemory(device, samplesBufferMemory, 0, samplesSize, 0, &mappedMemory);
+        memset(mappedMemory, 0, samplesSize);
+        vkUnmapMemory(device, samplesBufferMemory);
+    }
+
+    void saveInstrumentation(const char *suffix) {
+        void* mappedMemory = NULL;
+        vkMapMemory(device, samplesBufferMemory, 0, samplesSize, 0, &mappedMemory);
+        if (save_instrumentation((instrument_sample *)mappedMemory,
+                    samplesSize / sizeof(instrument_sample), suffix))
+            throw std::runtime_error("could not write the instrumentation samples");
+        vkUnmapMemory(device, samplesBufferMemory);
+    }
+
+    void saveRenderedImage(struct output_writer *writer, const char *suffix) {
         void* mappedMemory = NULL;
         // Map the buffer memory, so that we can read from it on the CPU.
         vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &mappedMemory);
         Pixel *pmappedMemory = (Pixel *)mappedMemory;
 
-        save_data(pmappedMemory, WIDTH, HEIGHT, DEPTH);
+        // With an asynchronous writer this only copies the data out.
+        output_writer_submit(writer, pmappedMemory, WIDTH, HEIGHT, DEPTH, suffix);
 
         // Done reading, so unmap.
         vkUnmapMemory(device, bufferMemory);
@@ -684,6 +825,30 @@ public:
                 subgroupProperties.subgroupSize);
 #endif
 
+        bool subgroupOps = false, halfFloat = false;
+        for (unsigned i = 0; i < numVariants; ++i) {
+            subgroupOps |= kernel_variant_define(&variants[i], "SUBGROUP_OPS") != 0;
+            halfFloat |= kernel_variant_define(&variants[i], "HALF_FLOAT") != 0;
+        }
+
+        // INSTRUMENT records the ballot of the lanes with a pixel
+        if (subgroupOps || instrument) {
+            VkPhysicalDeviceSubgroupProperties subgroupProperties = {};
+            subgroupProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+
+            VkPhysicalDeviceProperties2 physicalDeviceProperties = {};
+            physicalDeviceProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+            physicalDeviceProperties.pNext = &subgroupProperties;
+
+            vkGetPhysicalDeviceProperties2(physicalDevice, &physicalDeviceProperties);
+            bool compute = subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT;
+            VkSubgroupFeatureFlags needed = VK_SUBGROUP_FEATURE_BALLOT_BIT | VK_SUBGROUP_FEATURE_ARITHMETIC_BIT;
+            if (subgroupOps && ((subgroupProperties.supportedOperations & needed) != needed || !compute))
+                throw std::runtime_error("SUBGROUP_OPS needs subgroup ballot and arithmetic in compute shaders");
+            if (instrument && (!(subgroupProperties.supportedOperations & VK_SUBGROUP_FEATURE_BALLOT_BIT) || !compute))
+                throw std::runtime_error("INSTRUMENT needs subgroup ballot in compute shaders");
+        }
+
         /*
         We create the logical device in this function.
         */
@@ -721,10 +886,10 @@ public:
                 VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PERFORMANCE_QUERY_FEATURES_KHR,
         };
 
+        std::vector<const char *> extensions;
+
         if (perf.enabled) {
-            const char *ext_names[] = { VK_KHR_PERFORMANCE_QUERY_EXTENSION_NAME };
-            deviceCreateInfo.ppEnabledExtensionNames = ext_names;
-            deviceCreateInfo.enabledExtensionCount = 1;
+            extensions.push_back(VK_KHR_PERFORMANCE_QUERY_EXTENSION_NAME);
 
             VkPhysicalDeviceFeatures2 features;
             features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
@@ -737,6 +902,50 @@ public:
             deviceCreateInfo.pNext = &perfFeatures;
         }
 
+        // float16_t arithmetic in shaders, core since Vulkan 1.2
+        VkPhysicalDeviceShaderFloat16Int8Features float16Features = {
+                VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_FLOAT16_INT8_FEATURES,
+        };
+
+        if (halfFloat) {
+            VkPhysicalDeviceFeatures2 features = {};
+            features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            features.pNext = &float16Features;
+
+            vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+            if (!float16Features.shaderFloat16)
+                throw std::runtime_error("HALF_FLOAT needs the shaderFloat16 feature");
+
+            float16Features.shaderInt8 = VK_FALSE;
+            float16Features.pNext = (void *)deviceCreateInfo.pNext;
+            deviceCreateInfo.pNext = &float16Features;
+        }
+
+        // clock2x32ARB() of INSTRUMENT reads the subgroup clock
+        VkPhysicalDeviceShaderClockFeaturesKHR clockFeatures = {
+                VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_CLOCK_FEATURES_KHR,
+        };
+
+        if (instrument) {
+            VkPhysicalDeviceFeatures2 features = {};
+            features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            features.pNext = &clockFeatures;
+
+            vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+            if (!clockFeatures.shaderSubgroupClock)
+                throw std::runtime_error("INSTRUMENT needs VK_KHR_shader_clock with shaderSubgroupClock");
+
+            extensions.push_back(VK_KHR_SHADER_CLOCK_EXTENSION_NAME);
+            clockFeatures.shaderDeviceClock = VK_FALSE;
+            clockFeatures.pNext = (void *)deviceCreateInfo.pNext;
+            deviceCreateInfo.pNext = &clockFeatures;
+        }
+
+        deviceCreateInfo.ppEnabledExtensionNames = extensions.data();
+        deviceCreateInfo.enabledExtensionCount = extensions.size();
+
         VK_CHECK_RESULT(vkCreateDevice(physicalDevice, &deviceCreateInfo, NULL, &device)); // create logical device.
 
         // Get a handle to the only member of the queue family.
@@ -832,6 +1041,30 @@ public:
         
         // Now associate that allocated memory with the buffer. With that, the buffer is backed by actual memory. 
         VK_CHECK_RESULT(vkBindBufferMemory(device, buffer, bufferMemory, 0));
+
+        // only the GPU accesses the counter, vkCmdFillBuffer zeroes it
+        bufferCreateInfo.size = sizeof(uint32_t);
+        bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        VK_CHECK_RESULT(vkCreateBuffer(device, &bufferCreateInfo, NULL, &queueBuffer));
+
+        vkGetBufferMemoryRequirements(device, queueBuffer, &memoryRequirements);
+        allocateInfo.allocationSize = memoryRequirements.size;
+        allocateInfo.memoryTypeIndex = findMemoryType(
+            memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        VK_CHECK_RESULT(vkAllocateMemory(device, &allocateInfo, NULL, &queueBufferMemory));
+        VK_CHECK_RESULT(vkBindBufferMemory(device, queueBuffer, queueBufferMemory, 0));
+
+        // the samples are read like the image
+        bufferCreateInfo.size = samplesSize;
+        bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+        VK_CHECK_RESULT(vkCreateBuffer(device, &bufferCreateInfo, NULL, &samplesBuffer));
+
+        vkGetBufferMemoryRequirements(device, samplesBuffer, &memoryRequirements);
+        allocateInfo.allocationSize = memoryRequirements.size;
+        allocateInfo.memoryTypeIndex = findMemoryType(
+            memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+        VK_CHECK_RESULT(vkAllocateMemory(device, &allocateInfo, NULL, &samplesBufferMemory));
+        VK_CHECK_RESULT(vkBindBufferMemory(device, samplesBuffer, samplesBufferMemory, 0));
     }
 
     void createDescriptorSetLayout() {
@@ -847,18 +1080,21 @@ public:
 
           layout(std140, binding = 0) buffer buf
 
-        in the compute shader.
+        in the compute shader, binding point 1 to the queue buffer of PERSISTENT variants and 2 to
+        the samples of INSTRUMENT, which the other shaders don't declare.
         */
-        VkDescriptorSetLayoutBinding descriptorSetLayoutBinding = {};
-        descriptorSetLayoutBinding.binding = 0; // binding = 0
-        descriptorSetLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        descriptorSetLayoutBinding.descriptorCount = 1;
-        descriptorSetLayoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[3] = {};
+        for (uint32_t i = 0; i < 3; ++i) {
+            descriptorSetLayoutBindings[i].binding = i;
+            descriptorSetLayoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorSetLayoutBindings[i].descriptorCount = 1;
+            descriptorSetLayoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
 
         VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
         descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-        descriptorSetLayoutCreateInfo.bindingCount = 1; // only a single binding in this descriptor set layout. 
-        descriptorSetLayoutCreateInfo.pBindings = &descriptorSetLayoutBinding; 
+        descriptorSetLayoutCreateInfo.bindingCount = 3;
+        descriptorSetLayoutCreateInfo.pBindings = descriptorSetLayoutBindings;
 
         // Create the descriptor set layout. 
         VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorSetLayoutCreateInfo, NULL, &descriptorSetLayout));
@@ -871,11 +1107,11 @@ public:
         */
 
         /*
-        Our descriptor pool can only allocate a single storage buffer.
+        Our descriptor pool can only allocate the three storage buffers.
         */
         VkDescriptorPoolSize descriptorPoolSize = {};
         descriptorPoolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        descriptorPoolSize.descriptorCount = 1;
+        descriptorPoolSize.descriptorCount = 3;
 
         VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
         descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -903,22 +1139,30 @@ public:
         We use vkUpdateDescriptorSets() to update the descriptor set.
         */
 
-        // Specify the buffer to bind to the descriptor.
-        VkDescriptorBufferInfo descriptorBufferInfo = {};
-        descriptorBufferInfo.buffer = buffer;
-        descriptorBufferInfo.offset = 0;
-        descriptorBufferInfo.range = bufferSize;
-
-        VkWriteDescriptorSet writeDescriptorSet = {};
-        writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        writeDescriptorSet.dstSet = descriptorSet; // write to this descriptor set.
-        writeDescriptorSet.dstBinding = 0; // write to the first, and only binding.
-        writeDescriptorSet.descriptorCount = 1; // update a single descriptor.
-        writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; // storage buffer.
-        writeDescriptorSet.pBufferInfo = &descriptorBufferInfo;
+        // Specify the buffers to bind to the descriptors.
+        VkDescriptorBufferInfo descriptorBufferInfos[3] = {};
+        descriptorBufferInfos[0].buffer = buffer;
+        descriptorBufferInfos[0].offset = 0;
+        descriptorBufferInfos[0].range = bufferSize;
+        descriptorBufferInfos[1].buffer = queueBuffer;
+        descriptorBufferInfos[1].offset = 0;
+        descriptorBufferInfos[1].range = sizeof(uint32_t);
+        descriptorBufferInfos[2].buffer = samplesBuffer;
+        descriptorBufferInfos[2].offset = 0;
+        descriptorBufferInfos[2].range = samplesSize;
+
+        VkWriteDescriptorSet writeDescriptorSets[3] = {};
+        for (uint32_t i = 0; i < 3; ++i) {
+            writeDescriptorSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writeDescriptorSets[i].dstSet = descriptorSet; // write to this descriptor set.
+            writeDescriptorSets[i].dstBinding = i;
+            writeDescriptorSets[i].descriptorCount = 1; // update a single descriptor.
+            writeDescriptorSets[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; // storage buffer.
+            writeDescriptorSets[i].pBufferInfo = &descriptorBufferInfos[i];
+        }
 
         // perform the update of the descriptor set.
-        vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, NULL);
+        vkUpdateDescriptorSets(device, 3, writeDescriptorSets, 0, NULL);
     }
 
     // Read file into array of bytes, and cast to uint32_t*, then return.
@@ -960,9 +1204,11 @@ public:
         Create a shader module. A shader module basically just encapsulates some shader code.
         */
         uint32_t filelength;
-        // the code in comp.spv was created by running the command:
-        // glslangValidator.exe -V shader.comp
-        uint32_t* code = readFile(filelength, "shaders/comp.spv");
+        // the code in comp_<variant>.spv was created by run_vulkan.sh, with
+        // the defines of the variant
+        char filename[128];
+        snprintf(filename, sizeof(filename), "shaders/comp_%s.spv", variant->name);
+        uint32_t* code = readFile(filelength, filename);
         VkShaderModuleCreateInfo createInfo = {};
         createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
         createInfo.pCode = code;
@@ -984,6 +1230,29 @@ public:
         shaderStageCreateInfo.module = computeShaderModule;
         shaderStageCreateInfo.pName = "main";
 
+        /*
+        The workgroup size is a specialization constant (local_size_x_id etc. in the shader),
+        so the same SPIR-V can be used for every configuration. So is the coarsening factor
+        (constant_id 3).
+        */
+        uint32_t specializationData[4] = {
+            (uint32_t)WORKGROUP_SIZE_X, (uint32_t)WORKGROUP_SIZE_Y, (uint32_t)WORKGROUP_SIZE_Z,
+            COARSEN
+        };
+        VkSpecializationMapEntry specializationMapEntries[4];
+        for (uint32_t i = 0; i < 4; ++i) {
+            specializationMapEntries[i].constantID = i;
+            specializationMapEntries[i].offset = i * sizeof(uint32_t);
+            specializationMapEntries[i].size = sizeof(uint32_t);
+        }
+
+        VkSpecializationInfo specializationInfo = {};
+        specializationInfo.mapEntryCount = 4;
+        specializationInfo.pMapEntries = specializationMapEntries;
+        specializationInfo.dataSize = sizeof(specializationData);
+        specializationInfo.pData = specializationData;
+        shaderStageCreateInfo.pSpecializationInfo = &specializationInfo;
+
         /*
         The pipeline layout allows the pipeline to access descriptor sets. 
         So we just specify the descriptor set layout we created earlier.
@@ -1008,6 +1277,12 @@ public:
             NULL, &pipeline));
     }
 
+    void destroyComputePipeline() {
+        vkDestroyShaderModule(device, computeShaderModule, NULL);
+        vkDestroyPipelineLayout(device, pipelineLayout, NULL);
+        vkDestroyPipeline(device, pipeline, NULL);
+    }
+
     void createCommandPool() {
         /*
         We are getting closer to the end. In order to send commands to the device(GPU),
@@ -1016,7 +1291,8 @@ public:
         */
         VkCommandPoolCreateInfo commandPoolCreateInfo = {};
         commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        commandPoolCreateInfo.flags = 0;
+        // command buffer for the dispatch is re-recorded for every configuration.
+        commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
         // the queue family of this command pool. All command buffers allocated from this command pool,
         // must be submitted to queues of this family ONLY.
         commandPoolCreateInfo.queueFamilyIndex = queueFamilyIndex;
@@ -1063,6 +1339,45 @@ public:
 //        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT; // the buffer is only submitted and used once in this application.
         VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffers[1], &beginInfo)); // start recording commands.
 
+        uint32_t groups[3] = {
+            (uint32_t)ceil(WIDTH / float(WORKGROUP_SIZE_X * COARSEN * kernel_variant_points(variant))),
+            (uint32_t)ceil(HEIGHT / float(WORKGROUP_SIZE_Y)),
+            (uint32_t)ceil(DEPTH / float(WORKGROUP_SIZE_Z)),
+        };
+
+        /*
+        A PERSISTENT variant gets as many workgroups as the device keeps resident, which take the
+        groups of the grid as tiles from the queue buffer, zeroed first (after the atomics of the
+        previous submission).
+        */
+        if (kernel_variant_define(variant, "PERSISTENT")) {
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+            persistentGroups = get_persistent_groups(NULL,
+                    WORKGROUP_SIZE_X * WORKGROUP_SIZE_Y * WORKGROUP_SIZE_Z,
+                    groups[0] * groups[1] * groups[2],
+                    properties.limits.maxComputeWorkGroupCount[0]);
+            groups[0] = persistentGroups;
+            groups[1] = groups[2] = 1;
+
+            VkMemoryBarrier barrier = {};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            vkCmdPipelineBarrier(commandBuffers[1],
+              VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+              0, 1, &barrier, 0, NULL, 0, NULL);
+
+            vkCmdFillBuffer(commandBuffers[1], queueBuffer, 0, sizeof(uint32_t), 0);
+
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            vkCmdPipelineBarrier(commandBuffers[1],
+              VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+              0, 1, &barrier, 0, NULL, 0, NULL);
+        }
+
         if (perf.enabled) {
             vkCmdBeginQuery(commandBuffers[1], perf.queryPoolKHR, 0, 0);
             vkCmdBeginQuery(commandBuffers[1], perf.queryPoolPipeline, 0, 0);
@@ -1081,10 +1396,7 @@ public:
         The number of workgroups is specified in the arguments.
         If you are already familiar with compute shaders from OpenGL, this should be nothing new to you.
         */
-        vkCmdDispatch(commandBuffers[1],
-                (uint32_t)ceil(WIDTH / float(WORKGROUP_SIZE_X)),
-                (uint32_t)ceil(HEIGHT / float(WORKGROUP_SIZE_Y)),
-                (uint32_t)ceil(DEPTH / float(WORKGROUP_SIZE_Z)));
+        vkCmdDispatch(commandBuffers[1], groups[0], groups[1], groups[2]);
 
         if (perf.enabled) {
             vkCmdPipelineBarrier(commandBuffers[1],
@@ -1154,11 +1466,12 @@ public:
 
         vkFreeMemory(device, bufferMemory, NULL);
         vkDestroyBuffer(device, buffer, NULL);	
-        vkDestroyShaderModule(device, computeShaderModule, NULL);
+        vkFreeMemory(device, queueBufferMemory, NULL);
+        vkDestroyBuffer(device, queueBuffer, NULL);
+        vkFreeMemory(device, samplesBufferMemory, NULL);
+        vkDestroyBuffer(device, samplesBuffer, NULL);
         vkDestroyDescriptorPool(device, descriptorPool, NULL);
         vkDestroyDescriptorSetLayout(device, descriptorSetLayout, NULL);
-        vkDestroyPipelineLayout(device, pipelineLayout, NULL);
-        vkDestroyPipeline(device, pipeline, NULL);
         vkDestroyCommandPool(device, commandPool, NULL);	
         if (perf.enabled) {
             vkDestroyQueryPool(device, perf.queryPoolKHR, NULL);
@@ -1170,26 +1483,33 @@ public:
 };
 
 int main(int argc, char *argv[]) {
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s IMG_WIDTH IMG_HEIGHT IMG_DEPTH GROUP_X GROUP_Y GROUP_Z\n", argv[0]);
+    if (argc < 7 || (argc - 4) % 3 != 0) {
+        fprintf(stderr, "Usage: %s IMG_WIDTH IMG_HEIGHT IMG_DEPTH GROUP_X GROUP_Y GROUP_Z [GROUP_X GROUP_Y GROUP_Z]...\n", argv[0]);
         exit(1);
     }
 
     WIDTH = atoi(argv[1]);
     HEIGHT = atoi(argv[2]);
     DEPTH = atoi(argv[3]);
-    WORKGROUP_SIZE_X = atoi(argv[4]);
-    WORKGROUP_SIZE_Y = atoi(argv[5]);
-    WORKGROUP_SIZE_Z = atoi(argv[6]);
 
-    if (WORKGROUP_SIZE_X == 0 || WORKGROUP_SIZE_Y == 0 || WORKGROUP_SIZE_Z == 0||
-            WIDTH == 0 || HEIGHT == 0 || DEPTH == 0)
+    if (WIDTH == 0 || HEIGHT == 0 || DEPTH == 0)
         abort();
 
+    for (int i = 4; i < argc; i += 3) {
+        WorkgroupSize cfg;
+        cfg.x = atoi(argv[i + 0]);
+        cfg.y = atoi(argv[i + 1]);
+        cfg.z = atoi(argv[i + 2]);
+        if (cfg.x == 0 || cfg.y == 0 || cfg.z == 0)
+            abort();
+        configs.push_back(cfg);
+    }
+
     ComputeApplication app;
 
     try {
-        app.run();
+        if (app.run())
+            return EXIT_FAILURE;
     }
     catch (const std::runtime_error& e) {
         printf("%s\n", e.what());
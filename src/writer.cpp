@@ -0,0 +1,134 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "shared.h"
+
+/* number of copied buffers waiting for the writer thread, submit() blocks
+ * when this many are already queued */
+#define MAX_PENDING 1
+
+struct output_job {
+    std::vector<struct Pixel> data;
+    int width, height, depth;
+    std::string suffix;
+};
+
+struct output_writer {
+    struct output_opts opts;
+    bool async;
+    int ret;
+
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<output_job *> pending;
+    /* buffers already written, kept around to avoid reallocating (and
+     * faulting in) a buffer of the same size for every configuration */
+    std::vector<output_job *> free;
+    bool done;
+};
+
+static void
+writer_thread(struct output_writer *writer)
+{
+    std::unique_lock<std::mutex> l(writer->lock);
+
+    for (;;) {
+        while (writer->pending.empty() && !writer->done)
+            writer->cond.wait(l);
+        if (writer->pending.empty())
+            break;
+
+        output_job *job = writer->pending.front();
+        writer->pending.pop_front();
+        writer->cond.notify_all();
+        l.unlock();
+
+        int ret = save_data(job->data.data(), job->width, job->height, job->depth,
+                &writer->opts, job->suffix.c_str());
+
+        l.lock();
+        writer->ret |= ret;
+        writer->free.push_back(job);
+        writer->cond.notify_all();
+    }
+}
+
+struct output_writer *
+output_writer_create(const struct output_opts *opts, int async)
+{
+    struct output_writer *writer = new output_writer;
+
+    writer->opts = *opts;
+    writer->async = opts->async >= 0 ? opts->async > 0 : async != 0;
+    writer->ret = 0;
+    writer->done = false;
+
+    if (writer->async)
+        writer->thread = std::thread(writer_thread, writer);
+
+    return writer;
+}
+
+void
+output_writer_submit(struct output_writer *writer, const struct Pixel *data,
+        int width, int height, int depth, const char *suffix)
+{
+    if (!writer->async) {
+        writer->ret |= save_data(data, width, height, depth, &writer->opts, suffix);
+        return;
+    }
+
+    size_t count = (size_t)width * height * depth;
+    output_job *job = NULL;
+
+    {
+        std::unique_lock<std::mutex> l(writer->lock);
+        while (writer->pending.size() >= MAX_PENDING)
+            writer->cond.wait(l);
+
+        if (!writer->free.empty()) {
+            job = writer->free.back();
+            writer->free.pop_back();
+        }
+    }
+
+    if (!job)
+        job = new output_job;
+
+    job->data.resize(count);
+    memcpy(job->data.data(), data, count * sizeof(struct Pixel));
+    job->width = width;
+    job->height = height;
+    job->depth = depth;
+    job->suffix = suffix ? suffix : "";
+
+    std::unique_lock<std::mutex> l(writer->lock);
+    writer->pending.push_back(job);
+    writer->cond.notify_all();
+}
+
+int
+output_writer_finish(struct output_writer *writer)
+{
+    if (writer->async) {
+        {
+            std::unique_lock<std::mutex> l(writer->lock);
+            writer->done = true;
+            writer->cond.notify_all();
+        }
+        writer->thread.join();
+    }
+
+    for (output_job *job : writer->free)
+        delete job;
+
+    int ret = writer->ret;
+    delete writer;
+    return ret;
+}
@@ -0,0 +1,232 @@
+/*
+Checks the checksums of lodepng.cpp against byte-at-a-time loops on random
+buffers: update_adler32() and its SSE2/AVX2/NEON kernels, lodepng_crc32()
+(dispatched at runtime to PCLMULQDQ or the ARMv8 CRC instructions) and the
+slice-by-8 loop it falls back to. Lengths 0..LENGTHS, lengths around and far
+above the 5550 byte block of the adler sums and the 128 byte threshold of the
+CRC folding, all at unaligned starts. Also round trips zlib streams at every
+compression level, including empty input, and checks that oversubscribed
+Huffman codes are rejected. lodepng.cpp is included to reach its static
+functions. Returns non-zero if anything differs.
+*/
+#include "../src/lodepng.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// every length up to this one is checked at a few starts
+#define LENGTHS 1100
+
+static unsigned failures;
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t
+xorshift(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// the scalar adler, reducing after every byte
+static unsigned
+adler32_reference(unsigned adler, const unsigned char *data, size_t len)
+{
+    unsigned s1 = adler & 0xffff, s2 = adler >> 16;
+    for (size_t i = 0; i < len; ++i) {
+        s1 = (s1 + data[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    return s2 << 16 | s1;
+}
+
+// the byte table loop lodepng used before slice-by-8
+static unsigned
+crc32_reference(const unsigned char *data, size_t len)
+{
+    unsigned r = 0xffffffffu;
+    for (size_t i = 0; i < len; ++i)
+        r = lodepng_crc32_table[0][(r ^ data[i]) & 0xff] ^ (r >> 8);
+    return r ^ 0xffffffffu;
+}
+
+static void
+check(const char *what, size_t offset, size_t len, unsigned got, unsigned expected)
+{
+    if (got == expected)
+        return;
+    if (failures++ < 20)
+        fprintf(stderr, "%s: offset %zu length %zu: 0x%08x instead of 0x%08x\n",
+                what, offset, len, got, expected);
+}
+
+typedef void (*adler32_kernel)(unsigned *s1, unsigned *s2, const unsigned char *data, unsigned len);
+
+// a SIMD kernel on the whole multiple of 32 bytes of len, the remainder isn't its job
+static void
+check_adler32_kernel(const char *what, adler32_kernel kernel, unsigned adler,
+        const unsigned char *data, size_t offset, size_t len)
+{
+    unsigned amount = len & ~31u;
+    unsigned s1 = adler & 0xffff, s2 = adler >> 16;
+    kernel(&s1, &s2, data + offset, amount);
+    check(what, offset, amount, s2 << 16 | s1, adler32_reference(adler, data + offset, amount));
+}
+
+static void
+check_buffer(const unsigned char *data, size_t offset, size_t len)
+{
+    const unsigned char *p = data + offset;
+
+    // a valid running adler, as the multithreaded compressor chains them
+    unsigned adler = (xorshift() % 65521) << 16 | xorshift() % 65521;
+    check("update_adler32", offset, len,
+            update_adler32(adler, p, len), adler32_reference(adler, p, len));
+    check("adler32", offset, len, adler32(p, len), adler32_reference(1, p, len));
+
+#if defined(LODEPNG_SIMD_X86)
+    if (__builtin_cpu_supports("sse2"))
+        check_adler32_kernel("update_adler32_sse2", update_adler32_sse2, adler, data, offset, len);
+    if (__builtin_cpu_supports("avx2"))
+        check_adler32_kernel("update_adler32_avx2", update_adler32_avx2, adler, data, offset, len);
+#elif defined(LODEPNG_SIMD_NEON)
+    check_adler32_kernel("update_adler32_neon", update_adler32_neon, adler, data, offset, len);
+#endif
+
+    unsigned crc = crc32_reference(p, len);
+    check("lodepng_crc32", offset, len, lodepng_crc32(p, len), crc);
+    check("lodepng_crc32_slice8", offset, len,
+            lodepng_crc32_slice8(0xffffffffu, p, len) ^ 0xffffffffu, crc);
+
+    // the hardware paths on their own, also below the lengths lodepng_crc32 uses them for
+#if defined(LODEPNG_SIMD_X86)
+    size_t blocks = len & ~(size_t)15;
+    if (blocks >= 64 && __builtin_cpu_supports("pclmul"))
+        check("lodepng_crc32_pclmul", offset, blocks,
+                lodepng_crc32_pclmul(0xffffffffu, p, blocks) ^ 0xffffffffu,
+                crc32_reference(p, blocks));
+#elif defined(LODEPNG_SIMD_ARM_CRC32) && !defined(LODEPNG_SIMD_ARM_CRC32_HWCAP)
+    check("lodepng_crc32_arm", offset, len,
+            lodepng_crc32_arm(0xffffffffu, p, len) ^ 0xffffffffu, crc);
+#endif
+}
+
+// a table of codes given directly, in reading order, so that they can overlap
+static unsigned
+huffman_table(const unsigned *lengths, const unsigned *codes, unsigned numcodes)
+{
+    HuffmanTree tree;
+    HuffmanTree_init(&tree);
+    tree.numcodes = numcodes;
+    tree.maxbitlen = 15;
+    tree.lengths = (unsigned *)lodepng_malloc(numcodes * sizeof(unsigned));
+    tree.tree1d = (unsigned *)lodepng_malloc(numcodes * sizeof(unsigned));
+    for (unsigned i = 0; i < numcodes; ++i) {
+        tree.lengths[i] = lengths[i];
+        tree.tree1d[i] = reverseBits(codes[i], lengths[i]);
+    }
+    unsigned error = HuffmanTree_makeTable(&tree);
+    HuffmanTree_cleanup(&tree);
+    return error;
+}
+
+// oversubscribed codes fail with 55 in either level of the decoding table
+static void
+check_huffman_tables(void)
+{
+    // complete: 0, 10, 110, ..., 1111111110 (9 ones and a 0), 11111111110, 11111111111
+    unsigned lengths[13], codes[13];
+    for (unsigned i = 0; i < 10; ++i) {
+        lengths[i] = i + 1;
+        codes[i] = ((1u << i) - 1) << 1;
+    }
+    lengths[10] = lengths[11] = lengths[12] = 11;
+    codes[10] = 0x7fe;
+    codes[11] = 0x7ff;
+    check("HuffmanTree_makeTable complete", 0, 12, huffman_table(lengths, codes, 12), 0);
+
+    // a short code that is a prefix of another in the first table
+    codes[1] = 0;
+    check("HuffmanTree_makeTable first level", 0, 12, huffman_table(lengths, codes, 12), 55);
+    codes[1] = 2;
+
+    // 1111111110 is also a prefix of 11111111100, in the same second table,
+    // which is otherwise completely filled
+    codes[12] = 0x7fc;
+    check("HuffmanTree_makeTable second level", 0, 13, huffman_table(lengths, codes, 13), 55);
+    // two equal 11 bit codes, which fill the table too
+    codes[12] = 0x7ff;
+    check("HuffmanTree_makeTable duplicate", 0, 13, huffman_table(lengths, codes, 13), 55);
+}
+
+// zlib round trip at every level, including empty input and the 65535 byte stored blocks
+static void
+check_zlib(const unsigned char *data, size_t len)
+{
+    for (unsigned level = 0; level <= 9; ++level) {
+        LodePNGCompressSettings settings;
+        lodepng_compress_settings_init(&settings);
+        lodepng_compress_settings_level(&settings, level);
+
+        unsigned char *compressed = NULL, *decompressed = NULL;
+        size_t compressed_size = 0, decompressed_size = 0;
+        unsigned error = lodepng_zlib_compress(&compressed, &compressed_size, data, len, &settings);
+        if (!error)
+            error = lodepng_zlib_decompress(&decompressed, &decompressed_size,
+                    compressed, compressed_size, &lodepng_default_decompress_settings);
+        if (error || decompressed_size != len || (len && memcmp(decompressed, data, len))) {
+            if (failures++ < 20)
+                fprintf(stderr, "zlib level %u: length %zu: error %u, %zu bytes back\n",
+                        level, len, error, decompressed_size);
+        }
+        free(compressed);
+        free(decompressed);
+    }
+}
+
+int
+main(void)
+{
+    const size_t max_len = (1 << 20) + 37;
+    std::vector<unsigned char> buffer(max_len + 64);
+    for (size_t i = 0; i < buffer.size(); ++i)
+        buffer[i] = xorshift() >> 24;
+    // 64-byte aligned, so that offset is the misalignment
+    unsigned char *data = buffer.data() + (64 - (uintptr_t)buffer.data() % 64) % 64;
+
+    for (size_t len = 0; len <= LENGTHS; ++len)
+        check_buffer(data, len % 32, len);
+
+    // around the block of the adler sums and its multiples
+    const size_t edges[] = { 5549, 5550, 5551, 5552, 11099, 11100, 11101, 16650, 16651 };
+    for (size_t e : edges) {
+        for (size_t offset = 0; offset < 32; offset += 5)
+            check_buffer(data, offset, e);
+    }
+
+    for (int i = 0; i < 300; ++i)
+        check_buffer(data, xorshift() % 64, xorshift() % 20000);
+
+    // long runs of 0xff, where the sums grow fastest
+    std::vector<unsigned char> ones(max_len + 64, 0xff);
+    check_buffer(ones.data(), 3, 3 * 5550 + 17);
+    check_buffer(ones.data(), 1, max_len);
+    check_buffer(data, 7, max_len);
+
+    check_huffman_tables();
+
+    const size_t zlib_lengths[] = { 0, 1, 1000, 65535, 65536, 200000 };
+    for (size_t len : zlib_lengths)
+        check_zlib(data, len);
+
+    if (failures) {
+        fprintf(stderr, "%u checks failed\n", failures);
+        return 1;
+    }
+    printf("checksums, zlib round trips and huffman tables match\n");
+    return 0;
+}
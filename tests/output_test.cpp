@@ -0,0 +1,122 @@
+/*
+Writes data.csv of small images with OUTPUT_DELTA through the mmap sink and
+compares it with the stdio sink, which doesn't precompute the size of the
+file. With a single pixel, or a constant image, every column is modelled and
+a row is only its newline. Runs in a temporary directory, returns non-zero if
+anything differs.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../src/shared.h"
+
+static unsigned failures;
+
+static std::string
+read_file(const char *name)
+{
+    std::string s;
+    FILE *f = fopen(name, "rb");
+    if (!f)
+        return s;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        s.append(buf, n);
+    fclose(f);
+    return s;
+}
+
+// one workgroup of width x height, all pixels of the same colour
+static std::vector<Pixel>
+constant_image(int width, int height, int depth)
+{
+    std::vector<Pixel> data((size_t)width * height * depth);
+    for (size_t i = 0; i < data.size(); ++i) {
+        struct Pixel *p = &data[i];
+        memset(p, 0, sizeof(*p));
+        uint32_t x = i % width, y = i / width % height, z = i / ((size_t)width * height);
+        p->r = 0.25f;
+        p->g = 0.5f;
+        p->b = 0.75f;
+        p->a = 1.0f;
+        p->numWorkGroups = { 1, 1, (uint32_t)depth, 0 };
+        p->workGroupSize = { (uint32_t)width, (uint32_t)height, 1, 0 };
+        p->workGroupID = { 0, 0, z, 0 };
+        p->localInvocationID = { x, y, 0, 0 };
+        p->globalInvocationID = { x, y, z, 0 };
+        p->localInvocationIndex = { (uint32_t)(y * width + x), 0, 0, 0 };
+    }
+    return data;
+}
+
+static void
+check_image(int width, int height, int depth, unsigned threads)
+{
+    std::vector<Pixel> data = constant_image(width, height, depth);
+
+    struct output_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.mode = OUTPUT_FULL;
+    opts.delta = 1;
+    opts.level = -1;
+    opts.threads = threads;
+
+    opts.mmap = 0;
+    if (save_data(data.data(), width, height, depth, &opts, "_stdio")) {
+        fprintf(stderr, "%dx%dx%d: stdio sink failed\n", width, height, depth);
+        failures++;
+        return;
+    }
+    opts.mmap = 1;
+    if (save_data(data.data(), width, height, depth, &opts, "_mmap")) {
+        fprintf(stderr, "%dx%dx%d: mmap sink failed\n", width, height, depth);
+        failures++;
+        return;
+    }
+
+    std::string expected = read_file("data_stdio.csv"), got = read_file("data_mmap.csv");
+    size_t lines = 0;
+    for (char c : got)
+        lines += c == '\n';
+    if (got != expected || lines != data.size() + 1) {
+        fprintf(stderr, "%dx%dx%d, %u threads: %zu bytes, %zu lines instead of %zu bytes, %zu lines\n",
+                width, height, depth, threads, got.size(), lines, expected.size(),
+                data.size() + 1);
+        failures++;
+    }
+}
+
+int
+main(void)
+{
+    char dir[] = "/tmp/output_test.XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir)) {
+        perror(dir);
+        return 1;
+    }
+
+    check_image(1, 1, 1, 1);
+    check_image(1, 1, 1, 4);
+    check_image(4, 4, 1, 1);
+    check_image(4, 4, 1, 3);
+    check_image(8, 4, 2, 4);
+
+    const char *files[] = { "data_stdio.csv", "data_stdio_model.csv", "result_stdio.png",
+                            "data_mmap.csv", "data_mmap_model.csv", "result_mmap.png" };
+    for (const char *f : files)
+        unlink(f);
+    if (chdir("/") || rmdir(dir))
+        perror(dir);
+
+    if (failures) {
+        fprintf(stderr, "%u checks failed\n", failures);
+        return 1;
+    }
+    printf("mmap and stdio output match\n");
+    return 0;
+}